@@ -18,30 +18,50 @@
  * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
  * DEALINGS IN THE SOFTWARE. */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
 #include "cop/cop_filemap.h"
 #include "smplwav/smplwav_mount.h"
 #include "smplwav/smplwav_serialise.h"
 
+/* copy_file_range() first appeared in glibc 2.27. Define
+ * SAMPLEAUTH_NO_COPY_FILE_RANGE to always copy audio through user space. */
+#if defined(__linux__) && defined(__GLIBC__) && !defined(SAMPLEAUTH_NO_COPY_FILE_RANGE)
+#if (__GLIBC__ > 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27)
+#define SAMPLEAUTH_COPY_FILE_RANGE (1)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+#endif
+
 #define MAX_SET_ITEMS             (32)
+#define MAX_DIRECTORY_CHUNKS      (256)
 
 #define FLAG_STRIP_EVENT_METADATA (1)
 #define FLAG_WRITE_CUE_LOOPS      (2)
 #define FLAG_OUTPUT_METADATA      (4)
 #define FLAG_INPUT_METADATA       (8)
+#define FLAG_OUTPUT_INPLACE       (16)
 
 struct wavauth_options {
-	const char  *input_filename;
-	const char  *output_filename;
+	const char   *input_filename;
+	const char   *output_filename;
 
-	unsigned     flags;
-	unsigned     smplwav_flags;
+	unsigned      flags;
+	unsigned      smplwav_flags;
+	unsigned long data_alignment;
 
-	unsigned     nb_set_items;
-	char        *set_items[MAX_SET_ITEMS];
+	unsigned      nb_set_items;
+	char         *set_items[MAX_SET_ITEMS];
 };
 
 static int handle_options(struct wavauth_options *opts, char **argv, unsigned argc)
@@ -52,6 +72,7 @@ static int handle_options(struct wavauth_options *opts, char **argv, unsigned ar
 	opts->output_filename = NULL;
 	opts->flags           = 0;
 	opts->smplwav_flags   = 0;
+	opts->data_alignment  = 0;
 	opts->nb_set_items    = 0;
 
 	while (argc) {
@@ -106,6 +127,21 @@ static int handle_options(struct wavauth_options *opts, char **argv, unsigned ar
 			opts->set_items[opts->nb_set_items++] = *argv;
 			argv++;
 			argc--;
+		} else if (!strcmp(*argv, "--align-data")) {
+			char *end;
+			argv++;
+			argc--;
+			if (!argc) {
+				fprintf(stderr, "--align-data requires an argument.\n");
+				return -1;
+			}
+			opts->data_alignment = strtoul(*argv, &end, 10);
+			if (*end != '\0' || opts->data_alignment == 0 || opts->data_alignment > 0x80000000ul || (opts->data_alignment & (opts->data_alignment - 1))) {
+				fprintf(stderr, "--align-data requires a power of two.\n");
+				return -1;
+			}
+			argv++;
+			argc--;
 		} else if (!strcmp(*argv, "--output")) {
 			argv++;
 			argc--;
@@ -142,6 +178,7 @@ static int handle_options(struct wavauth_options *opts, char **argv, unsigned ar
 			return -1;
 		}
 		opts->output_filename = opts->input_filename;
+		opts->flags          |= FLAG_OUTPUT_INPLACE;
 	}
 
 
@@ -203,31 +240,244 @@ static void dump_metadata(const struct smplwav *wav)
 	}
 }
 
-void *serialise_sample(const struct smplwav *wav, size_t *xsz, int store_cue_loops) {
-	unsigned char *data;
-	size_t         sz;
-	int            err;
+void *serialise_sample(const struct smplwav *wav, size_t *xsz, int store_cue_loops, unsigned long data_alignment) {
+	static uint_fast32_t          marker_lengths[2 * SMPLWAV_MAX_MARKERS];
+	struct smplwav_serialise_plan plan;
+	unsigned char                *data;
+
+	assert(wav->nb_marker <= SMPLWAV_MAX_MARKERS);
 
-	/* Find size of entire wave file then allocate memory for it. */
-	if (smplwav_serialise(wav, NULL, &sz, store_cue_loops)) {
+	/* Find the layout of the entire wave file then allocate memory for it. */
+	if (smplwav_serialise_plan_aligned(&plan, wav, store_cue_loops, marker_lengths, data_alignment)) {
 		fprintf(stderr, "can not serialise the updated waveform\n");
 		return NULL;
 	}
-	if ((data = malloc(sz)) == NULL) {
+	if ((data = malloc(plan.size)) == NULL) {
 		fprintf(stderr, "out of memory\n");
 		return NULL;
 	}
 
 	/* Serialise the wave file to memory. */
-	err = smplwav_serialise(wav, data, xsz, store_cue_loops);
+	smplwav_serialise_emit(&plan, wav, data);
+	*xsz = plan.size;
+	return data;
+}
+
+#if defined(SAMPLEAUTH_COPY_FILE_RANGE)
+
+static int write_all(int fd, const unsigned char *data, size_t size)
+{
+	while (size) {
+		ssize_t w = write(fd, data, size);
+		if (w <= 0)
+			return -1;
+		data += w;
+		size -= (size_t)w;
+	}
+	return 0;
+}
+
+/* Writes the serialised wave to "output_filename" without building it in
+ * memory. The headers and metadata are written from a small buffer and the
+ * audio and unsupported chunks (which are views into the mapped input file)
+ * are moved by copy_file_range() so they never pass through user space (on
+ * btrfs and XFS the kernel shares the blocks instead of copying them). If
+ * the kernel can not copy between the two files, the rest of the output is
+ * written from the mapping.
+ *
+ * Returns zero on success, a positive value if nothing was written and the
+ * output must be produced in memory instead (for example, if the output is
+ * the input file) or a negative value if writing the output failed. */
+static int
+write_sample_copy_range
+	(const struct smplwav     *wav
+	,const struct cop_filemap *infile
+	,const char               *input_filename
+	,const char               *output_filename
+	,int                       store_cue_loops
+	,unsigned long             data_alignment
+	)
+{
+	static uint_fast32_t          marker_lengths[2 * SMPLWAV_MAX_MARKERS];
+	static struct smplwav_segment segments[SMPLWAV_SERIALISE_MAX_SEGMENTS(SMPLWAV_MAX_UNSUPPORTED_CHUNKS)];
+	struct smplwav_serialise_plan plan;
+	const unsigned char          *in_start = infile->ptr;
+	unsigned char                *metadata;
+	unsigned                      nb_segment;
+	unsigned                      i;
+	int                           in_fd;
+	int                           out_fd;
+	int                           use_copy = 1;
+	int                           err      = 0;
+	struct stat                   in_st;
+	struct stat                   out_st;
+
+	assert(wav->nb_marker <= SMPLWAV_MAX_MARKERS);
+	assert(wav->nb_unsupported <= SMPLWAV_MAX_UNSUPPORTED_CHUNKS);
+
+	if (smplwav_serialise_plan_aligned(&plan, wav, store_cue_loops, marker_lengths, data_alignment))
+		return 1;
+
+	if ((in_fd = open(input_filename, O_RDONLY)) < 0)
+		return 1;
+
+	/* The output is not truncated until we know that it is not the input. */
+	if ((out_fd = open(output_filename, O_WRONLY | O_CREAT, 0666)) < 0) {
+		close(in_fd);
+		return 1;
+	}
+
+	if  (   fstat(in_fd, &in_st)
+	    ||  fstat(out_fd, &out_st)
+	    ||  (in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino)
+	    ||  (metadata = malloc(plan.metadata_size)) == NULL
+	    ) {
+		close(out_fd);
+		close(in_fd);
+		return 1;
+	}
+
+	nb_segment = smplwav_serialise_segments(&plan, wav, metadata, segments);
+
+	if (ftruncate(out_fd, 0))
+		err = -1;
+
+	for (i = 0; err == 0 && i < nb_segment; i++) {
+		const unsigned char *data = segments[i].data;
+		size_t               size = segments[i].size;
+
+		/* Pieces which are not in the input file are generated. */
+		if (data < in_start || data >= in_start + infile->size) {
+			err = write_all(out_fd, data, size);
+			continue;
+		}
+
+		while (use_copy && size) {
+			loff_t  in_offset = data - in_start;
+			ssize_t copied    = copy_file_range(in_fd, &in_offset, out_fd, NULL, size, 0);
+			if (copied <= 0) {
+				use_copy = 0;
+				break;
+			}
+			data += copied;
+			size -= (size_t)copied;
+		}
+
+		err = write_all(out_fd, data, size);
+	}
+
+	free(metadata);
+	if (close(out_fd))
+		err = -1;
+	close(in_fd);
+	return err;
+}
+
+#endif
+
+/* Returns non-zero if rewriting the file would keep the same chunks as
+ * patching it. Patching keeps every chunk other than the metadata, but a
+ * rewrite drops unknown chunks unless they were preserved. */
+static int patch_keeps_chunks(const struct smplwav_chunk_directory *directory, unsigned smplwav_flags)
+{
+	unsigned i;
+
+	if (smplwav_flags & SMPLWAV_MOUNT_PRESERVE_UNKNOWN)
+		return 1;
+
+	for (i = 0; i < directory->nb_chunk; i++) {
+		switch (directory->chunks[i].id) {
+			case SMPLWAV_RIFF_ID('d', 's', '6', '4'):
+			case SMPLWAV_RIFF_ID('f', 'm', 't', ' '):
+			case SMPLWAV_RIFF_ID('f', 'a', 'c', 't'):
+			case SMPLWAV_RIFF_ID('d', 'a', 't', 'a'):
+			case SMPLWAV_RIFF_ID('c', 'u', 'e', ' '):
+			case SMPLWAV_RIFF_ID('s', 'm', 'p', 'l'):
+			case SMPLWAV_RIFF_ID('J', 'U', 'N', 'K'):
+			case SMPLWAV_RIFF_ID('j', 'u', 'n', 'k'):
+			case SMPLWAV_RIFF_ID('P', 'A', 'D', ' '):
+				break;
+			case SMPLWAV_RIFF_ID('L', 'I', 'S', 'T'):
+				if  (   directory->chunks[i].list_type != SMPLWAV_RIFF_ID('I', 'N', 'F', 'O')
+				    &&  directory->chunks[i].list_type != SMPLWAV_RIFF_ID('a', 'd', 't', 'l')
+				    )
+					return 0;
+				break;
+			default:
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Works out the writes which update the metadata of the mounted file in
+ * place. Returns the buffer which the writes refer to or NULL if the file
+ * must be rewritten instead. */
+static unsigned char *
+patch_sample
+	(const struct smplwav                 *wav
+	,const struct smplwav_chunk_directory *directory
+	,const unsigned char                  *header
+	,size_t                                file_size
+	,unsigned                              smplwav_flags
+	,int                                   store_cue_loops
+	,unsigned long                         data_alignment
+	,struct smplwav_patch_write           *writes
+	,unsigned                             *nb_write
+	)
+{
+	static uint_fast32_t          marker_lengths[2 * SMPLWAV_MAX_MARKERS];
+	struct smplwav_serialise_plan plan;
+	unsigned char                *data;
+	uint_fast64_t                 new_size;
+	const struct smplwav_chunk   *data_ck = smplwav_chunk_find(directory, SMPLWAV_RIFF_ID('d', 'a', 't', 'a'));
+
+	assert(wav->nb_marker <= SMPLWAV_MAX_MARKERS);
+
+	/* The audio does not move so it must already be aligned. */
+	if  (   !patch_keeps_chunks(directory, smplwav_flags)
+	    ||  data_ck == NULL
+	    ||  (data_alignment > 1 && data_ck->offset % data_alignment)
+	    ||  smplwav_serialise_plan(&plan, wav, store_cue_loops, marker_lengths)
+	    ||  (data = malloc(smplwav_serialise_patch_size(&plan, directory))) == NULL
+	    )
+		return NULL;
+
+	/* The writes are made with stdio which can neither shrink a file nor
+	 * seek beyond LONG_MAX. */
+	if  (   smplwav_serialise_patch(&plan, wav, directory, header, data, writes, nb_write, &new_size)
+	    ||  new_size < file_size
+	    ||  new_size > LONG_MAX
+	    ) {
+		free(data);
+		return NULL;
+	}
 
-	/* Serialise should always be successful if the size query was successful
-	* and the returned size should be identical to what was queried. */
-	assert(err == 0); (void)err;
-	assert(sz == *xsz);
 	return data;
 }
 
+static int apply_patch(const char *filename, const struct smplwav_patch_write *writes, unsigned nb_write)
+{
+	FILE    *f;
+	unsigned i;
+	int      err = 0;
+
+	if ((f = fopen(filename, "r+b")) == NULL)
+		return -1;
+
+	for (i = 0; err == 0 && i < nb_write; i++)
+		if  (   fseek(f, (long)writes[i].offset, SEEK_SET)
+		    ||  fwrite(writes[i].data, 1, writes[i].size, f) != writes[i].size
+		    )
+			err = -1;
+
+	if (fclose(f))
+		err = -1;
+
+	return err;
+}
+
 static int is_whitespace(char c)
 {
 	return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\r');
@@ -401,12 +651,22 @@ static int handle_loop(struct smplwav *wav, char *cmd_str)
 		return -1;
 	}
 
+	if (start > 0xFFFFFFFF) {
+		fprintf(stderr, "loops cannot start beyond the first 2^32 samples\n");
+		return -1;
+	}
+
 	if (duration > 0xFFFFFFFF || start + duration > wav->data_frames) {
 		fprintf(stderr, "the loop duration went beyond the end of the sample\n");
 		return -1;
 	}
 
-	if (wav->nb_marker >= SMPLWAV_MAX_MARKERS) {
+	if (start + duration - 1 > 0xFFFFFFFF) {
+		fprintf(stderr, "loops cannot end beyond the first 2^32 samples\n");
+		return -1;
+	}
+
+	if (wav->nb_marker >= wav->max_marker) {
 		fprintf(stderr, "cannot add another loop - too much marker metadata\n");
 		return -1;
 	}
@@ -442,7 +702,12 @@ static int handle_cue(struct smplwav *wav, char *cmd_str)
 		return -1;
 	}
 
-	if (wav->nb_marker >= SMPLWAV_MAX_MARKERS) {
+	if (start > 0xFFFFFFFF) {
+		fprintf(stderr, "cue markers cannot be placed beyond the first 2^32 samples\n");
+		return -1;
+	}
+
+	if (wav->nb_marker >= wav->max_marker) {
 		fprintf(stderr, "cannot add another loop - too much marker metadata\n");
 		return -1;
 	}
@@ -517,7 +782,8 @@ void print_usage(FILE *f, const char *pname)
 	fprintf(f, "    [ \"--output-inplace\" | ( \"--output\" ( filename ) ) ]\n");
 	fprintf(f, "    [ \"--output-metadata\" ] [ \"--reset\" ] [ \"--write-cue-loops\" ]\n");
 	fprintf(f, "    [ \"--prefer-cue-loops\" | \"--prefer-smpl-loops\" ]\n");
-	fprintf(f, "    [ \"--strip-event-metadata\" ] ( sample filename )\n\n");
+	fprintf(f, "    [ \"--strip-event-metadata\" ] [ \"--align-data\" ( bytes ) ]\n");
+	fprintf(f, "    ( sample filename )\n\n");
 	fprintf(f, "This tool is used to modify or repair the metadata associated with a sample. It\n");
 	fprintf(f, "operates according to the following flow:\n");
 	fprintf(f, "1) The sample is loaded. If \"--reset\" is specified, all known chunks which are\n");
@@ -574,7 +840,12 @@ void print_usage(FILE *f, const char *pname)
 	fprintf(f, "   the smpl chunk and markers will only be written to the cue chunk as this is\n");
 	fprintf(f, "   the most compatible form. If \"--write-cue-loops\" is specified, loops will\n");
 	fprintf(f, "   also be stored in the cue chunk. This may assist in checking them in editor\n");
-	fprintf(f, "   software.\n\n");
+	fprintf(f, "   software. When the file is updated in-place, only its metadata chunks are\n");
+	fprintf(f, "   rewritten (into the space of the old ones or at the end of the file) if\n");
+	fprintf(f, "   the rest of the file would be unchanged. If \"--align-data\" is given, a JUNK\n");
+	fprintf(f, "   chunk is inserted before the audio so that it starts at a multiple of the\n");
+	fprintf(f, "   given number of bytes (which must be a power of two, e.g. 4096) from the\n");
+	fprintf(f, "   start of the file. This allows the audio to be read with direct I/O.\n\n");
 	fprintf(f, "Examples:\n");
 	fprintf(f, "   %s --reset sample.wav --output-inplace\n", pname);
 	fprintf(f, "   Removes all non-essential wave chunks from sample.wav and overwrites the\n");
@@ -592,6 +863,14 @@ int main(int argc, char *argv[])
 	unsigned uerr;
 	struct cop_filemap infile;
 	struct smplwav wav;
+	struct smplwav_marker markers[SMPLWAV_MAX_MARKERS];
+	struct smplwav_extra_ck unsupported[SMPLWAV_MAX_UNSUPPORTED_CHUNKS];
+	struct smplwav_chunk_directory directory;
+	static struct smplwav_chunk chunks[MAX_DIRECTORY_CHUNKS];
+	static struct smplwav_patch_write patch_writes[SMPLWAV_PATCH_MAX_WRITES(MAX_DIRECTORY_CHUNKS)];
+	unsigned nb_patch_write = 0;
+	unsigned char *patch_data = NULL;
+	int written = 0;
 	unsigned i;
 	char *stdinbuf = NULL;
 	size_t stdinbufsz = 0;
@@ -612,7 +891,10 @@ int main(int argc, char *argv[])
 		return err;
 	}
 
-	if (SMPLWAV_ERROR_CODE(uerr = smplwav_mount(&wav, infile.ptr, infile.size, opts.smplwav_flags))) {
+	smplwav_set_storage(&wav, markers, SMPLWAV_MAX_MARKERS, unsupported, SMPLWAV_MAX_UNSUPPORTED_CHUNKS);
+	smplwav_set_directory(&wav, &directory, chunks, MAX_DIRECTORY_CHUNKS);
+
+	if (SMPLWAV_ERROR_CODE(uerr = smplwav_mount_memory(&wav, infile.ptr, infile.size, opts.smplwav_flags))) {
 		if (SMPLWAV_ERROR_CODE(uerr) == SMPLWAV_ERROR_SMPL_CUE_LOOP_CONFLICTS) {
 			fprintf(stderr, "%s has sampler loops that conflict with loops in the cue chunk. you must specify --prefer-smpl-loops or --prefer-cue-loops to load it. here are the details:\n", opts.input_filename);
 			fprintf(stderr, "common loops (position/duration):\n");
@@ -693,8 +975,25 @@ int main(int argc, char *argv[])
 		smplwav_sort_markers(&wav);
 		if (opts.flags & FLAG_OUTPUT_METADATA)
 			dump_metadata(&wav);
-		if (opts.output_filename != NULL) {
-			out_data = serialise_sample(&wav, &out_data_sz, (opts.flags & FLAG_WRITE_CUE_LOOPS) == FLAG_WRITE_CUE_LOOPS);
+		/* Only the metadata of the input file is rewritten if that is
+		 * possible. */
+		if  (   (opts.flags & FLAG_OUTPUT_INPLACE)
+		    &&  !(uerr & (SMPLWAV_WARNING_FILE_TRUNCATION | SMPLWAV_WARNING_DIRECTORY_TRUNCATED))
+		    )
+			patch_data = patch_sample(&wav, &directory, infile.ptr, infile.size, opts.smplwav_flags, (opts.flags & FLAG_WRITE_CUE_LOOPS) == FLAG_WRITE_CUE_LOOPS, opts.data_alignment, patch_writes, &nb_patch_write);
+#if defined(SAMPLEAUTH_COPY_FILE_RANGE)
+		if (opts.output_filename != NULL && !(opts.flags & FLAG_OUTPUT_INPLACE)) {
+			int wr = write_sample_copy_range(&wav, &infile, opts.input_filename, opts.output_filename, (opts.flags & FLAG_WRITE_CUE_LOOPS) == FLAG_WRITE_CUE_LOOPS, opts.data_alignment);
+			if (wr < 0) {
+				fprintf(stderr, "could not write to file %s\n", opts.output_filename);
+				err = -1;
+			} else if (wr == 0) {
+				written = 1;
+			}
+		}
+#endif
+		if (err == 0 && opts.output_filename != NULL && patch_data == NULL && !written) {
+			out_data = serialise_sample(&wav, &out_data_sz, (opts.flags & FLAG_WRITE_CUE_LOOPS) == FLAG_WRITE_CUE_LOOPS, opts.data_alignment);
 			if (out_data == NULL)
 				err = -1;
 		}
@@ -706,6 +1005,14 @@ int main(int argc, char *argv[])
 	cop_filemap_close(&infile);
 
 	/* Must dump data after closing the filemap - this could be operating in-place. */
+	if (patch_data != NULL) {
+		assert(opts.output_filename != NULL);
+		if (err == 0 && apply_patch(opts.output_filename, patch_writes, nb_patch_write)) {
+			fprintf(stderr, "could not write to file %s\n", opts.output_filename);
+			err = -1;
+		}
+		free(patch_data);
+	}
 	if (out_data != NULL) {
 		assert(opts.output_filename != NULL);
 		if (err == 0 && cop_file_dump(opts.output_filename, out_data, out_data_sz)) {
@@ -26,12 +26,15 @@
 #include <assert.h>
 #include "cop/cop_attributes.h"
 
+/* Suggested sizes for marker and unsupported chunk storage which is
+ * declared as a fixed size array (see smplwav_set_storage()). These are not
+ * limits of the library. */
 #define SMPLWAV_MAX_MARKERS             (64)
 #define SMPLWAV_MAX_UNSUPPORTED_CHUNKS  (32)
 
 struct smplwav_marker {
 	/* id, in_cue, in_smpl and has_ltxt are used while the markers are being
-	 * prepared by smplwav_mount(). They are not used by the serialisation
+	 * prepared by smplwav_mount_memory(). They are not used by the serialisation
 	 * code and are free to be read from and written to by the calling code
 	 * for other purposes. */
 	uint_fast32_t         id;
@@ -105,12 +108,23 @@ const char *smplwav_info_index_to_string(unsigned index);
  * It is undefined for the string to not be 4 characters. */
 int smplwav_info_string_to_index(const char *fourcc);
 
+/* Builds the identifier of a RIFF chunk from its four characters. i.e.
+ *   SMPLWAV_RIFF_ID('b', 'e', 'x', 't') */
+#define SMPLWAV_RIFF_ID(c1, c2, c3, c4) \
+	(   ((uint_fast32_t)(c1)) \
+	|   (((uint_fast32_t)(c2)) << 8) \
+	|   (((uint_fast32_t)(c3)) << 16) \
+	|   (((uint_fast32_t)(c4)) << 24) \
+	)
+
 struct smplwav_extra_ck {
 	uint_fast32_t     id;
 	uint_fast32_t     size;
 	unsigned char    *data;
 };
 
+struct smplwav_chunk_directory;
+
 struct smplwav {
 	/* String metadata found in the info chunk. The purpose of each element is
 	 * the element with the same index in the SMPLWAV_INFO_TAGS[] array. */
@@ -121,24 +135,49 @@ struct smplwav {
 	int                        has_pitch_info;
 	uint_fast64_t              pitch_info;
 
-	/* Positional based metadata loaded from the waveform. */
+	/* Positional based metadata loaded from the waveform. "markers" points to
+	 * storage for "max_marker" elements which is owned by the caller. */
 	unsigned                   nb_marker;
-	struct smplwav_marker      markers[SMPLWAV_MAX_MARKERS];
+	unsigned                   max_marker;
+	struct smplwav_marker     *markers;
 
 	/* The data format of the wave file. */
 	struct smplwav_format      format;
 
 	/* The number of samples in the wave file and the pointer to its data. */
-	uint_fast32_t              data_frames;
+	uint_fast64_t              data_frames;
 	void                      *data;
 
 	/* Chunks which were found in the wave file which cannot be handled by
 	 * this implementation. This is anything other than: INFO, fmt, data, cue,
-	 * smpl, adtl and fact. */
+	 * smpl, adtl and fact. "unsupported" points to storage for
+	 * "max_unsupported" elements which is owned by the caller. */
 	unsigned                   nb_unsupported;
-	struct smplwav_extra_ck    unsupported[SMPLWAV_MAX_UNSUPPORTED_CHUNKS];
+	unsigned                   max_unsupported;
+	struct smplwav_extra_ck   *unsupported;
+
+	/* If not NULL, the mount functions record the location of every chunk
+	 * of the file here (see smplwav_set_directory() in smplwav_mount.h). */
+	struct smplwav_chunk_directory *directory;
 };
 
+/* Sets the storage which receives the markers and unsupported chunks of a
+ * wave. This must be called before a wave structure is first mounted (the
+ * mount functions keep the storage members but ignore everything else) or
+ * built by hand. Either pointer may be NULL if the corresponding maximum is
+ * zero. smplwav_mount_arena() sets the storage itself. The chunk directory
+ * is detached. */
+static COP_ATTR_UNUSED void smplwav_set_storage(struct smplwav *wav, struct smplwav_marker *markers, unsigned max_marker, struct smplwav_extra_ck *unsupported, unsigned max_unsupported)
+{
+	wav->nb_marker       = 0;
+	wav->max_marker      = max_marker;
+	wav->markers         = markers;
+	wav->nb_unsupported  = 0;
+	wav->max_unsupported = max_unsupported;
+	wav->unsupported     = unsupported;
+	wav->directory       = NULL;
+}
+
 static COP_ATTR_UNUSED uint_fast16_t smplwav_format_container_size(int format)
 {
 	switch (format) {
@@ -154,4 +193,16 @@ static COP_ATTR_UNUSED uint_fast16_t smplwav_format_container_size(int format)
 
 void smplwav_sort_markers(struct smplwav *wav);
 
+/* smplwav never creates threads itself. APIs which can split their work
+ * across threads take an executor supplied by the caller (which will usually
+ * hand the jobs to an existing worker pool).
+ *
+ * An executor must call fn(context, i) exactly once for every i in
+ * [0, nb_jobs) and must not return until all of those calls have completed.
+ * The calls may be made in any order and concurrently from any number of
+ * threads. Passing a NULL executor to an API which accepts one causes the
+ * jobs to be run serially on the calling thread. */
+typedef void (*smplwav_job_fn)(void *context, unsigned job);
+typedef void (*smplwav_executor_fn)(void *executor_context, smplwav_job_fn fn, void *context, unsigned nb_jobs);
+
 #endif /* SMPLWAV_H */
@@ -0,0 +1,118 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#ifndef SMPLWAV_CACHE_H
+#define SMPLWAV_CACHE_H
+
+#include "smplwav_mount.h"
+
+/* Mount Cache API
+ * -------------------------------------------------------------------------*/
+
+/* These functions convert the result of mounting a wave file into a compact,
+ * self-contained record which can be stored in a cache file and later turned
+ * back into a smplwav structure without walking any RIFF chunks. Records
+ * contain no pointers and are stored little-endian so a cache file can be
+ * memory mapped and used directly. The library does not define the layout of
+ * the cache file itself; an application will usually store records one after
+ * another with an index keyed by a hash of the path.
+ *
+ * The key identifies the file which a record was made from. Every member is
+ * compared when a record is loaded; members which the application does not
+ * use should be set to zero. */
+struct smplwav_cache_key {
+	/* Usually smplwav_cache_hash() of the path of the file. */
+	uint_fast64_t path_hash;
+
+	/* Usually filled in by smplwav_cache_key_fd(). */
+	uint_fast64_t file_size;
+	uint_fast64_t mtime;
+	uint_fast64_t inode;
+
+	/* Optionally, smplwav_cache_hash() of some or all of the file contents
+	 * for applications which cannot trust modification times. */
+	uint_fast64_t content_hash;
+};
+
+/* Returns the 64-bit FNV-1a hash of "size" bytes at "data" continuing from
+ * "hash". The initial value should be SMPLWAV_CACHE_HASH_INIT. */
+#define SMPLWAV_CACHE_HASH_INIT (0xCBF29CE484222325u)
+
+uint_fast64_t smplwav_cache_hash(uint_fast64_t hash, const void *data, size_t size);
+
+/* Fills in the file_size, mtime and inode members of "key" for the open file
+ * "fd" leaving the other members unchanged. Returns zero on success or
+ * non-zero if the file could not be queried. The modification time is in
+ * nanoseconds. The inode is zero on Windows, where the modification time
+ * only has a resolution of one second.
+ *
+ * The key can only tell files apart as well as the file system records
+ * modification times. An edit which keeps the size and the inode (such as an
+ * in-place metadata patch made with smplwav_serialise_patch()) within the
+ * timestamp granularity of the file system (one or two seconds on some file
+ * systems and on Windows, a few milliseconds on Linux) of the record being
+ * stored is not detected. Applications which can not rule that out should
+ * set content_hash. */
+int smplwav_cache_key_fd(struct smplwav_cache_key *key, int fd);
+
+/* Creates a record from a successfully mounted wave. "data_offset" is the
+ * offset of the audio within the file (as returned by smplwav_mount_fd() or
+ * the difference between wav->data and the start of the buffer given to
+ * smplwav_mount_memory()). The format, audio location, pitch information, INFO
+ * strings, markers and unsupported chunks are stored; strings and chunk
+ * bodies are copied into the record.
+ *
+ * If buf is NULL, no data will be written. The size argument will be updated
+ * to the size of the record as long as the function did not fail. The
+ * function returns zero on success or non-zero if the record would exceed
+ * the 32-bit limit of the format. */
+int
+smplwav_cache_store
+	(const struct smplwav           *wav
+	,const struct smplwav_cache_key *key
+	,uint_fast64_t                   data_offset
+	,unsigned char                  *buf
+	,size_t                         *size
+	);
+
+/* Rebuilds "wav" from a record of at most "size" bytes. The marker and
+ * unsupported chunk storage of "wav" must have been set with
+ * smplwav_set_storage(). Strings and chunk bodies point into the record so it
+ * must outlive "wav". As with smplwav_mount_fd(), wav->data is NULL and
+ * "data_offset" and "data_size" receive the location of the audio.
+ *
+ * Returns zero on success, SMPLWAV_ERROR_CACHE_STALE if the record was made
+ * for a different key, SMPLWAV_ERROR_CACHE_INVALID if the record is corrupt
+ * or SMPLWAV_ERROR_TOO_MANY_MARKERS or SMPLWAV_ERROR_TOO_MANY_CHUNKS if the
+ * storage of wav is not large enough. On error, wav is uninitialised. The
+ * size of the record is stored in "record_size" so that the next record in
+ * a file can be found. */
+unsigned
+smplwav_cache_load
+	(struct smplwav                 *wav
+	,const unsigned char            *buf
+	,size_t                          size
+	,const struct smplwav_cache_key *key
+	,size_t                         *record_size
+	,uint_fast64_t                  *data_offset
+	,uint_fast64_t                  *data_size
+	);
+
+#endif /* SMPLWAV_CACHE_H */
@@ -32,7 +32,12 @@
  * The function will take these interleaved samples and channelise them into
  * "dest". "dest" must contain at least "dest_stride" * "nb_channels" floats
  * and "dest_stride" must be at least "length". For each channel, the elements
- * of "dest" between "length" and "dest_stride" will not be initialised. */
+ * of "dest" between "length" and "dest_stride" will not be initialised.
+ *
+ * On x86, SSE2 or AVX2 implementations are selected at runtime depending on
+ * what the CPU supports. These produce bit-identical output to the portable
+ * C implementation which can be forced by building with SMPLWAV_NO_SIMD
+ * defined. */
 void
 smplwav_convert_deinterleave_floats
 	(float               *dest
@@ -43,4 +48,243 @@ smplwav_convert_deinterleave_floats
 	,int                  input_format
 	);
 
+/* Per-channel statistics accumulated by
+ * smplwav_convert_deinterleave_floats_stats(). The caller must initialise
+ * every member to zero before the first call; further calls (for example,
+ * on consecutive pieces of a long sample) continue to accumulate.
+ *
+ * The DC offset of a channel is sum / nb_samples and the RMS level is
+ * sqrt(sum_sq / nb_samples). */
+struct smplwav_convert_channel_stats {
+	/* The largest absolute sample value. */
+	float         peak;
+
+	/* The sum and the sum of squares of all samples. */
+	double        sum;
+	double        sum_sq;
+
+	/* The number of samples at the most negative or most positive value of
+	 * an integer input format. For SMPLWAV_FORMAT_FLOAT32 input, this is the
+	 * number of samples with a magnitude of at least 1.0. */
+	uint_fast64_t nb_clipped;
+
+	/* The number of samples which have been analysed. */
+	uint_fast64_t nb_samples;
+};
+
+/* Performs the same conversion as smplwav_convert_deinterleave_floats() and
+ * accumulates statistics for each channel into "stats" which must contain
+ * "nb_channels" elements. The statistics are computed on each block of
+ * output while it is still in the cache so the sample data is only read from
+ * memory once. The results are identical on every CPU. */
+void
+smplwav_convert_deinterleave_floats_stats
+	(float                                *dest
+	,size_t                                dest_stride
+	,const unsigned char                  *src
+	,unsigned                              length
+	,unsigned                              nb_channels
+	,int                                   input_format
+	,struct smplwav_convert_channel_stats *stats
+	);
+
+/* Planar output types for smplwav_convert_deinterleave().
+ *
+ *   SMPLWAV_CONVERT_OUTPUT_FLOAT   float, identical to
+ *                                  smplwav_convert_deinterleave_floats().
+ *   SMPLWAV_CONVERT_OUTPUT_INT16   int16_t. Integer input keeps its 16 most
+ *                                  significant bits (i.e. it is truncated,
+ *                                  not rounded or dithered).
+ *   SMPLWAV_CONVERT_OUTPUT_INT32   int32_t. Integer input is left justified.
+ *   SMPLWAV_CONVERT_OUTPUT_DOUBLE  double. The conversion is exact.
+ *   SMPLWAV_CONVERT_OUTPUT_HALF    uint16_t containing IEEE 754 half
+ *                                  precision values (rounded to nearest).
+ *
+ * Floating point input converted to an integer type is scaled, clamped and
+ * rounded in the same way as smplwav_convert_interleave_floats() without
+ * dither. */
+#define SMPLWAV_CONVERT_OUTPUT_FLOAT  (0)
+#define SMPLWAV_CONVERT_OUTPUT_INT16  (1)
+#define SMPLWAV_CONVERT_OUTPUT_INT32  (2)
+#define SMPLWAV_CONVERT_OUTPUT_DOUBLE (3)
+#define SMPLWAV_CONVERT_OUTPUT_HALF   (4)
+
+static COP_ATTR_UNUSED size_t smplwav_convert_output_size(int output_type)
+{
+	switch (output_type) {
+		case SMPLWAV_CONVERT_OUTPUT_INT16:
+		case SMPLWAV_CONVERT_OUTPUT_HALF:
+			return 2;
+		case SMPLWAV_CONVERT_OUTPUT_DOUBLE:
+			return 8;
+		default:
+			assert(output_type == SMPLWAV_CONVERT_OUTPUT_FLOAT || output_type == SMPLWAV_CONVERT_OUTPUT_INT32);
+			return 4;
+	}
+}
+
+/* The same as smplwav_convert_deinterleave_floats() except that "dest" is an
+ * array of the type given by "output_type" and "dest_stride" is measured in
+ * elements of that type. */
+void
+smplwav_convert_deinterleave
+	(void                *dest
+	,size_t               dest_stride
+	,int                  output_type
+	,const unsigned char *src
+	,unsigned             length
+	,unsigned             nb_channels
+	,int                  input_format
+	);
+
+/* The smallest number of frames converted by one job of
+ * smplwav_convert_deinterleave_floats_parallel(). */
+#define SMPLWAV_CONVERT_MIN_JOB_FRAMES (16384)
+
+/* Performs the same conversion as smplwav_convert_deinterleave_floats() but
+ * splits the frames into at most "max_jobs" ranges which are converted by
+ * the supplied executor (see smplwav.h). The output is identical to the
+ * single-threaded function. Ranges are never smaller than
+ * SMPLWAV_CONVERT_MIN_JOB_FRAMES frames so short samples will use fewer
+ * jobs than requested. */
+void
+smplwav_convert_deinterleave_floats_parallel
+	(float               *dest
+	,size_t               dest_stride
+	,const unsigned char *src
+	,unsigned             length
+	,unsigned             nb_channels
+	,int                  input_format
+	,unsigned             max_jobs
+	,smplwav_executor_fn  executor
+	,void                *executor_context
+	);
+
+/* Flags for smplwav_convert_interleave_floats(). */
+
+/* Add triangular probability density function dither of +/-1 LSB before
+ * quantising to a PCM format. Has no effect on SMPLWAV_FORMAT_FLOAT32. */
+#define SMPLWAV_CONVERT_FLAG_DITHER (1u)
+
+struct smplwav_convert_clip_stats {
+	/* The number of samples which were beyond the range of the output format
+	 * and were clamped. For SMPLWAV_FORMAT_FLOAT32 output nothing is clamped
+	 * and this is the number of samples with a magnitude above 1.0. */
+	uint_fast64_t nb_clipped;
+
+	/* The largest absolute input value. */
+	float         peak;
+};
+
+/* This is the inverse of smplwav_convert_deinterleave_floats(). "src"
+ * contains "nb_channels" channels of "length" floats with each channel
+ * starting "src_stride" elements after the previous one. The samples are
+ * interleaved into "dest" in "output_format" which must have room for
+ * "length" * "nb_channels" samples. The output is suitable to be used
+ * directly as the data pointer of a smplwav structure for serialisation.
+ *
+ * Samples are scaled so that 1.0 maps to the positive full scale value, are
+ * clamped to the range of the format and are rounded to the nearest integer.
+ *
+ * If "flags" contains SMPLWAV_CONVERT_FLAG_DITHER, the noise added to each
+ * sample is a deterministic function of "dither_seed" plus the interleaved
+ * index of the sample. A long buffer can be written in pieces with identical
+ * results by advancing the seed by the number of samples (frames multiplied
+ * by channels) already written.
+ *
+ * If "stats" is not NULL, clipping statistics are accumulated into it (the
+ * caller must initialise it). */
+void
+smplwav_convert_interleave_floats
+	(unsigned char                     *dest
+	,const float                       *src
+	,size_t                             src_stride
+	,unsigned                           length
+	,unsigned                           nb_channels
+	,int                                output_format
+	,unsigned                           flags
+	,uint_fast32_t                      dither_seed
+	,struct smplwav_convert_clip_stats *stats
+	);
+
+/* Converts the frames [start, start + count) of the audio in a mounted wave
+ * into "dest" with the same layout as smplwav_convert_deinterleave_floats():
+ * "dest" must contain at least "dest_stride" * wav->format.channels floats
+ * and "dest_stride" must be at least "count". Element 0 of each channel in
+ * "dest" corresponds to frame "start" of the sample.
+ *
+ * This permits decoding only the region of a sample which is about to be
+ * played (or only the loop region) rather than the entire waveform.
+ *
+ * The audio must be in memory: "wav" must have been mounted by
+ * smplwav_mount_memory(), smplwav_mount_arena() or smplwav_mount_lazy().
+ * Waves mounted by smplwav_mount_fd(), smplwav_mount_reader() or
+ * smplwav_cache_load() have no audio in memory (wav->data is NULL); read the
+ * frames with smplwav_read_frames() first and convert them with
+ * smplwav_convert_deinterleave_floats(). The audio of a stream mount is only
+ * available from its SMPLWAV_STREAM_EVENT_AUDIO events.
+ *
+ * The function returns zero on success or non-zero if wav->data is NULL or
+ * the window extends beyond the end of the audio in which case nothing is
+ * written. */
+int
+smplwav_convert_range_floats
+	(const struct smplwav *wav
+	,float                *dest
+	,size_t                dest_stride
+	,uint_fast64_t         start
+	,uint_fast32_t         count
+	);
+
+/* The same as smplwav_convert_range_floats() but producing any of the
+ * SMPLWAV_CONVERT_OUTPUT_* types (see smplwav_convert_deinterleave()). */
+int
+smplwav_convert_range
+	(const struct smplwav *wav
+	,void                 *dest
+	,size_t                dest_stride
+	,int                   output_type
+	,uint_fast64_t         start
+	,uint_fast32_t         count
+	);
+
+/* Converts only some of the channels of an interleaved stream. Channel "i"
+ * of "dest" receives source channel "channel_map[i]" for "i" in
+ * [0, nb_outputs). Source channels may appear more than once or not at all;
+ * channels which are not referenced are never read. Other arguments have the
+ * same meaning as in smplwav_convert_deinterleave_floats() but "dest" only
+ * needs room for "nb_outputs" channels. */
+void
+smplwav_convert_select_floats
+	(float               *dest
+	,size_t               dest_stride
+	,const unsigned      *channel_map
+	,unsigned             nb_outputs
+	,const unsigned char *src
+	,unsigned             length
+	,unsigned             nb_channels
+	,int                  input_format
+	);
+
+/* Converts an interleaved stream and mixes it down in the same pass. "matrix"
+ * contains "nb_outputs" rows of "nb_channels" gains and channel "o" of "dest"
+ * receives the sum over "c" of matrix[o * nb_channels + c] multiplied by
+ * source channel "c". Source channels which have a zero gain in every row are
+ * never read. For example, the mid signal of a stereo stream is produced by
+ * a single row containing { 0.5f, 0.5f }.
+ *
+ * Sums are accumulated in order of increasing source channel so results do
+ * not depend on the CPU. */
+void
+smplwav_convert_mix_floats
+	(float               *dest
+	,size_t               dest_stride
+	,const float         *matrix
+	,unsigned             nb_outputs
+	,const unsigned char *src
+	,unsigned             length
+	,unsigned             nb_channels
+	,int                  input_format
+	);
+
 #endif /* SMPLWAV_CONVERT_H */
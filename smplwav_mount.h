@@ -89,7 +89,7 @@
 #define SMPLWAV_ERROR_SMPL_INVALID            (10u)
 
 /* The wave file contained too many unsupported chunks (more than
- * WAV_SAMPLE_MAX_UNSUPPORTED_CHUNKS) to store in wav. The load is aborted and
+ * wav->max_unsupported) to store in wav. The load is aborted and
  * wav is uninitialised. */
 #define SMPLWAV_ERROR_TOO_MANY_CHUNKS         (11u)
 
@@ -98,8 +98,8 @@
  * uninitialised. */
 #define SMPLWAV_ERROR_DUPLICATE_CHUNKS        (12u)
 
-/* The wave file contained more than WAV_SAMPLE_MAX_MARKERS positional
- * metadata items. The load is aborted and wav is uninitialised. */
+/* The wave file contained more than wav->max_marker positional metadata
+ * items. The load is aborted and wav is uninitialised. */
 #define SMPLWAV_ERROR_TOO_MANY_MARKERS        (13u)
 
 /* The wave file contained markers which contained samples outside the range
@@ -123,6 +123,26 @@
  * permit the load to continue selecting which items to preserve. */
 #define SMPLWAV_ERROR_SMPL_CUE_LOOP_CONFLICTS (15u)
 
+/* Reading from the file failed or the file was shorter than expected. Only
+ * returned by smplwav_mount_fd() and smplwav_mount_reader(). The load is
+ * aborted and wav is uninitialised. */
+#define SMPLWAV_ERROR_READ                    (16u)
+
+/* The metadata chunks did not fit in the buffer supplied to
+ * smplwav_mount_fd() (or smplwav_mount_reader()) or the arena supplied to
+ * smplwav_mount_arena(). The load
+ * is aborted and wav is uninitialised. */
+#define SMPLWAV_ERROR_BUFFER_TOO_SMALL        (17u)
+
+/* The record passed to smplwav_cache_load() is damaged or was written by an
+ * incompatible version of the library. wav is uninitialised. */
+#define SMPLWAV_ERROR_CACHE_INVALID           (18u)
+
+/* The record passed to smplwav_cache_load() was made from a different
+ * version of the file and the file needs to be mounted again. wav is
+ * uninitialised. */
+#define SMPLWAV_ERROR_CACHE_STALE             (19u)
+
 /* Use this macro to extract the error code from a return value. */
 #define SMPLWAV_ERROR_CODE(x) ((x) & 0xFFu)
 
@@ -147,6 +167,71 @@
  * was corrected. */
 #define SMPLWAV_WARNING_SMPL_CUE_LOOP_CONFLICTS   (0x800u)
 
+/* The file contained more chunks than the chunk directory attached to the
+ * wave could hold. Only the first max_chunk chunks were recorded but
+ * nb_chunk is the number of chunks in the file. */
+#define SMPLWAV_WARNING_DIRECTORY_TRUNCATED       (0x1000u)
+
+/* Chunk Directory
+ * -------------------------------------------------------------------------*/
+
+/* The location of one chunk of a mounted file. */
+struct smplwav_chunk {
+	uint_fast32_t id;
+
+	/* The first four bytes of the body of a LIST chunk (for example, "INFO"
+	 * or "adtl") or zero for other chunks. */
+	uint_fast32_t list_type;
+
+	/* The offset of the chunk body from the start of the file and the size
+	 * of the body (which is truncated if the chunk runs past the end of the
+	 * file). */
+	uint_fast64_t offset;
+	uint_fast64_t size;
+
+	/* Private. */
+	unsigned      next;
+};
+
+#define SMPLWAV_CHUNK_DIRECTORY_BUCKETS (64)
+
+/* A directory of every chunk in a file which is filled in by the mount
+ * functions while they walk the file, so finding chunks which smplwav does
+ * not interpret (such as bext, iXML, inst or acid) never needs a second pass.
+ * Chunks are recorded whatever the mount flags are and do not count against
+ * the unsupported chunk storage of the wave. "chunks" points to storage for
+ * "max_chunk" entries which is owned by the caller. All other members are
+ * private. */
+struct smplwav_chunk_directory {
+	unsigned              nb_chunk;
+	unsigned              max_chunk;
+	struct smplwav_chunk *chunks;
+	unsigned              bucket[SMPLWAV_CHUNK_DIRECTORY_BUCKETS];
+};
+
+/* Attaches "directory" to the wave so that later mounts record the chunks
+ * of the file into "chunks" which must have room for "max_chunk" entries.
+ * Must be called after smplwav_set_storage(). smplwav_mount_arena() and
+ * smplwav_cache_load() do not record chunks. */
+static COP_ATTR_UNUSED void smplwav_set_directory(struct smplwav *wav, struct smplwav_chunk_directory *directory, struct smplwav_chunk *chunks, unsigned max_chunk)
+{
+	unsigned i;
+	directory->nb_chunk  = 0;
+	directory->max_chunk = max_chunk;
+	directory->chunks    = chunks;
+	for (i = 0; i < SMPLWAV_CHUNK_DIRECTORY_BUCKETS; i++)
+		directory->bucket[i] = 0;
+	wav->directory       = directory;
+}
+
+/* Returns the first chunk (in file order) with the given identifier or NULL
+ * if there is none. LIST chunks are found by their list type rather than by
+ * "LIST". The cost does not depend on the number of chunks in the file. */
+const struct smplwav_chunk *smplwav_chunk_find(const struct smplwav_chunk_directory *directory, uint_fast32_t id);
+
+/* Returns the next chunk after "chunk" with the same identifier or NULL. */
+const struct smplwav_chunk *smplwav_chunk_find_next(const struct smplwav_chunk_directory *directory, const struct smplwav_chunk *chunk);
+
 /* Sample Mounting API
  * -------------------------------------------------------------------------*/
 
@@ -154,7 +239,14 @@
  * in the given buffer (which is assumed to be a memory view of a wave file).
  *
  * Any information in the structure before the function is called is ignored
- * and will be overwritten.
+ * and will be overwritten with the exception of the marker and unsupported
+ * chunk storage which must have been set with smplwav_set_storage().
+ *
+ * This function was called smplwav_mount() when struct smplwav contained its
+ * own marker and chunk arrays. It was renamed when the storage moved out of
+ * the structure so that code written for the old layout (which would write
+ * through uninitialised storage pointers) fails to build. See the migration
+ * notes in README.md.
  *
  * Pointers in the wav structure (which are always string pointers) will point
  * directly into the supplied buffer argument. This means that the lifetime
@@ -170,6 +262,9 @@
  * No memory is dynamically allocated by this function and there is nothing
  * to cleanup on failure or success.
  *
+ * RF64 and BW64 files (which use a ds64 chunk to store the sizes of files
+ * over 4 GB) are mounted in the same way as RIFF files.
+ *
  * Flags may be any combination of the SMPLWAV_MOUNT_* values with one
  * exception. If SMPLWAV_MOUNT_PREFER_SMPL_LOOPS is specified,
  * SMPLWAV_MOUNT_PREFER_CUE_LOOPS must not be specified and vice versa.
@@ -182,6 +277,297 @@
  * return value was non-zero, one or more compromises were made to load the
  * wav structure which may or may-not be a problem. The warnings are a mask
  * of SMPLWAV_WARNING_* flags in the returned value. */
-unsigned smplwav_mount(struct smplwav *wav, unsigned char *buf, size_t bufsz, unsigned flags);
+unsigned smplwav_mount_memory(struct smplwav *wav, unsigned char *buf, size_t bufsz, unsigned flags);
+
+/* The same as smplwav_mount_memory() except that the storage for the markers
+ * and unsupported chunks is taken from "arena" which is "arena_size" bytes
+ * long rather than being set beforehand. The arena is sized to the file so
+ * there is no limit on the number of markers or chunks. "arena" must be
+ * suitably aligned for a pointer (memory from malloc() is) and may be NULL if
+ * "arena_size" is zero.
+ *
+ * On success, the markers and chunks are packed at the start of the arena
+ * with no unused elements (max_marker is set to nb_marker and max_unsupported
+ * to nb_unsupported) and "arena_used" receives the number of bytes which were
+ * used rounded up so that "arena" + "arena_used" is still suitably aligned.
+ * This allows the metadata of many samples to be packed into one large
+ * allocation.
+ *
+ * If the arena is too small, SMPLWAV_ERROR_BUFFER_TOO_SMALL is returned and
+ * "arena_used" receives a size which will be large enough. Calling the
+ * function with an "arena_size" of zero is therefore a way to find out how
+ * much space a file needs (a file which needs none is mounted straight away).
+ * The size asked for is worked out before the markers are decoded and is
+ * usually larger than the "arena_used" of a successful mount (a loop which is
+ * both a cue point and a sampler loop is one marker, and files with thousands
+ * of markers also need room to index them while they are decoded), so the
+ * "arena_used" of one mount is not a valid "arena_size" for mounting the same
+ * file again. Any chunk directory is detached from the wave. */
+unsigned
+smplwav_mount_arena
+	(struct smplwav *wav
+	,unsigned char  *buf
+	,size_t          bufsz
+	,unsigned        flags
+	,void           *arena
+	,size_t          arena_size
+	,size_t         *arena_used
+	);
+
+/* This function is the same as smplwav_mount_memory() except that the wave is
+ * read from the file descriptor "fd" using positioned reads and the audio data
+ * is never read or mapped. Only the chunk headers and the bodies of the chunks
+ * which will be kept are read, so the cost of the call depends on the amount
+ * of metadata rather than on the size of the file. This makes it suitable for
+ * scanning large sample libraries.
+ *
+ * The bodies of the metadata chunks are copied into "buf" which must be at
+ * least "bufsz" bytes long; pointers in wav point into this buffer. If the
+ * metadata does not fit, SMPLWAV_ERROR_BUFFER_TOO_SMALL is returned.
+ *
+ * On success, wav->data is NULL, "data_offset" receives the offset of the
+ * first byte of audio in the file and "data_size" receives the size of the
+ * audio in bytes (which is wav->data_frames multiplied by the frame size).
+ *
+ * The file offset of "fd" is not used or modified on POSIX systems. On
+ * Windows, the file offset is left at an unspecified position. */
+unsigned
+smplwav_mount_fd
+	(struct smplwav *wav
+	,int             fd
+	,unsigned char  *buf
+	,size_t          bufsz
+	,unsigned        flags
+	,uint_fast64_t  *data_offset
+	,uint_fast64_t  *data_size
+	);
+
+/* Pluggable I/O
+ * -------------------------------------------------------------------------*/
+
+/* Reads "size" bytes starting at "offset" in a file into "dest". Returns
+ * non-zero if the read fails or if fewer than "size" bytes could be read.
+ * Reads are positioned so a backend does not need to keep a file position
+ * and the same backend may serve many threads if its context allows it. */
+typedef int (*smplwav_read_fn)(void *context, unsigned char *dest, size_t size, uint_fast64_t offset);
+
+/* The reference backend which reads from a file descriptor. "context" must
+ * point to an int holding the descriptor. The file offset of the descriptor
+ * is left as described for smplwav_mount_fd(). */
+int smplwav_read_fd(void *context, unsigned char *dest, size_t size, uint_fast64_t offset);
+
+/* The same as smplwav_mount_fd() except that the file, which is "file_size"
+ * bytes long, is read through "read" (which is passed "context"). This
+ * allows samples to be mounted from archives, network storage or anything
+ * else which can be read at arbitrary offsets without copying the whole file
+ * into memory first. Only the chunk headers and the bodies of the metadata
+ * chunks which are kept are read. smplwav_mount_fd() is this function used
+ * with smplwav_read_fd(). */
+unsigned
+smplwav_mount_reader
+	(struct smplwav  *wav
+	,smplwav_read_fn  read
+	,void            *context
+	,uint_fast64_t    file_size
+	,unsigned char   *buf
+	,size_t           bufsz
+	,unsigned         flags
+	,uint_fast64_t   *data_offset
+	,uint_fast64_t   *data_size
+	);
+
+/* Reads the frames [start, start + count) of the audio of a wave mounted by
+ * smplwav_mount_reader() or smplwav_mount_fd() into "dest" in the format of
+ * the file. "data_offset" is the value returned by the mount. Returns zero
+ * on success or non-zero if the range extends beyond the end of the audio
+ * (in which case nothing is read) or the read fails. */
+int
+smplwav_read_frames
+	(const struct smplwav *wav
+	,smplwav_read_fn       read
+	,void                 *context
+	,uint_fast64_t         data_offset
+	,uint_fast64_t         start
+	,uint_fast32_t         count
+	,void                 *dest
+	);
+
+/* Batch Mounting API
+ * -------------------------------------------------------------------------*/
+
+/* One file of a batch. The caller fills in the input members and the
+ * remaining members are written by smplwav_mount_batch().
+ *
+ * If "fd" is negative, "buf" contains a complete wave file of "bufsz" bytes
+ * which is mounted with smplwav_mount_memory(). Otherwise "fd" is mounted with
+ * smplwav_mount_fd() using "buf" as the metadata buffer and "data_offset" and
+ * "data_size" receive the location of the audio. Every item must have its
+ * own buffer and the storage of "wav" must have been set with
+ * smplwav_set_storage(). */
+struct smplwav_mount_batch_item {
+	/* Inputs (and the storage members of wav). */
+	int             fd;
+	unsigned char  *buf;
+	size_t          bufsz;
+
+	/* Outputs. */
+	unsigned        result;
+	struct smplwav  wav;
+	uint_fast64_t   data_offset;
+	uint_fast64_t   data_size;
+};
+
+/* Items are handed to the executor in groups of this many so the cost of
+ * dispatching a job is small compared to the cost of the mounts it runs. */
+#define SMPLWAV_MOUNT_BATCH_JOB_ITEMS (16)
+
+/* Mounts every item in "items" with the given flags. The work is split into
+ * jobs of up to SMPLWAV_MOUNT_BATCH_JOB_ITEMS items which are run by the
+ * supplied executor (see smplwav.h); because there are usually many more jobs
+ * than threads, an executor which hands jobs out on demand balances files of
+ * different sizes across the pool. A NULL executor mounts the items serially.
+ *
+ * The result of each mount (exactly as returned by smplwav_mount_memory() or
+ * smplwav_mount_fd()) is stored in the "result" member of its item. The
+ * function returns the number of items with a non-zero error code. */
+unsigned
+smplwav_mount_batch
+	(struct smplwav_mount_batch_item *items
+	,unsigned                         nb_items
+	,unsigned                         flags
+	,smplwav_executor_fn              executor
+	,void                            *executor_context
+	);
+
+/* Streaming API
+ * -------------------------------------------------------------------------*/
+
+/* The chunks which the mount functions know how to interpret. Only used by
+ * the implementation. */
+struct smplwav_mount_chunks {
+	struct smplwav_extra_ck info;
+	struct smplwav_extra_ck adtl;
+	struct smplwav_extra_ck cue;
+	struct smplwav_extra_ck smpl;
+	struct smplwav_extra_ck fact;
+	struct smplwav_extra_ck data;
+	struct smplwav_extra_ck fmt;
+
+	/* The size of the data chunk which can exceed data.size in RF64 files. */
+	uint_fast64_t           data_size;
+};
+
+/* State of an incremental mount. All members are private. */
+struct smplwav_stream {
+	struct smplwav              *wav;
+	struct smplwav_mount_chunks  chunks;
+	struct smplwav_extra_ck     *slot;
+	unsigned char               *buf;
+	size_t                       bufsz;
+	unsigned char                hdr[12];
+	unsigned                     hdr_fill;
+	unsigned                     flags;
+	unsigned                     warnings;
+	int                          state;
+	uint_fast32_t                riff_sz;
+	uint_fast32_t                ck_size;
+	uint_fast32_t                ck_received;
+	uint_fast64_t                offset;
+	unsigned                     pad;
+	int                          format_reported;
+};
+
+/* Nothing to report: all of the input was consumed. */
+#define SMPLWAV_STREAM_EVENT_NONE   (0)
+
+/* wav->format and wav->data_frames are now valid. This is reported once,
+ * as soon as the fmt chunk and the header of the data chunk have both been
+ * received. */
+#define SMPLWAV_STREAM_EVENT_FORMAT (1)
+
+/* "audio" points to "audio_size" bytes of the data chunk inside the input
+ * which was pushed. "audio_offset" is the position of the first of these
+ * bytes within the data chunk. Slices follow the input and are not aligned to
+ * frames. */
+#define SMPLWAV_STREAM_EVENT_AUDIO  (2)
+
+struct smplwav_stream_event {
+	int                  type;
+	size_t               consumed;
+	const unsigned char *audio;
+	size_t               audio_size;
+	uint_fast32_t        audio_offset;
+};
+
+/* Prepares "stream" to mount a wave file which arrives in pieces (for
+ * example, from a pipe or a socket). "wav", "flags" and the metadata buffer
+ * "buf" of "bufsz" bytes have the same purpose as in smplwav_mount_fd().
+ * The audio is never stored: it is handed back to the caller as it arrives
+ * and wav->data will be NULL. RF64 and BW64 files are not supported. */
+void smplwav_stream_init(struct smplwav_stream *stream, struct smplwav *wav, unsigned char *buf, size_t bufsz, unsigned flags);
+
+/* Parses up to "size" bytes from "data". The function stops early to report
+ * an event: "event->consumed" is set to the number of bytes used and the
+ * caller should push the remaining bytes again after handling the event.
+ * The input does not need to remain valid after the call returns unless it
+ * is referenced by an audio event which has not yet been handled.
+ *
+ * Returns zero or a SMPLWAV_ERROR_* code if the stream is invalid, in which
+ * case the stream must not be used again. */
+unsigned smplwav_stream_push(struct smplwav_stream *stream, const unsigned char *data, size_t size, struct smplwav_stream_event *event);
+
+/* Called once all of the input has been pushed. Interprets the metadata which
+ * was collected and returns the same set of error and warning codes as
+ * smplwav_mount_memory(). Metadata chunks which follow the data chunk (which
+ * is common for LIST chunks) are only available after this call. */
+unsigned smplwav_stream_finish(struct smplwav_stream *stream);
+
+/* Lazy Mounting API
+ * -------------------------------------------------------------------------*/
+
+/* State of a lazy mount. All members are private. */
+struct smplwav_lazy {
+	struct smplwav              *wav;
+	struct smplwav_mount_chunks  chunks;
+	unsigned                     flags;
+	unsigned                     loaded;
+	unsigned                     info_result;
+	unsigned                     marker_result;
+};
+
+/* The same as smplwav_mount_memory() except that only the format, the audio
+ * and the unsupported chunks are loaded. The INFO, adtl, cue and smpl chunks
+ * are located but not decoded: wav->info is empty and there are no markers or
+ * pitch information until smplwav_lazy_load_info() or
+ * smplwav_lazy_load_markers() is called. Errors in those chunks are only
+ * reported by the function which decodes them. This is the fastest way to get
+ * at the audio of a sample when the metadata may never be needed.
+ *
+ * "lazy" remembers where the chunks are and must remain valid (along with
+ * "buf" and "wav") for as long as the metadata may be requested. */
+unsigned
+smplwav_mount_lazy
+	(struct smplwav      *wav
+	,struct smplwav_lazy *lazy
+	,unsigned char       *buf
+	,size_t               bufsz
+	,unsigned             flags
+	);
+
+/* Decodes the INFO chunk into wav->info. Returns zero or the error and warning
+ * codes which smplwav_mount_memory() would have returned for the chunk. If an
+ * error is returned, wav->info is left empty. Only the first call does any
+ * work; later calls return the same value. */
+unsigned smplwav_lazy_load_info(struct smplwav_lazy *lazy);
+
+/* Decodes the adtl, cue and smpl chunks into the markers and pitch information
+ * of the wave and reconciles the loops using the flags which were passed to
+ * smplwav_mount_lazy(). Returns zero or the error and warning codes which
+ * smplwav_mount_memory() would have returned for these chunks. If an error
+ * other than SMPLWAV_ERROR_SMPL_CUE_LOOP_CONFLICTS is returned, the markers
+ * and pitch information are uninitialised (the format, audio and INFO strings
+ * remain valid). Only the first call does any work; later calls return the
+ * same value. */
+unsigned smplwav_lazy_load_markers(struct smplwav_lazy *lazy);
 
 #endif /* SMPLWAV_MOUNT_H */
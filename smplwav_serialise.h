@@ -37,8 +37,191 @@
  * It is undefined for any of the values in the wav_sample structure to be
  * invalid.
  *
+ * If the file or its data chunk would be too large for the 32-bit sizes of a
+ * RIFF file, an RF64 file is written instead (the sizes are stored in a ds64
+ * chunk which follows the header). Otherwise the output is an ordinary RIFF
+ * file.
+ *
  * The function returns zero on success or non-zero if the wave is impossible
- * to serialise (a chunk size would have exceeded the hard 32-bit limit). */
+ * to serialise (a metadata chunk size would have exceeded the hard 32-bit
+ * limit, a loop would end beyond the first 2^32 frames which the smpl chunk
+ * can describe or the file would not fit in memory). */
 int smplwav_serialise(const struct smplwav *wav, unsigned char *buf, size_t *size, int store_cue_loops);
 
+/* The layout of a serialised wave. The size of every chunk and the length of
+ * every string is worked out once by smplwav_serialise_plan() so the wave can
+ * then be written any number of times without measuring it again. */
+struct smplwav_serialise_plan {
+	/* The number of bytes written by smplwav_serialise_emit(). */
+	size_t          size;
+
+	/* The offset of the first byte of audio in the output. */
+	uint_fast64_t   data_offset;
+
+	/* The number of bytes written to the buffer passed to
+	 * smplwav_serialise_segments() (everything except the audio and the
+	 * bodies of the unsupported chunks). */
+	size_t          metadata_size;
+
+	/* All other members are private. */
+	int             store_cue_loops;
+	int             rf64;
+	int             has_fact;
+	int             has_smpl;
+	uint_fast32_t   fmt_size;
+	uint_fast32_t   info_size;
+	uint_fast32_t   info_lengths[SMPLWAV_NB_INFO_TAGS];
+	uint_fast32_t   adtl_size;
+	uint_fast32_t   nb_cue;
+	uint_fast32_t   nb_loop;
+	uint_fast64_t   pad_size;
+	uint_fast32_t  *marker_lengths;
+};
+
+/* Works out the layout of the serialised form of "wav" (see
+ * smplwav_serialise() for the meaning of "store_cue_loops"). The lengths of
+ * the marker names and descriptions are stored in "marker_lengths" which must
+ * have room for 2 * wav->nb_marker elements and must remain valid for as long
+ * as the plan is used. If it is NULL, those lengths are measured again each
+ * time the plan is emitted.
+ *
+ * Returns zero on success or non-zero if the wave is impossible to serialise
+ * (for the same reasons as smplwav_serialise()). */
+int
+smplwav_serialise_plan
+	(struct smplwav_serialise_plan *plan
+	,const struct smplwav          *wav
+	,int                            store_cue_loops
+	,uint_fast32_t                 *marker_lengths
+	);
+
+/* The same as smplwav_serialise_plan() except that a zero filled JUNK chunk
+ * is inserted before the data chunk when it is needed to put the first byte
+ * of audio (plan->data_offset) on a multiple of "data_alignment" bytes from
+ * the start of the file. Files written this way can be streamed with direct
+ * I/O (O_DIRECT) or read with aligned vector loads from a memory mapping.
+ *
+ * "data_alignment" must be a power of two (the function fails otherwise) or
+ * zero. Zero or one disables the padding. */
+int
+smplwav_serialise_plan_aligned
+	(struct smplwav_serialise_plan *plan
+	,const struct smplwav          *wav
+	,int                            store_cue_loops
+	,uint_fast32_t                 *marker_lengths
+	,uint_fast32_t                  data_alignment
+	);
+
+/* Writes "plan->size" bytes of the serialised wave to "buf". "wav" must have
+ * the same metadata, format and number of frames as the wave which was
+ * planned but its audio may be different, so one plan can be used to write
+ * many files which share a metadata template. The output is identical to
+ * that of smplwav_serialise(). */
+void
+smplwav_serialise_emit
+	(const struct smplwav_serialise_plan *plan
+	,const struct smplwav                *wav
+	,unsigned char                       *buf
+	);
+
+/* One piece of a serialised wave. The pieces are written to a file in order
+ * (for example, with writev()). */
+struct smplwav_segment {
+	const void *data;
+	size_t      size;
+};
+
+/* The largest number of segments which smplwav_serialise_segments() can
+ * produce for a wave with "nb_unsupported" unsupported chunks. */
+#define SMPLWAV_SERIALISE_MAX_SEGMENTS(nb_unsupported) (3 + 2 * (size_t)(nb_unsupported))
+
+/* Produces the same output as smplwav_serialise_emit() without copying the
+ * audio or the unsupported chunks. The generated bytes (headers and
+ * metadata) are written to "buf" which must have room for
+ * "plan->metadata_size" bytes. "segments" must have room for
+ * SMPLWAV_SERIALISE_MAX_SEGMENTS(wav->nb_unsupported) elements and receives
+ * a list of pieces which alternate between parts of "buf" and references to
+ * wav->data and the unsupported chunk data (so these must remain valid until
+ * the output has been written). Empty pieces are never produced.
+ *
+ * Rewriting the metadata of a large sample which has been mounted from a
+ * memory mapped file therefore needs no copy of its audio. Returns the number
+ * of segments. */
+unsigned
+smplwav_serialise_segments
+	(const struct smplwav_serialise_plan *plan
+	,const struct smplwav                *wav
+	,unsigned char                       *buf
+	,struct smplwav_segment              *segments
+	);
+
+/* Patching API
+ * -------------------------------------------------------------------------*/
+
+/* A patch updates the metadata of an existing file without rewriting its
+ * audio. The INFO list, the adtl list, the cue chunk and the smpl chunk of
+ * the file are replaced; every other chunk stays exactly where it is. */
+
+/* One write of a patch: "size" bytes at "data" are written at "offset" bytes
+ * from the start of the file. */
+struct smplwav_patch_write {
+	uint_fast64_t  offset;
+	const void    *data;
+	size_t         size;
+};
+
+/* The largest number of writes which smplwav_serialise_patch() can produce
+ * for a file with "nb_chunk" chunks. */
+#define SMPLWAV_PATCH_MAX_WRITES(nb_chunk) (3 + (size_t)(nb_chunk))
+
+/* Returns the number of bytes which smplwav_serialise_patch() needs in its
+ * "buf" argument. */
+size_t
+smplwav_serialise_patch_size
+	(const struct smplwav_serialise_plan  *plan
+	,const struct smplwav_chunk_directory *directory
+	);
+
+/* Works out how to update the metadata of the file which "wav" was mounted
+ * from in place. "directory" must have been attached to the wave when it was
+ * mounted (see smplwav_set_directory()) and must have recorded every chunk
+ * of the file (the mount must not have reported
+ * SMPLWAV_WARNING_DIRECTORY_TRUNCATED or SMPLWAV_WARNING_FILE_TRUNCATION).
+ * "header" points to the first 12 bytes of the file and "plan" must have
+ * been made from "wav" by smplwav_serialise_plan().
+ *
+ * The new metadata chunks are written over the old ones where they fit
+ * (adjacent JUNK and PAD chunks are also reused) and the space which is left
+ * over is turned into JUNK chunks, of which only the headers are written.
+ * If the metadata does not fit anywhere, it is written at the end of the
+ * file. The size of the RIFF form is only written if it changes. A metadata
+ * edit of a large sample therefore costs a few kilobytes of I/O rather than
+ * a copy of the file.
+ *
+ * The generated bytes are written to "buf" which must have room for
+ * smplwav_serialise_patch_size() bytes. "writes" must have room for
+ * SMPLWAV_PATCH_MAX_WRITES(directory->nb_chunk) elements and receives the
+ * list of writes which refer to "buf"; the number of writes is stored in
+ * "nb_write". The writes do not overlap so they may be made in any order but
+ * they must all be made before any of the file is mounted again. Afterwards
+ * the file must be resized to "file_size" bytes if that differs from its
+ * current size (it only gets smaller in the rare case where the metadata
+ * nearly fits into a run of chunks at the end of the file).
+ *
+ * Returns zero on success or non-zero if the file can not be patched (the
+ * directory is incomplete, the header is not a RIFF, RF64 or BW64 header or
+ * a RIFF file would exceed 4 GB). Nothing is produced in that case and the
+ * file should be rewritten instead. */
+int
+smplwav_serialise_patch
+	(const struct smplwav_serialise_plan  *plan
+	,const struct smplwav                 *wav
+	,const struct smplwav_chunk_directory *directory
+	,const unsigned char                  *header
+	,unsigned char                        *buf
+	,struct smplwav_patch_write           *writes
+	,unsigned                             *nb_write
+	,uint_fast64_t                        *file_size
+	);
+
 #endif /* SMPLWAV_SERIALISE_H */
@@ -0,0 +1,281 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#include "smplwav/smplwav_cache.h"
+#include "cop/cop_conversions.h"
+#include "smplwav_internal.h"
+#include <string.h>
+
+/* Record layout. All values are little-endian and offsets are from the start
+ * of the record. A string or chunk offset of zero means NULL.
+ *
+ *   0   "SWMC"                  4   version
+ *   8   record size             12  number of markers
+ *   16  number of chunks        20  mask of INFO strings which are present
+ *   24  key (5 x 64-bit)        64  format
+ *   68  sample rate             72  channels (16-bit)
+ *   74  bits per sample (16)    76  has pitch info
+ *   80  pitch info (64-bit)     88  data offset (64-bit)
+ *   96  data frames (64-bit)
+ *
+ * followed by the markers (id, position, length, name offset, desc offset,
+ * flags), an offset for each INFO string which is present, the unsupported
+ * chunks (id, size, offset) and finally the strings and chunk bodies. */
+#define CACHE_MAGIC          SMPLWAV_RIFF_ID('S', 'W', 'M', 'C')
+#define CACHE_VERSION        (1u)
+#define CACHE_HEADER_SIZE    (104u)
+#define CACHE_MARKER_SIZE    (24u)
+#define CACHE_INFO_SIZE      (4u)
+#define CACHE_CHUNK_SIZE     (12u)
+
+#define CACHE_MARKER_IN_CUE   (1u)
+#define CACHE_MARKER_IN_SMPL  (2u)
+#define CACHE_MARKER_HAS_LTXT (4u)
+
+uint_fast64_t smplwav_cache_hash(uint_fast64_t hash, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	while (size--)
+		hash = ((hash ^ *p++) * 0x100000001B3u) & 0xFFFFFFFFFFFFFFFFu;
+	return hash;
+}
+
+static void store_key(unsigned char *buf, const struct smplwav_cache_key *key)
+{
+	smplwav_st_ule64(buf + 0,  key->path_hash);
+	smplwav_st_ule64(buf + 8,  key->file_size);
+	smplwav_st_ule64(buf + 16, key->mtime);
+	smplwav_st_ule64(buf + 24, key->inode);
+	smplwav_st_ule64(buf + 32, key->content_hash);
+}
+
+static int key_matches(const unsigned char *buf, const struct smplwav_cache_key *key)
+{
+	return  (smplwav_ld_ule64(buf + 0)  == key->path_hash)
+	    &&  (smplwav_ld_ule64(buf + 8)  == key->file_size)
+	    &&  (smplwav_ld_ule64(buf + 16) == key->mtime)
+	    &&  (smplwav_ld_ule64(buf + 24) == key->inode)
+	    &&  (smplwav_ld_ule64(buf + 32) == key->content_hash);
+}
+
+/* Copies a string or chunk body into the record and returns its offset,
+ * advancing "pos". */
+static uint_fast64_t store_blob(unsigned char *buf, uint_fast64_t *pos, const void *data, size_t size)
+{
+	uint_fast64_t offset = *pos;
+	if (size)
+		memcpy(buf + offset, data, size);
+	*pos += size;
+	return offset;
+}
+
+int smplwav_cache_store(const struct smplwav *wav, const struct smplwav_cache_key *key, uint_fast64_t data_offset, unsigned char *buf, size_t *size)
+{
+	uint_fast64_t pos;
+	uint_fast32_t info_mask = 0;
+	unsigned      nb_info   = 0;
+	unsigned char *tab;
+	unsigned       i;
+
+	for (i = 0; i < SMPLWAV_NB_INFO_TAGS; i++) {
+		if (wav->info[i] != NULL) {
+			info_mask |= 1u << i;
+			nb_info++;
+		}
+	}
+
+	/* The first pass (with buf NULL) only computes the size. */
+	pos = CACHE_HEADER_SIZE + CACHE_MARKER_SIZE * (uint_fast64_t)wav->nb_marker + CACHE_INFO_SIZE * nb_info + CACHE_CHUNK_SIZE * (uint_fast64_t)wav->nb_unsupported;
+	for (i = 0; i < wav->nb_marker; i++) {
+		if (wav->markers[i].name != NULL)
+			pos += strlen(wav->markers[i].name) + 1;
+		if (wav->markers[i].desc != NULL)
+			pos += strlen(wav->markers[i].desc) + 1;
+	}
+	for (i = 0; i < SMPLWAV_NB_INFO_TAGS; i++)
+		if (wav->info[i] != NULL)
+			pos += strlen(wav->info[i]) + 1;
+	for (i = 0; i < wav->nb_unsupported; i++)
+		pos += wav->unsupported[i].size;
+
+	if (pos > 0xFFFFFFFFu)
+		return 1;
+
+	*size = (size_t)pos;
+	if (buf == NULL)
+		return 0;
+
+	cop_st_ule32(buf + 0,  CACHE_MAGIC);
+	cop_st_ule32(buf + 4,  CACHE_VERSION);
+	cop_st_ule32(buf + 8,  (uint_fast32_t)pos);
+	cop_st_ule32(buf + 12, wav->nb_marker);
+	cop_st_ule32(buf + 16, wav->nb_unsupported);
+	cop_st_ule32(buf + 20, info_mask);
+	store_key(buf + 24, key);
+	cop_st_ule32(buf + 64, (uint_fast32_t)wav->format.format);
+	cop_st_ule32(buf + 68, wav->format.sample_rate);
+	cop_st_ule16(buf + 72, wav->format.channels);
+	cop_st_ule16(buf + 74, wav->format.bits_per_sample);
+	cop_st_ule32(buf + 76, wav->has_pitch_info ? 1 : 0);
+	smplwav_st_ule64(buf + 80, wav->pitch_info);
+	smplwav_st_ule64(buf + 88, data_offset);
+	smplwav_st_ule64(buf + 96, wav->data_frames);
+
+	tab = buf + CACHE_HEADER_SIZE;
+	pos = CACHE_HEADER_SIZE + CACHE_MARKER_SIZE * (uint_fast64_t)wav->nb_marker + CACHE_INFO_SIZE * nb_info + CACHE_CHUNK_SIZE * (uint_fast64_t)wav->nb_unsupported;
+
+	for (i = 0; i < wav->nb_marker; i++, tab += CACHE_MARKER_SIZE) {
+		const struct smplwav_marker *m = wav->markers + i;
+		cop_st_ule32(tab + 0,  m->id);
+		cop_st_ule32(tab + 4,  m->position);
+		cop_st_ule32(tab + 8,  m->length);
+		cop_st_ule32(tab + 12, (m->name != NULL) ? (uint_fast32_t)store_blob(buf, &pos, m->name, strlen(m->name) + 1) : 0);
+		cop_st_ule32(tab + 16, (m->desc != NULL) ? (uint_fast32_t)store_blob(buf, &pos, m->desc, strlen(m->desc) + 1) : 0);
+		cop_st_ule32(tab + 20, (m->in_cue ? CACHE_MARKER_IN_CUE : 0) | (m->in_smpl ? CACHE_MARKER_IN_SMPL : 0) | (m->has_ltxt ? CACHE_MARKER_HAS_LTXT : 0));
+	}
+
+	for (i = 0; i < SMPLWAV_NB_INFO_TAGS; i++) {
+		if (wav->info[i] != NULL) {
+			cop_st_ule32(tab, (uint_fast32_t)store_blob(buf, &pos, wav->info[i], strlen(wav->info[i]) + 1));
+			tab += CACHE_INFO_SIZE;
+		}
+	}
+
+	for (i = 0; i < wav->nb_unsupported; i++, tab += CACHE_CHUNK_SIZE) {
+		const struct smplwav_extra_ck *ck = wav->unsupported + i;
+		cop_st_ule32(tab + 0, ck->id);
+		cop_st_ule32(tab + 4, ck->size);
+		cop_st_ule32(tab + 8, (uint_fast32_t)store_blob(buf, &pos, ck->data, ck->size));
+	}
+
+	assert(pos == *size);
+	return 0;
+}
+
+/* Returns the string at "offset" or NULL. "*ok" is cleared if the offset does
+ * not refer to a terminated string in the string area of the record. */
+static char *load_string(const unsigned char *buf, uint_fast32_t offset, uint_fast32_t strings, uint_fast32_t rec_size, int *ok)
+{
+	if (!offset)
+		return NULL;
+	if (offset < strings || offset >= rec_size || memchr(buf + offset, 0, rec_size - offset) == NULL) {
+		*ok = 0;
+		return NULL;
+	}
+	return (char *)(buf + offset);
+}
+
+unsigned smplwav_cache_load(struct smplwav *wav, const unsigned char *buf, size_t size, const struct smplwav_cache_key *key, size_t *record_size, uint_fast64_t *data_offset, uint_fast64_t *data_size)
+{
+	uint_fast32_t        rec_size;
+	uint_fast32_t        nb_marker;
+	uint_fast32_t        nb_unsupported;
+	uint_fast32_t        info_mask;
+	uint_fast64_t        strings;
+	const unsigned char *tab;
+	unsigned             nb_info = 0;
+	unsigned             i;
+	int                  ok      = 1;
+
+	if  (   (size < CACHE_HEADER_SIZE)
+	    ||  (cop_ld_ule32(buf) != CACHE_MAGIC)
+	    ||  (cop_ld_ule32(buf + 4) != CACHE_VERSION)
+	    ||  ((rec_size = cop_ld_ule32(buf + 8)) < CACHE_HEADER_SIZE)
+	    ||  (rec_size > size)
+	    )
+		return SMPLWAV_ERROR_CACHE_INVALID;
+
+	*record_size = rec_size;
+
+	if (!key_matches(buf + 24, key))
+		return SMPLWAV_ERROR_CACHE_STALE;
+
+	nb_marker      = cop_ld_ule32(buf + 12);
+	nb_unsupported = cop_ld_ule32(buf + 16);
+	info_mask      = cop_ld_ule32(buf + 20);
+	for (i = 0; i < SMPLWAV_NB_INFO_TAGS; i++)
+		nb_info += (info_mask >> i) & 1;
+
+	strings = CACHE_HEADER_SIZE + CACHE_MARKER_SIZE * (uint_fast64_t)nb_marker + CACHE_INFO_SIZE * nb_info + CACHE_CHUNK_SIZE * (uint_fast64_t)nb_unsupported;
+	if  (   (strings > rec_size)
+	    ||  (info_mask >> SMPLWAV_NB_INFO_TAGS)
+	    ||  (cop_ld_ule32(buf + 64) > SMPLWAV_FORMAT_FLOAT32)
+	    )
+		return SMPLWAV_ERROR_CACHE_INVALID;
+
+	if (nb_marker > wav->max_marker)
+		return SMPLWAV_ERROR_TOO_MANY_MARKERS;
+	if (nb_unsupported > wav->max_unsupported)
+		return SMPLWAV_ERROR_TOO_MANY_CHUNKS;
+
+	wav->format.format          = (int)cop_ld_ule32(buf + 64);
+	wav->format.sample_rate     = cop_ld_ule32(buf + 68);
+	wav->format.channels        = cop_ld_ule16(buf + 72);
+	wav->format.bits_per_sample = cop_ld_ule16(buf + 74);
+	wav->has_pitch_info         = cop_ld_ule32(buf + 76) != 0;
+	wav->pitch_info             = smplwav_ld_ule64(buf + 80);
+	wav->data_frames            = smplwav_ld_ule64(buf + 96);
+	wav->data                   = NULL;
+
+	tab = buf + CACHE_HEADER_SIZE;
+
+	wav->nb_marker = nb_marker;
+	for (i = 0; i < nb_marker; i++, tab += CACHE_MARKER_SIZE) {
+		struct smplwav_marker *m = wav->markers + i;
+		uint_fast32_t          f = cop_ld_ule32(tab + 20);
+		m->id       = cop_ld_ule32(tab + 0);
+		m->position = cop_ld_ule32(tab + 4);
+		m->length   = cop_ld_ule32(tab + 8);
+		m->name     = load_string(buf, cop_ld_ule32(tab + 12), (uint_fast32_t)strings, rec_size, &ok);
+		m->desc     = load_string(buf, cop_ld_ule32(tab + 16), (uint_fast32_t)strings, rec_size, &ok);
+		m->in_cue   = (f & CACHE_MARKER_IN_CUE) != 0;
+		m->in_smpl  = (f & CACHE_MARKER_IN_SMPL) != 0;
+		m->has_ltxt = (f & CACHE_MARKER_HAS_LTXT) != 0;
+	}
+
+	for (i = 0; i < SMPLWAV_NB_INFO_TAGS; i++) {
+		if ((info_mask >> i) & 1) {
+			wav->info[i] = load_string(buf, cop_ld_ule32(tab), (uint_fast32_t)strings, rec_size, &ok);
+			tab += CACHE_INFO_SIZE;
+		} else {
+			wav->info[i] = NULL;
+		}
+	}
+
+	wav->nb_unsupported = nb_unsupported;
+	for (i = 0; i < nb_unsupported; i++, tab += CACHE_CHUNK_SIZE) {
+		struct smplwav_extra_ck *ck     = wav->unsupported + i;
+		uint_fast32_t            offset = cop_ld_ule32(tab + 8);
+		ck->id   = cop_ld_ule32(tab + 0);
+		ck->size = cop_ld_ule32(tab + 4);
+		ck->data = NULL;
+		if (offset < strings || offset > rec_size || ck->size > rec_size - offset)
+			ok = 0;
+		else
+			ck->data = (unsigned char *)(buf + offset);
+	}
+
+	if (!ok)
+		return SMPLWAV_ERROR_CACHE_INVALID;
+
+	*data_offset = smplwav_ld_ule64(buf + 88);
+	*data_size   = wav->data_frames * wav->format.channels * smplwav_format_container_size(wav->format.format);
+	return 0;
+}
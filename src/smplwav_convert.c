@@ -18,72 +18,836 @@
  * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
  * DEALINGS IN THE SOFTWARE. */
 
-#include <stdlib.h>
-#include "smplwav/smplwav_convert.h"
+#include <string.h>
+#include "smplwav_convert_internal.h"
 
-void smplwav_convert_deinterleave_floats(float *dest, size_t dest_stride, const unsigned char *src, unsigned length, unsigned nb_channels, int input_format)
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+static void pcm16_stereo_scalar(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
 {
-	if (input_format == SMPLWAV_FORMAT_PCM16)
-	{
-		if (nb_channels == 2) {
-			unsigned j;
-			float *out1 = dest;
-			float *out2 = out1 + dest_stride;
-			for (j = 0; j < length; j++) {
-				int_fast32_t s1;
-				int_fast32_t s2;
-				s1 =             src[4*j+1];
-				s1 = (s1 << 8) | src[4*j+0];
-				s2 =             src[4*j+3];
-				s2 = (s2 << 8) | src[4*j+2];
-				if (s1 >= 32768)
-					s1 -= 65536;
-				if (s2 >= 32768)
-					s2 -= 65536;
-				out1[j] = s1 * (256.0f / (float)0x800000);
-				out2[j] = s2 * (256.0f / (float)0x800000);
-			}
-		} else {
-			unsigned i;
-			float *out = dest;
-			for (i = 0; i < nb_channels; i++, out += dest_stride) {
-				unsigned j;
-				for (j = 0; j < length; j++) {
-					uint_fast32_t s;
-					int_fast32_t t;
-					s =            src[2*(i+nb_channels*j)+1];
-					s = (s << 8) | src[2*(i+nb_channels*j)+0];
-					t = (s & 0x8000u)   ? -(int_fast32_t)(((~s) & 0x7FFFu) + 1) : (int_fast32_t)s;
-					out[j] = t * (256.0f / (float)0x800000);
-				}
+	size_t j;
+	float *out1 = dest_ptr;
+	float *out2 = out1 + dest_stride;
+	assert(nb_channels == 2);
+	for (j = 0; j < length; j++) {
+		int_fast32_t s1;
+		int_fast32_t s2;
+		s1 =             src[4*j+1];
+		s1 = (s1 << 8) | src[4*j+0];
+		s2 =             src[4*j+3];
+		s2 = (s2 << 8) | src[4*j+2];
+		if (s1 >= 32768)
+			s1 -= 65536;
+		if (s2 >= 32768)
+			s2 -= 65536;
+		out1[j] = s1 * (256.0f / (float)0x800000);
+		out2[j] = s2 * (256.0f / (float)0x800000);
+	}
+}
+
+static void pcm16_channel_scalar(float *dest, const unsigned char *src, size_t length, size_t frame_bytes)
+{
+	size_t j;
+	for (j = 0; j < length; j++, src += frame_bytes) {
+		uint_fast32_t s;
+		int_fast32_t t;
+		s =            src[1];
+		s = (s << 8) | src[0];
+		t = (s & 0x8000u)   ? -(int_fast32_t)(((~s) & 0x7FFFu) + 1) : (int_fast32_t)s;
+		dest[j] = t * (256.0f / (float)0x800000);
+	}
+}
+
+static void pcm24_stereo_scalar(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	size_t i;
+	float *out1 = dest_ptr;
+	float *out2 = out1 + dest_stride;
+	assert(nb_channels == 2);
+	for (i = 0; i < length; i++, src += 6) {
+		int_fast32_t t1 = cop_ld_sle24(src + 0);
+		int_fast32_t t2 = cop_ld_sle24(src + 3);
+		out1[i]         = t1 * (1.0f / (float)0x800000);
+		out2[i]         = t2 * (1.0f / (float)0x800000);
+	}
+}
+
+static void pcm24_channel_scalar(float *dest, const unsigned char *src, size_t length, size_t frame_bytes)
+{
+	size_t j;
+	for (j = 0; j < length; j++, src += frame_bytes)
+		dest[j] = cop_ld_sle24(src) * (1.0f / (float)0x800000);
+}
+
+static float ld_pcm32(const unsigned char *src)
+{
+	uint_fast32_t s = cop_ld_ule32(src);
+	int_fast32_t  t = (s & 0x80000000u) ? -(int_fast32_t)((~s) & 0x7FFFFFFFu) - 1 : (int_fast32_t)s;
+	return t * (1.0f / 2147483648.0f);
+}
+
+static float ld_float32(const unsigned char *src)
+{
+	uint32_t u = (uint32_t)cop_ld_ule32(src);
+	float    f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+static void pcm32_stereo_scalar(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	size_t i;
+	float *out1 = dest_ptr;
+	float *out2 = out1 + dest_stride;
+	assert(nb_channels == 2);
+	for (i = 0; i < length; i++, src += 8) {
+		out1[i] = ld_pcm32(src + 0);
+		out2[i] = ld_pcm32(src + 4);
+	}
+}
+
+static void pcm32_channel_scalar(float *dest, const unsigned char *src, size_t length, size_t frame_bytes)
+{
+	size_t j;
+	for (j = 0; j < length; j++, src += frame_bytes)
+		dest[j] = ld_pcm32(src);
+}
+
+static void float32_stereo_scalar(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	size_t i;
+	float *out1 = dest_ptr;
+	float *out2 = out1 + dest_stride;
+	assert(nb_channels == 2);
+	for (i = 0; i < length; i++, src += 8) {
+		out1[i] = ld_float32(src + 0);
+		out2[i] = ld_float32(src + 4);
+	}
+}
+
+static void float32_channel_scalar(float *dest, const unsigned char *src, size_t length, size_t frame_bytes)
+{
+	size_t j;
+	for (j = 0; j < length; j++, src += frame_bytes)
+		dest[j] = ld_float32(src);
+}
+
+SMPLWAV_CONVERT_MAKE_MULTI_KERNEL(pcm16_multi_scalar, pcm16_channel_scalar, 2)
+SMPLWAV_CONVERT_MAKE_MULTI_KERNEL(pcm24_multi_scalar, pcm24_channel_scalar, 3)
+SMPLWAV_CONVERT_MAKE_MULTI_KERNEL(pcm32_multi_scalar, pcm32_channel_scalar, 4)
+SMPLWAV_CONVERT_MAKE_MULTI_KERNEL(float32_multi_scalar, float32_channel_scalar, 4)
+
+const struct smplwav_quantiser SMPLWAV_QUANTISERS[3] =
+{	{32768.0f,      -32768.0f,      32767.0f}
+,	{8388608.0f,    -8388608.0f,    8388607.0f}
+,	{2147483648.0f, -2147483648.0f, 2147483520.0f}
+};
+
+/* Rounds to the nearest integer with ties going to even. This matches the
+ * default behaviour of the SSE conversion instructions. v must be within
+ * the range of a 32-bit integer. */
+static int_fast32_t round_even(float v)
+{
+	int_fast32_t t = (int_fast32_t)v;
+	float        r = v - (float)t;
+	if (r > 0.5f || (r == 0.5f && (t & 1)))
+		t++;
+	else if (r < -0.5f || (r == -0.5f && (t & 1)))
+		t--;
+	return t;
+}
+
+static void update_peak(struct smplwav_convert_clip_stats *stats, float x)
+{
+	float a = (x < 0.0f) ? -x : x;
+	if (a > stats->peak)
+		stats->peak = a;
+}
+
+static int_fast32_t quantise(const struct smplwav_quantiser *q, float x, float noise, struct smplwav_convert_clip_stats *stats)
+{
+	float v = x * q->scale + noise;
+	update_peak(stats, x);
+	if (v < q->lo) {
+		v = q->lo;
+		stats->nb_clipped++;
+	} else if (v > q->hi) {
+		v = q->hi;
+		stats->nb_clipped++;
+	} else if (v != v) {
+		v = q->lo;
+	}
+	return round_even(v);
+}
+
+static void interleave_pcm_scalar(int format, unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	const struct smplwav_quantiser *q = &(SMPLWAV_QUANTISERS[format]);
+	size_t j;
+	for (j = 0; j < length; j++) {
+		unsigned i;
+		for (i = 0; i < nb_channels; i++, seed++) {
+			float        noise = (dither) ? smplwav_convert_tpdf(seed) : 0.0f;
+			uint_fast32_t    u = (uint_fast32_t)quantise(q, src[i * src_stride + j], noise, stats);
+			switch (format) {
+				case SMPLWAV_FORMAT_PCM16:
+					cop_st_ule16(dest, u & 0xFFFFu);
+					dest += 2;
+					break;
+				case SMPLWAV_FORMAT_PCM24:
+					dest[0] = u & 0xFFu;
+					dest[1] = (u >> 8) & 0xFFu;
+					dest[2] = (u >> 16) & 0xFFu;
+					dest += 3;
+					break;
+				default:
+					cop_st_ule32(dest, u & 0xFFFFFFFFu);
+					dest += 4;
+					break;
 			}
 		}
 	}
-	else if (input_format == SMPLWAV_FORMAT_PCM24)
-	{
+}
+
+static void interleave_float32_scalar(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	size_t j;
+	for (j = 0; j < length; j++) {
 		unsigned i;
-		if (nb_channels == 2) {
-			float *out1 = dest;
-			float *out2 = out1 + dest_stride;
-			for (i = 0; i < length; i++, src += 6) {
-				int_fast32_t t1 = cop_ld_sle24(src + 0);
-				int_fast32_t t2 = cop_ld_sle24(src + 3);
-				out1[i]         = t1 * (1.0f / (float)0x800000);
-				out2[i]         = t2 * (1.0f / (float)0x800000);
-			}
-		} else {
-			float *out = dest;
-			for (i = 0; i < nb_channels; i++, out += dest_stride) {
-				unsigned j;
-				for (j = 0; j < length; j++) {
-					out[j] = cop_ld_sle24(src + 3 * (i + nb_channels * j)) * (1.0f / (float)0x800000);
-				}
+		for (i = 0; i < nb_channels; i++, dest += 4) {
+			float    x = src[i * src_stride + j];
+			uint32_t u;
+			update_peak(stats, x);
+			if (x > 1.0f || x < -1.0f)
+				stats->nb_clipped++;
+			memcpy(&u, &x, sizeof(u));
+			cop_st_ule32(dest, u);
+		}
+	}
+}
+
+void smplwav_convert_interleave_scalar(int format, unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	if (format == SMPLWAV_FORMAT_FLOAT32)
+		interleave_float32_scalar(dest, src, src_stride, length, nb_channels, dither, seed, stats);
+	else
+		interleave_pcm_scalar(format, dest, src, src_stride, length, nb_channels, dither, seed, stats);
+}
+
+static void interleave_pcm16_scalar(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	interleave_pcm_scalar(SMPLWAV_FORMAT_PCM16, dest, src, src_stride, length, nb_channels, dither, seed, stats);
+}
+
+static void interleave_pcm24_scalar(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	interleave_pcm_scalar(SMPLWAV_FORMAT_PCM24, dest, src, src_stride, length, nb_channels, dither, seed, stats);
+}
+
+static void interleave_pcm32_scalar(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	interleave_pcm_scalar(SMPLWAV_FORMAT_PCM32, dest, src, src_stride, length, nb_channels, dither, seed, stats);
+}
+
+static void stats_scalar(struct smplwav_convert_channel_stats *stats, const float *src, size_t length, float clip_level)
+{
+	double        sum[4]     = {0.0, 0.0, 0.0, 0.0};
+	double        sum_sq[4]  = {0.0, 0.0, 0.0, 0.0};
+	float         peak       = stats->peak;
+	uint_fast64_t nb_clipped = 0;
+	size_t        j;
+	for (j = 0; j < length; j++) {
+		float x = src[j];
+		float a = (x < 0.0f) ? -x : x;
+		sum[j & 3]    += x;
+		sum_sq[j & 3] += (double)x * x;
+		if (a > peak)
+			peak = a;
+		if (x >= clip_level || x <= -1.0f)
+			nb_clipped++;
+	}
+	stats->peak        = peak;
+	stats->nb_clipped += nb_clipped;
+	smplwav_convert_stats_finish(stats, sum, sum_sq, length);
+}
+
+/* Loaders for the non-float outputs. Integer samples are returned left
+ * justified in 32 bits so that every format can be handled the same way. */
+static int_fast32_t ld_pcm16_sample(const unsigned char *src)
+{
+	uint_fast32_t s = cop_ld_ule16(src);
+	return (s & 0x8000u) ? -(int_fast32_t)(((~s) & 0x7FFFu) + 1) : (int_fast32_t)s;
+}
+
+static int_fast32_t ld_left_justified(int format, const unsigned char *src)
+{
+	uint_fast32_t s;
+	switch (format) {
+		case SMPLWAV_FORMAT_PCM16:
+			return ld_pcm16_sample(src) * 65536;
+		case SMPLWAV_FORMAT_PCM24:
+			return cop_ld_sle24(src) * 256;
+		default:
+			s = cop_ld_ule32(src);
+			return (s & 0x80000000u) ? -(int_fast32_t)((~s) & 0x7FFFFFFFu) - 1 : (int_fast32_t)s;
+	}
+}
+
+/* Rounding float input to an integer output goes through the same quantiser
+ * as the interleaver (without dither or statistics). */
+static int_fast32_t quantise_float32(int format, const unsigned char *src)
+{
+	struct smplwav_convert_clip_stats stats;
+	stats.nb_clipped = 0;
+	stats.peak       = 0.0f;
+	return quantise(&(SMPLWAV_QUANTISERS[format]), ld_float32(src), 0.0f, &stats);
+}
+
+/* Truncating to 16 bits keeps the two most significant bytes of the sample
+ * so there is no need to decode the entire value. */
+static int16_t ld_int16(int format, const unsigned char *src)
+{
+	if (format == SMPLWAV_FORMAT_FLOAT32)
+		return (int16_t)quantise_float32(SMPLWAV_FORMAT_PCM16, src);
+	return (int16_t)ld_pcm16_sample(src + smplwav_format_container_size(format) - 2);
+}
+
+static int32_t ld_int32(int format, const unsigned char *src)
+{
+	if (format == SMPLWAV_FORMAT_FLOAT32)
+		return (int32_t)quantise_float32(SMPLWAV_FORMAT_PCM32, src);
+	return (int32_t)ld_left_justified(format, src);
+}
+
+static double ld_double(int format, const unsigned char *src)
+{
+	if (format == SMPLWAV_FORMAT_FLOAT32)
+		return ld_float32(src);
+	return ld_left_justified(format, src) * (1.0 / 2147483648.0);
+}
+
+uint16_t smplwav_convert_float_to_half(float f)
+{
+	uint32_t      u;
+	uint_fast32_t sign;
+	uint_fast32_t a;
+	uint_fast32_t h;
+	uint_fast32_t rem;
+	uint_fast32_t half;
+	unsigned      shift;
+
+	memcpy(&u, &f, sizeof(u));
+	sign = (u >> 16) & 0x8000u;
+	a    = u & 0x7FFFFFFFu;
+
+	/* Infinity and NaN. NaNs are made quiet and keep the top bits of their
+	 * payload. */
+	if (a >= 0x7F800000u)
+		return (uint16_t)(sign | 0x7C00u | ((a > 0x7F800000u) ? (0x200u | ((a >> 13) & 0x3FFu)) : 0));
+
+	/* Normal halves. A carry out of the mantissa correctly increments the
+	 * exponent and anything too large saturates to infinity. */
+	if (a >= 0x38800000u) {
+		h   = (a >> 13) - 0x1C000u;
+		rem = a & 0x1FFFu;
+		if (rem > 0x1000u || (rem == 0x1000u && (h & 1)))
+			h++;
+		return (uint16_t)(sign | ((h > 0x7C00u) ? 0x7C00u : h));
+	}
+
+	/* Values smaller than half of the smallest subnormal round to zero. */
+	if (a < 0x33000000u)
+		return (uint16_t)sign;
+
+	/* Subnormal halves. */
+	shift = 126 - (unsigned)(a >> 23);
+	a     = (a & 0x7FFFFFu) | 0x800000u;
+	h     = a >> shift;
+	rem   = a & ((1ul << shift) - 1);
+	half  = 1ul << (shift - 1);
+	if (rem > half || (rem == half && (h & 1)))
+		h++;
+	return (uint16_t)(sign | h);
+}
+
+static uint16_t ld_half(int format, const unsigned char *src)
+{
+	if (format == SMPLWAV_FORMAT_FLOAT32)
+		return smplwav_convert_float_to_half(ld_float32(src));
+	return smplwav_convert_float_to_half(ld_left_justified(format, src) * (1.0f / 2147483648.0f));
+}
+
+void smplwav_convert_deinterleave_scalar(int output_type, int format, void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	size_t   container = smplwav_format_container_size(format);
+	unsigned i;
+	for (i = 0; i < nb_channels; i++) {
+		size_t j;
+		for (j = 0; j < length; j++) {
+			const unsigned char *s = src + container * (i + nb_channels * j);
+			size_t               k = i * dest_stride + j;
+			switch (output_type) {
+				case SMPLWAV_CONVERT_OUTPUT_INT16:
+					((int16_t *)dest_ptr)[k] = ld_int16(format, s);
+					break;
+				case SMPLWAV_CONVERT_OUTPUT_INT32:
+					((int32_t *)dest_ptr)[k] = ld_int32(format, s);
+					break;
+				case SMPLWAV_CONVERT_OUTPUT_DOUBLE:
+					((double *)dest_ptr)[k] = ld_double(format, s);
+					break;
+				default:
+					assert(output_type == SMPLWAV_CONVERT_OUTPUT_HALF);
+					((uint16_t *)dest_ptr)[k] = ld_half(format, s);
+					break;
 			}
 		}
 	}
+}
+
+/* Creates a table entry for the output type and input format which calls
+ * smplwav_convert_deinterleave_scalar(). The compiler is able to specialise
+ * the inner loop on the constant arguments. */
+#define MAKE_SCALAR_KERNEL(name_, output_, format_) \
+static void name_(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels) \
+{ \
+	smplwav_convert_deinterleave_scalar(SMPLWAV_CONVERT_OUTPUT_ ## output_, SMPLWAV_FORMAT_ ## format_, dest_ptr, dest_stride, src, length, nb_channels); \
+}
+
+MAKE_SCALAR_KERNEL(int16_pcm16_scalar, INT16, PCM16)
+MAKE_SCALAR_KERNEL(int16_pcm24_scalar, INT16, PCM24)
+MAKE_SCALAR_KERNEL(int16_pcm32_scalar, INT16, PCM32)
+MAKE_SCALAR_KERNEL(int16_float32_scalar, INT16, FLOAT32)
+MAKE_SCALAR_KERNEL(int32_pcm16_scalar, INT32, PCM16)
+MAKE_SCALAR_KERNEL(int32_pcm24_scalar, INT32, PCM24)
+MAKE_SCALAR_KERNEL(int32_pcm32_scalar, INT32, PCM32)
+MAKE_SCALAR_KERNEL(int32_float32_scalar, INT32, FLOAT32)
+MAKE_SCALAR_KERNEL(double_pcm16_scalar, DOUBLE, PCM16)
+MAKE_SCALAR_KERNEL(double_pcm24_scalar, DOUBLE, PCM24)
+MAKE_SCALAR_KERNEL(double_pcm32_scalar, DOUBLE, PCM32)
+MAKE_SCALAR_KERNEL(double_float32_scalar, DOUBLE, FLOAT32)
+MAKE_SCALAR_KERNEL(half_pcm16_scalar, HALF, PCM16)
+MAKE_SCALAR_KERNEL(half_pcm24_scalar, HALF, PCM24)
+MAKE_SCALAR_KERNEL(half_pcm32_scalar, HALF, PCM32)
+MAKE_SCALAR_KERNEL(half_float32_scalar, HALF, FLOAT32)
+
+#undef MAKE_SCALAR_KERNEL
+
+void smplwav_convert_scalar_kernels(struct smplwav_convert_kernels *kernels)
+{
+	smplwav_deinterleave_fn (*f)[SMPLWAV_CONVERT_NB_LAYOUTS] = kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_FLOAT];
+	unsigned i;
+
+	f[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_MONO]     = pcm16_multi_scalar;
+	f[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_STEREO]   = pcm16_stereo_scalar;
+	f[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_MULTI]    = pcm16_multi_scalar;
+	f[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_MONO]     = pcm24_multi_scalar;
+	f[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_STEREO]   = pcm24_stereo_scalar;
+	f[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_MULTI]    = pcm24_multi_scalar;
+	f[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_MONO]     = pcm32_multi_scalar;
+	f[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_STEREO]   = pcm32_stereo_scalar;
+	f[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_MULTI]    = pcm32_multi_scalar;
+	f[SMPLWAV_FORMAT_FLOAT32][SMPLWAV_CONVERT_MONO]   = float32_multi_scalar;
+	f[SMPLWAV_FORMAT_FLOAT32][SMPLWAV_CONVERT_STEREO] = float32_stereo_scalar;
+	f[SMPLWAV_FORMAT_FLOAT32][SMPLWAV_CONVERT_MULTI]  = float32_multi_scalar;
+
+	for (i = 0; i < SMPLWAV_CONVERT_NB_LAYOUTS; i++) {
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_INT16][SMPLWAV_FORMAT_PCM16][i]    = int16_pcm16_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_INT16][SMPLWAV_FORMAT_PCM24][i]    = int16_pcm24_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_INT16][SMPLWAV_FORMAT_PCM32][i]    = int16_pcm32_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_INT16][SMPLWAV_FORMAT_FLOAT32][i]  = int16_float32_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_INT32][SMPLWAV_FORMAT_PCM16][i]    = int32_pcm16_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_INT32][SMPLWAV_FORMAT_PCM24][i]    = int32_pcm24_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_INT32][SMPLWAV_FORMAT_PCM32][i]    = int32_pcm32_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_INT32][SMPLWAV_FORMAT_FLOAT32][i]  = int32_float32_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_DOUBLE][SMPLWAV_FORMAT_PCM16][i]   = double_pcm16_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_DOUBLE][SMPLWAV_FORMAT_PCM24][i]   = double_pcm24_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_DOUBLE][SMPLWAV_FORMAT_PCM32][i]   = double_pcm32_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_DOUBLE][SMPLWAV_FORMAT_FLOAT32][i] = double_float32_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_HALF][SMPLWAV_FORMAT_PCM16][i]     = half_pcm16_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_HALF][SMPLWAV_FORMAT_PCM24][i]     = half_pcm24_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_HALF][SMPLWAV_FORMAT_PCM32][i]     = half_pcm32_scalar;
+		kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_HALF][SMPLWAV_FORMAT_FLOAT32][i]   = half_float32_scalar;
+	}
+
+	kernels->interleave[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_MONO]       = interleave_pcm16_scalar;
+	kernels->interleave[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_STEREO]     = interleave_pcm16_scalar;
+	kernels->interleave[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_MULTI]      = interleave_pcm16_scalar;
+	kernels->interleave[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_MONO]       = interleave_pcm24_scalar;
+	kernels->interleave[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_STEREO]     = interleave_pcm24_scalar;
+	kernels->interleave[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_MULTI]      = interleave_pcm24_scalar;
+	kernels->interleave[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_MONO]       = interleave_pcm32_scalar;
+	kernels->interleave[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_STEREO]     = interleave_pcm32_scalar;
+	kernels->interleave[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_MULTI]      = interleave_pcm32_scalar;
+	kernels->interleave[SMPLWAV_FORMAT_FLOAT32][SMPLWAV_CONVERT_MONO]     = interleave_float32_scalar;
+	kernels->interleave[SMPLWAV_FORMAT_FLOAT32][SMPLWAV_CONVERT_STEREO]   = interleave_float32_scalar;
+	kernels->interleave[SMPLWAV_FORMAT_FLOAT32][SMPLWAV_CONVERT_MULTI]    = interleave_float32_scalar;
+
+	kernels->channel[SMPLWAV_FORMAT_PCM16]   = pcm16_channel_scalar;
+	kernels->channel[SMPLWAV_FORMAT_PCM24]   = pcm24_channel_scalar;
+	kernels->channel[SMPLWAV_FORMAT_PCM32]   = pcm32_channel_scalar;
+	kernels->channel[SMPLWAV_FORMAT_FLOAT32] = float32_channel_scalar;
+
+	kernels->stats         = stats_scalar;
+	kernels->float_to_half = NULL;
+}
+
+static struct smplwav_convert_kernels kernel_table;
+
+static void init_kernels(void)
+{
+	smplwav_convert_scalar_kernels(&kernel_table);
+	smplwav_convert_x86_kernels(&kernel_table);
+}
+
+#if defined(_WIN32)
+
+static INIT_ONCE kernels_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK init_kernels_once(PINIT_ONCE once, PVOID parameter, PVOID *context)
+{
+	(void)once;
+	(void)parameter;
+	(void)context;
+	init_kernels();
+	return TRUE;
+}
+
+/* The kernel table is built the first time a conversion is requested. */
+static const struct smplwav_convert_kernels *get_kernels(void)
+{
+	InitOnceExecuteOnce(&kernels_once, init_kernels_once, NULL, NULL);
+	return &kernel_table;
+}
+
+#else
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/* The kernel table is built the first time a conversion is requested. */
+static const struct smplwav_convert_kernels *get_kernels(void)
+{
+	pthread_once(&kernels_once, init_kernels);
+	return &kernel_table;
+}
+
+#endif
+
+static void deinterleave_multi_blocked(smplwav_deinterleave_fn fn, unsigned char *dest, size_t element_size, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels, int input_format)
+{
+	size_t frame_bytes = nb_channels * (size_t)smplwav_format_container_size(input_format);
+	size_t block_frames;
+
+	if (!frame_bytes)
+		return;
+
+	/* Blocks are a multiple of 8 frames. The gather kernels always leave the
+	 * last frame they are given to scalar code (a gather of it could read
+	 * beyond the end of the source), so every block but the last is passed
+	 * with the first frame of the next block. The vector loops then cover
+	 * the whole block and the extra frame is converted again, to the same
+	 * values, by the next call. */
+	block_frames = SMPLWAV_CONVERT_BLOCK_BYTES / frame_bytes;
+	block_frames = (block_frames < 8) ? 8 : (block_frames & ~(size_t)7);
+
+	while (length > block_frames) {
+		fn(dest, dest_stride, src, block_frames + 1, nb_channels);
+		dest   += block_frames * element_size;
+		src    += block_frames * frame_bytes;
+		length -= block_frames;
+	}
+
+	fn(dest, dest_stride, src, length, nb_channels);
+}
+
+/* Produces half precision output using the float kernels and the hardware
+ * float to half conversion. Blocks of frames are converted into a small
+ * buffer on the stack which stays in L1 between the two passes. */
+static void deinterleave_half_via_float(const struct smplwav_convert_kernels *kernels, uint16_t *dest, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels, int input_format)
+{
+	float                   scratch[SMPLWAV_CONVERT_HALF_SCRATCH];
+	smplwav_deinterleave_fn fn           = kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_FLOAT][input_format][smplwav_convert_layout(nb_channels)];
+	size_t                  frame_bytes  = nb_channels * (size_t)smplwav_format_container_size(input_format);
+	size_t                  block_frames = (SMPLWAV_CONVERT_HALF_SCRATCH / nb_channels) & ~(size_t)7;
+
+	while (length) {
+		size_t   count = (length > block_frames) ? block_frames : length;
+		unsigned i;
+		fn(scratch, count, src, count, nb_channels);
+		for (i = 0; i < nb_channels; i++)
+			kernels->float_to_half(dest + i * dest_stride, scratch + i * count, count);
+		dest   += count;
+		src    += count * frame_bytes;
+		length -= count;
+	}
+}
+
+static void deinterleave(void *dest, size_t dest_stride, int output_type, const unsigned char *src, size_t length, unsigned nb_channels, int input_format)
+{
+	const struct smplwav_convert_kernels *kernels = get_kernels();
+	unsigned                              layout;
+	smplwav_deinterleave_fn               fn;
+
+	assert(input_format >= 0 && input_format < SMPLWAV_CONVERT_NB_FORMATS);
+	assert(output_type >= 0 && output_type < SMPLWAV_CONVERT_NB_OUTPUTS);
+
+	if (output_type == SMPLWAV_CONVERT_OUTPUT_HALF && kernels->float_to_half != NULL && nb_channels && nb_channels <= SMPLWAV_CONVERT_HALF_SCRATCH / 8) {
+		deinterleave_half_via_float(kernels, dest, dest_stride, src, length, nb_channels, input_format);
+		return;
+	}
+
+	layout = smplwav_convert_layout(nb_channels);
+	fn     = kernels->deinterleave[output_type][input_format][layout];
+
+	if (layout == SMPLWAV_CONVERT_MULTI)
+		deinterleave_multi_blocked(fn, dest, smplwav_convert_output_size(output_type), dest_stride, src, length, nb_channels, input_format);
 	else
-	{
-		abort();
+		fn(dest, dest_stride, src, length, nb_channels);
+}
+
+void smplwav_convert_deinterleave_floats(float *dest, size_t dest_stride, const unsigned char *src, unsigned length, unsigned nb_channels, int input_format)
+{
+	deinterleave(dest, dest_stride, SMPLWAV_CONVERT_OUTPUT_FLOAT, src, length, nb_channels, input_format);
+}
+
+void smplwav_convert_deinterleave(void *dest, size_t dest_stride, int output_type, const unsigned char *src, unsigned length, unsigned nb_channels, int input_format)
+{
+	deinterleave(dest, dest_stride, output_type, src, length, nb_channels, input_format);
+}
+
+struct deinterleave_job {
+	float               *dest;
+	size_t               dest_stride;
+	const unsigned char *src;
+	size_t               length;
+	size_t               job_frames;
+	size_t               frame_bytes;
+	unsigned             nb_channels;
+	int                  input_format;
+};
+
+static void run_deinterleave_job(void *context, unsigned job)
+{
+	const struct deinterleave_job *j = context;
+	size_t start = job * j->job_frames;
+	if (start < j->length) {
+		size_t count = j->length - start;
+		if (count > j->job_frames)
+			count = j->job_frames;
+		deinterleave(j->dest + start, j->dest_stride, SMPLWAV_CONVERT_OUTPUT_FLOAT, j->src + start * j->frame_bytes, count, j->nb_channels, j->input_format);
+	}
+}
+
+void smplwav_convert_deinterleave_floats_parallel(float *dest, size_t dest_stride, const unsigned char *src, unsigned length, unsigned nb_channels, int input_format, unsigned max_jobs, smplwav_executor_fn executor, void *executor_context)
+{
+	struct deinterleave_job job;
+	unsigned                nb_jobs;
+	unsigned                i;
+
+	job.dest         = dest;
+	job.dest_stride  = dest_stride;
+	job.src          = src;
+	job.length       = length;
+	job.frame_bytes  = nb_channels * (size_t)smplwav_format_container_size(input_format);
+	job.nb_channels  = nb_channels;
+	job.input_format = input_format;
+
+	if (!max_jobs)
+		max_jobs = 1;
+
+	/* Job boundaries are placed on multiples of 64 frames so that no two
+	 * jobs write to the same cache line of a (suitably aligned) output. */
+	job.job_frames   = (length + (size_t)max_jobs - 1) / max_jobs;
+	if (job.job_frames < SMPLWAV_CONVERT_MIN_JOB_FRAMES)
+		job.job_frames = SMPLWAV_CONVERT_MIN_JOB_FRAMES;
+	job.job_frames   = (job.job_frames + 63) & ~(size_t)63;
+	nb_jobs          = (unsigned)((length + job.job_frames - 1) / job.job_frames);
+
+	if (executor != NULL && nb_jobs > 1) {
+		/* Select the kernels before any worker needs them. */
+		(void)get_kernels();
+		executor(executor_context, run_deinterleave_job, &job, nb_jobs);
+	} else {
+		for (i = 0; i < nb_jobs; i++)
+			run_deinterleave_job(&job, i);
+	}
+}
+
+/* Returns the number of frames to process at once when converting channels
+ * one at a time so that the block of source frames stays in L1. */
+static size_t channel_block_frames(size_t frame_bytes, size_t max_frames)
+{
+	size_t block_frames = SMPLWAV_CONVERT_BLOCK_BYTES / frame_bytes;
+	block_frames = (block_frames < 8) ? 8 : (block_frames & ~(size_t)7);
+	return (block_frames > max_frames) ? max_frames : block_frames;
+}
+
+void smplwav_convert_select_floats(float *dest, size_t dest_stride, const unsigned *channel_map, unsigned nb_outputs, const unsigned char *src, unsigned length, unsigned nb_channels, int input_format)
+{
+	smplwav_channel_fn fn;
+	size_t             container;
+	size_t             frame_bytes;
+	size_t             block_frames;
+	size_t             start;
+
+	assert(input_format >= 0 && input_format < SMPLWAV_CONVERT_NB_FORMATS);
+
+	fn           = get_kernels()->channel[input_format];
+	container    = smplwav_format_container_size(input_format);
+	frame_bytes  = nb_channels * container;
+	if (!frame_bytes)
+		return;
+	block_frames = channel_block_frames(frame_bytes, length);
+
+	for (start = 0; start < length; start += block_frames) {
+		size_t   count = (length - start > block_frames) ? block_frames : (length - start);
+		unsigned o;
+		for (o = 0; o < nb_outputs; o++) {
+			assert(channel_map[o] < nb_channels);
+			fn(dest + o * dest_stride + start, src + start * frame_bytes + channel_map[o] * container, count, frame_bytes);
+		}
+	}
+}
+
+void smplwav_convert_mix_floats(float *dest, size_t dest_stride, const float *matrix, unsigned nb_outputs, const unsigned char *src, unsigned length, unsigned nb_channels, int input_format)
+{
+	float              scratch[SMPLWAV_CONVERT_MIX_SCRATCH];
+	smplwav_channel_fn fn;
+	size_t             container;
+	size_t             frame_bytes;
+	size_t             block_frames;
+	size_t             start;
+
+	assert(input_format >= 0 && input_format < SMPLWAV_CONVERT_NB_FORMATS);
+
+	fn           = get_kernels()->channel[input_format];
+	container    = smplwav_format_container_size(input_format);
+	frame_bytes  = nb_channels * container;
+	block_frames = channel_block_frames(frame_bytes ? frame_bytes : 1, SMPLWAV_CONVERT_MIX_SCRATCH);
+
+	for (start = 0; start < length; start += block_frames) {
+		size_t   count = (length - start > block_frames) ? block_frames : (length - start);
+		unsigned o;
+		unsigned c;
+
+		for (o = 0; o < nb_outputs; o++)
+			memset(dest + o * dest_stride + start, 0, count * sizeof(float));
+
+		for (c = 0; c < nb_channels; c++) {
+			for (o = 0; o < nb_outputs && matrix[o * nb_channels + c] == 0.0f; o++)
+				;
+			if (o == nb_outputs)
+				continue;
+
+			fn(scratch, src + start * frame_bytes + c * container, count, frame_bytes);
+
+			for (; o < nb_outputs; o++) {
+				const float gain = matrix[o * nb_channels + c];
+				float      *out  = dest + o * dest_stride + start;
+				size_t      j;
+				if (gain == 0.0f)
+					continue;
+				for (j = 0; j < count; j++)
+					out[j] += gain * scratch[j];
+			}
+		}
 	}
 }
 
+/* The values of the most positive sample of each format after conversion to
+ * float. The most negative sample is always -1.0. */
+static const float CLIP_LEVELS[SMPLWAV_CONVERT_NB_FORMATS] =
+{	32767.0f / 32768.0f
+,	8388607.0f / 8388608.0f
+,	1.0f
+,	1.0f
+};
+
+void smplwav_convert_deinterleave_floats_stats(float *dest, size_t dest_stride, const unsigned char *src, unsigned length, unsigned nb_channels, int input_format, struct smplwav_convert_channel_stats *stats)
+{
+	const struct smplwav_convert_kernels *kernels = get_kernels();
+	smplwav_deinterleave_fn               fn;
+	size_t                                frame_bytes;
+	size_t                                block_frames;
+	size_t                                start;
+
+	assert(input_format >= 0 && input_format < SMPLWAV_CONVERT_NB_FORMATS);
+
+	fn          = kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_FLOAT][input_format][smplwav_convert_layout(nb_channels)];
+	frame_bytes = nb_channels * (size_t)smplwav_format_container_size(input_format);
+	if (!frame_bytes)
+		return;
+	block_frames = channel_block_frames(frame_bytes, length);
+
+	for (start = 0; start < length; start += block_frames) {
+		size_t   count = (length - start > block_frames) ? block_frames : (length - start);
+		unsigned i;
+		fn(dest + start, dest_stride, src + start * frame_bytes, count, nb_channels);
+		for (i = 0; i < nb_channels; i++)
+			kernels->stats(&(stats[i]), dest + i * dest_stride + start, count, CLIP_LEVELS[input_format]);
+	}
+}
+
+int smplwav_convert_range(const struct smplwav *wav, void *dest, size_t dest_stride, int output_type, uint_fast64_t start, uint_fast32_t count)
+{
+	size_t frame_bytes = wav->format.channels * (size_t)smplwav_format_container_size(wav->format.format);
+
+	if (wav->data == NULL || start > wav->data_frames || count > wav->data_frames - start)
+		return 1;
+
+	assert(dest_stride >= count);
+
+	deinterleave(dest, dest_stride, output_type, (const unsigned char *)wav->data + (size_t)start * frame_bytes, count, wav->format.channels, wav->format.format);
+	return 0;
+}
+
+int smplwav_convert_range_floats(const struct smplwav *wav, float *dest, size_t dest_stride, uint_fast64_t start, uint_fast32_t count)
+{
+	return smplwav_convert_range(wav, dest, dest_stride, SMPLWAV_CONVERT_OUTPUT_FLOAT, start, count);
+}
+
+void smplwav_convert_interleave_floats(unsigned char *dest, const float *src, size_t src_stride, unsigned length, unsigned nb_channels, int output_format, unsigned flags, uint_fast32_t dither_seed, struct smplwav_convert_clip_stats *stats)
+{
+	struct smplwav_convert_clip_stats local;
+	unsigned                          layout;
+	smplwav_interleave_fn             fn;
+	int                               dither = (flags & SMPLWAV_CONVERT_FLAG_DITHER) && output_format != SMPLWAV_FORMAT_FLOAT32;
+	size_t                            frame_bytes = nb_channels * (size_t)smplwav_format_container_size(output_format);
+	size_t                            block_frames;
+	size_t                            remaining = length;
+
+	assert(output_format >= 0 && output_format < SMPLWAV_CONVERT_NB_FORMATS);
+
+	layout           = smplwav_convert_layout(nb_channels);
+	fn               = get_kernels()->interleave[output_format][layout];
+	local.nb_clipped = 0;
+	local.peak       = 0.0f;
+
+	if (!frame_bytes)
+		return;
+
+	/* See deinterleave_multi_blocked(). The multichannel kernels write each
+	 * block once per channel. */
+	block_frames = SMPLWAV_CONVERT_BLOCK_BYTES / frame_bytes;
+	block_frames = (layout != SMPLWAV_CONVERT_MULTI) ? remaining : ((block_frames < 8) ? 8 : (block_frames & ~(size_t)7));
+
+	while (remaining > block_frames) {
+		fn(dest, src, src_stride, block_frames, nb_channels, dither, dither_seed, &local);
+		dest        += block_frames * frame_bytes;
+		src         += block_frames;
+		dither_seed += (uint_fast32_t)(block_frames * nb_channels);
+		remaining   -= block_frames;
+	}
+
+	fn(dest, src, src_stride, remaining, nb_channels, dither, dither_seed, &local);
+
+	if (stats != NULL) {
+		stats->nb_clipped += local.nb_clipped;
+		if (local.peak > stats->peak)
+			stats->peak = local.peak;
+	}
+}
@@ -0,0 +1,170 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#ifndef SMPLWAV_CONVERT_INTERNAL_H
+#define SMPLWAV_CONVERT_INTERNAL_H
+
+#include "smplwav/smplwav_convert.h"
+
+/* A deinterleave kernel converts "length" frames of "nb_channels" interleaved
+ * samples at "src" into planar data at "dest" with the same semantics as
+ * smplwav_convert_deinterleave(). The type of "dest" depends on which output
+ * type the kernel is registered for. Kernels must never read beyond the last
+ * byte of the last frame as "src" is frequently a view into a memory mapped
+ * file. */
+typedef void (*smplwav_deinterleave_fn)(void *dest, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels);
+
+/* A channel kernel converts "length" samples of a single channel into floats.
+ * "src" points at the first sample of the channel and consecutive samples are
+ * "frame_bytes" apart. The same rules about reading beyond the last sample
+ * apply. */
+typedef void (*smplwav_channel_fn)(float *dest, const unsigned char *src, size_t length, size_t frame_bytes);
+
+/* Defines a float deinterleave kernel for any number of channels which calls
+ * a channel kernel for each channel in turn. */
+#define SMPLWAV_CONVERT_MAKE_MULTI_KERNEL(name_, channel_fn_, container_size_) \
+static void name_(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels) \
+{ \
+	float   *dest = dest_ptr; \
+	unsigned i; \
+	for (i = 0; i < nb_channels; i++, dest += dest_stride) \
+		channel_fn_(dest, src + (container_size_) * i, length, (container_size_) * (size_t)nb_channels); \
+}
+
+/* An interleave kernel quantises "length" frames of planar floats from "src"
+ * into interleaved samples at "dest" (see smplwav_convert_interleave_floats).
+ * If "dither" is non-zero, TPDF noise generated by smplwav_convert_tpdf() from
+ * "seed" plus the interleaved index of each sample is added before rounding.
+ * The clip count and peak are accumulated into "stats". */
+typedef void (*smplwav_interleave_fn)(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats);
+
+/* A statistics kernel accumulates the statistics of "length" floats into
+ * "stats". Samples greater than or equal to "clip_level" or less than or equal
+ * to -1.0 are counted as clipped. The sum and sum of squares are accumulated
+ * in double precision into four partial sums (sample j goes into partial sum
+ * j % 4) which are combined as (s0 + s2) + (s1 + s3) before being added to
+ * "stats". Every implementation must follow this order exactly. */
+typedef void (*smplwav_stats_fn)(struct smplwav_convert_channel_stats *stats, const float *src, size_t length, float clip_level);
+
+/* Quantisation ranges of the PCM formats. The upper limit for PCM32 is the
+ * largest float below 2^31. Values are scaled, offset by dither, clamped to
+ * [lo, hi] and then rounded to the nearest integer (ties to even). */
+struct smplwav_quantiser {
+	float scale;
+	float lo;
+	float hi;
+};
+
+extern const struct smplwav_quantiser SMPLWAV_QUANTISERS[3];
+
+/* Maps a 32-bit sample index onto TPDF noise in the range (-1, 1) LSB. The
+ * hash is the "lowbias32" integer hash by Chris Wellons. Both 16-bit halves
+ * of the hash are used as independent uniform variables. */
+static COP_ATTR_UNUSED float smplwav_convert_tpdf(uint_fast32_t x)
+{
+	x  = x & 0xFFFFFFFFu;
+	x ^= x >> 16;
+	x  = (x * 0x7FEB352Du) & 0xFFFFFFFFu;
+	x ^= x >> 15;
+	x  = (x * 0x846CA68Bu) & 0xFFFFFFFFu;
+	x ^= x >> 16;
+	return ((int_fast32_t)(x & 0xFFFFu) - (int_fast32_t)(x >> 16)) * (1.0f / 65536.0f);
+}
+
+/* Kernels are specialised on the number of channels in the stream. */
+#define SMPLWAV_CONVERT_MONO       (0)
+#define SMPLWAV_CONVERT_STEREO     (1)
+#define SMPLWAV_CONVERT_MULTI      (2)
+#define SMPLWAV_CONVERT_NB_LAYOUTS (3)
+
+#define SMPLWAV_CONVERT_NB_FORMATS (4)
+#define SMPLWAV_CONVERT_NB_OUTPUTS (5)
+
+static COP_ATTR_UNUSED unsigned smplwav_convert_layout(unsigned nb_channels)
+{
+	return (nb_channels == 1) ? SMPLWAV_CONVERT_MONO : ((nb_channels == 2) ? SMPLWAV_CONVERT_STEREO : SMPLWAV_CONVERT_MULTI);
+}
+
+/* Streams with more than two channels are converted in blocks of frames
+ * which occupy roughly this many bytes of interleaved data. The multichannel
+ * kernels make one pass over the block per channel; keeping the block small
+ * enough to stay resident in L1 means every source byte is only fetched from
+ * memory once regardless of the channel count. */
+#define SMPLWAV_CONVERT_BLOCK_BYTES (16384)
+
+/* Number of floats of stack space used to hold one channel of a block of
+ * frames while it is mixed into the outputs. */
+#define SMPLWAV_CONVERT_MIX_SCRATCH (512)
+
+/* Converts floats to IEEE half precision with round to nearest even. */
+typedef void (*smplwav_float_to_half_fn)(uint16_t *dest, const float *src, size_t length);
+
+/* Number of floats of stack space used when half precision output is
+ * produced by converting blocks to float first. */
+#define SMPLWAV_CONVERT_HALF_SCRATCH (2048)
+
+/* The deinterleave table is indexed by [SMPLWAV_CONVERT_OUTPUT_*]
+ * [SMPLWAV_FORMAT_*][SMPLWAV_CONVERT_* layout]. The interleave table is
+ * indexed by [SMPLWAV_FORMAT_*][SMPLWAV_CONVERT_* layout] and the channel
+ * table by [SMPLWAV_FORMAT_*].
+ *
+ * float_to_half is only set if there is a hardware implementation. In that
+ * case half precision output is produced by the float kernels followed by
+ * float_to_half rather than by the direct half kernels (which always give
+ * the same result). */
+struct smplwav_convert_kernels {
+	smplwav_deinterleave_fn  deinterleave[SMPLWAV_CONVERT_NB_OUTPUTS][SMPLWAV_CONVERT_NB_FORMATS][SMPLWAV_CONVERT_NB_LAYOUTS];
+	smplwav_interleave_fn    interleave[SMPLWAV_CONVERT_NB_FORMATS][SMPLWAV_CONVERT_NB_LAYOUTS];
+	smplwav_channel_fn       channel[SMPLWAV_CONVERT_NB_FORMATS];
+	smplwav_stats_fn         stats;
+	smplwav_float_to_half_fn float_to_half;
+};
+
+/* Populates kernels with the portable C implementations. These are the
+ * reference implementations: every other kernel must produce bit-identical
+ * output to them. */
+void smplwav_convert_scalar_kernels(struct smplwav_convert_kernels *kernels);
+
+/* The reference interleaver for any format and channel count. Used by the
+ * SIMD kernels to handle frames at the end of a buffer. */
+void smplwav_convert_interleave_scalar(int format, unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats);
+
+/* The reference implementation of every non-float output type for any
+ * format and channel count. Used by the SIMD kernels to handle frames at the
+ * end of a buffer. */
+void smplwav_convert_deinterleave_scalar(int output_type, int format, void *dest, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels);
+
+/* Converts a float to IEEE half precision rounding to nearest even. */
+uint16_t smplwav_convert_float_to_half(float f);
+
+/* Finishes a statistics kernel by adding the partial sums to "stats". */
+static COP_ATTR_UNUSED void smplwav_convert_stats_finish(struct smplwav_convert_channel_stats *stats, const double *sum, const double *sum_sq, size_t length)
+{
+	stats->sum        += (sum[0] + sum[2]) + (sum[1] + sum[3]);
+	stats->sum_sq     += (sum_sq[0] + sum_sq[2]) + (sum_sq[1] + sum_sq[3]);
+	stats->nb_samples += length;
+}
+
+/* Replaces entries in kernels with SIMD implementations which are supported
+ * by the CPU we are running on. Does nothing on non-x86 targets or if
+ * SMPLWAV_NO_SIMD is defined. */
+void smplwav_convert_x86_kernels(struct smplwav_convert_kernels *kernels);
+
+#endif /* SMPLWAV_CONVERT_INTERNAL_H */
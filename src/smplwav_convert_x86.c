@@ -0,0 +1,1130 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#include "smplwav_convert_internal.h"
+
+#if !defined(SMPLWAV_NO_SIMD) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+
+#include <immintrin.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SMPLWAV_TARGET_SSE2
+#define SMPLWAV_TARGET_SSSE3
+#define SMPLWAV_TARGET_AVX2
+#define SMPLWAV_TARGET_F16C
+#else
+#define SMPLWAV_TARGET_SSE2  __attribute__((target("sse2")))
+#define SMPLWAV_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define SMPLWAV_TARGET_AVX2  __attribute__((target("avx2")))
+#define SMPLWAV_TARGET_F16C  __attribute__((target("avx,f16c")))
+#endif
+
+#define CPU_SSE2  (1u)
+#define CPU_SSSE3 (2u)
+#define CPU_AVX2  (4u)
+#define CPU_F16C  (8u)
+
+static unsigned get_cpu_features(void)
+{
+	unsigned features = 0;
+#if defined(_MSC_VER)
+	int regs[4];
+	__cpuid(regs, 0);
+	if (regs[0] >= 1) {
+		int has_osxsave;
+		__cpuid(regs, 1);
+		if (regs[3] & (1 << 26))
+			features |= CPU_SSE2;
+		if (regs[2] & (1 << 9))
+			features |= CPU_SSSE3;
+		has_osxsave = (regs[2] & (1 << 27)) != 0;
+		if (has_osxsave && (regs[2] & (1 << 29)) && (_xgetbv(0) & 0x6) == 0x6)
+			features |= CPU_F16C;
+		__cpuid(regs, 0);
+		if (regs[0] >= 7 && has_osxsave && (_xgetbv(0) & 0x6) == 0x6) {
+			__cpuidex(regs, 7, 0);
+			if (regs[1] & (1 << 5))
+				features |= CPU_AVX2;
+		}
+	}
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		features |= CPU_SSE2;
+	if (__builtin_cpu_supports("ssse3"))
+		features |= CPU_SSSE3;
+	if (__builtin_cpu_supports("avx2"))
+		features |= CPU_AVX2;
+	if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"))
+		features |= CPU_F16C;
+#endif
+	return features;
+}
+
+/* PCM16
+ * -------------------------------------------------------------------------*/
+
+SMPLWAV_TARGET_SSE2
+static void pcm16_mono_sse2(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	float *dest = dest_ptr;
+	const __m128 scale = _mm_set1_ps(256.0f / (float)0x800000);
+	size_t j;
+	for (j = 0; j + 8 <= length; j += 8, src += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)src);
+		_mm_storeu_ps(dest + j,     _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)), scale));
+		_mm_storeu_ps(dest + j + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)), scale));
+	}
+	for (; j < length; j++, src += 2)
+		dest[j] = ((int16_t)cop_ld_ule16(src)) * (256.0f / (float)0x800000);
+}
+
+SMPLWAV_TARGET_SSE2
+static void pcm16_stereo_sse2(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	const __m128 scale = _mm_set1_ps(256.0f / (float)0x800000);
+	float *out1 = dest_ptr;
+	float *out2 = out1 + dest_stride;
+	size_t j;
+	for (j = 0; j + 4 <= length; j += 4, src += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)src);
+		__m128i l = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+		__m128i r = _mm_srai_epi32(v, 16);
+		_mm_storeu_ps(out1 + j, _mm_mul_ps(_mm_cvtepi32_ps(l), scale));
+		_mm_storeu_ps(out2 + j, _mm_mul_ps(_mm_cvtepi32_ps(r), scale));
+	}
+	for (; j < length; j++, src += 4) {
+		out1[j] = ((int16_t)cop_ld_ule16(src + 0)) * (256.0f / (float)0x800000);
+		out2[j] = ((int16_t)cop_ld_ule16(src + 2)) * (256.0f / (float)0x800000);
+	}
+}
+
+/* There is no efficient SSE2 way to gather samples with an arbitrary stride,
+ * so the 16-bit lanes are inserted one at a time. This still removes the
+ * per-sample sign extension branch and converts four samples at once. */
+SMPLWAV_TARGET_SSE2
+static void pcm16_channel_sse2(float *dest, const unsigned char *src, size_t length, size_t frame_bytes)
+{
+	const __m128 scale = _mm_set1_ps(256.0f / (float)0x800000);
+	size_t j;
+	for (j = 0; j + 8 <= length; j += 8, src += 8 * frame_bytes) {
+		__m128i v = _mm_setzero_si128();
+		v = _mm_insert_epi16(v, cop_ld_ule16(src + 0 * frame_bytes), 0);
+		v = _mm_insert_epi16(v, cop_ld_ule16(src + 1 * frame_bytes), 1);
+		v = _mm_insert_epi16(v, cop_ld_ule16(src + 2 * frame_bytes), 2);
+		v = _mm_insert_epi16(v, cop_ld_ule16(src + 3 * frame_bytes), 3);
+		v = _mm_insert_epi16(v, cop_ld_ule16(src + 4 * frame_bytes), 4);
+		v = _mm_insert_epi16(v, cop_ld_ule16(src + 5 * frame_bytes), 5);
+		v = _mm_insert_epi16(v, cop_ld_ule16(src + 6 * frame_bytes), 6);
+		v = _mm_insert_epi16(v, cop_ld_ule16(src + 7 * frame_bytes), 7);
+		_mm_storeu_ps(dest + j,     _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)), scale));
+		_mm_storeu_ps(dest + j + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)), scale));
+	}
+	for (; j < length; j++, src += frame_bytes)
+		dest[j] = ((int16_t)cop_ld_ule16(src)) * (256.0f / (float)0x800000);
+}
+
+SMPLWAV_CONVERT_MAKE_MULTI_KERNEL(pcm16_multi_sse2, pcm16_channel_sse2, 2)
+
+SMPLWAV_TARGET_AVX2
+static void pcm16_mono_avx2(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	float *dest = dest_ptr;
+	const __m256 scale = _mm256_set1_ps(256.0f / (float)0x800000);
+	size_t j;
+	for (j = 0; j + 16 <= length; j += 16, src += 32) {
+		__m256i a = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + 0)));
+		__m256i b = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + 16)));
+		_mm256_storeu_ps(dest + j,     _mm256_mul_ps(_mm256_cvtepi32_ps(a), scale));
+		_mm256_storeu_ps(dest + j + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(b), scale));
+	}
+	if (j < length)
+		pcm16_mono_sse2(dest + j, dest_stride, src, length - j, nb_channels);
+}
+
+SMPLWAV_TARGET_AVX2
+static void pcm16_stereo_avx2(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	const __m256 scale = _mm256_set1_ps(256.0f / (float)0x800000);
+	float *out1 = dest_ptr;
+	float *out2 = out1 + dest_stride;
+	size_t j;
+	for (j = 0; j + 8 <= length; j += 8, src += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)src);
+		__m256i l = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+		__m256i r = _mm256_srai_epi32(v, 16);
+		_mm256_storeu_ps(out1 + j, _mm256_mul_ps(_mm256_cvtepi32_ps(l), scale));
+		_mm256_storeu_ps(out2 + j, _mm256_mul_ps(_mm256_cvtepi32_ps(r), scale));
+	}
+	if (j < length)
+		pcm16_stereo_sse2(out1 + j, dest_stride, src, length - j, nb_channels);
+}
+
+/* Gathers load 32 bits from each offset, so a gather of the final sample of
+ * the buffer would read two bytes beyond its end. The vector loop therefore
+ * always leaves at least one trailing frame to the scalar loop. */
+SMPLWAV_TARGET_AVX2
+static void pcm16_channel_avx2(float *dest, const unsigned char *src, size_t length, size_t frame_bytes)
+{
+	const __m256  scale   = _mm256_set1_ps(256.0f / (float)0x800000);
+	const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int)frame_bytes));
+	size_t j;
+	for (j = 0; j + 8 < length; j += 8, src += 8 * frame_bytes) {
+		__m256i v = _mm256_i32gather_epi32((const int *)src, offsets, 1);
+		v = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+		_mm256_storeu_ps(dest + j, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+	}
+	for (; j < length; j++, src += frame_bytes)
+		dest[j] = ((int16_t)cop_ld_ule16(src)) * (256.0f / (float)0x800000);
+}
+
+SMPLWAV_CONVERT_MAKE_MULTI_KERNEL(pcm16_multi_avx2, pcm16_channel_avx2, 2)
+
+/* PCM24
+ * -------------------------------------------------------------------------*/
+
+/* Loads four bytes starting at a 24-bit sample. The caller must ensure that
+ * the byte following the sample is readable. */
+static int32_t ld_u32_unaligned(const unsigned char *src)
+{
+	int32_t x;
+	memcpy(&x, src, 4);
+	return x;
+}
+
+/* The 24-bit kernels place each packed sample in the upper three bytes of a
+ * 32-bit lane with pshufb. The lane then holds the sample multiplied by 256
+ * which converts to float exactly, so scaling by 2^-31 gives the same
+ * result as the scalar path. Every 16 byte load only consumes 12 bytes; the
+ * loop bounds are chosen so that the final load never extends past the end
+ * of the last frame. */
+
+SMPLWAV_TARGET_SSSE3
+static void pcm24_mono_ssse3(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	float *dest = dest_ptr;
+	const __m128  scale = _mm_set1_ps(1.0f / 2147483648.0f);
+	const __m128i shuf  = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	size_t j;
+	for (j = 0; j + 10 <= length; j += 8, src += 24) {
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 0)), shuf);
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 12)), shuf);
+		_mm_storeu_ps(dest + j,     _mm_mul_ps(_mm_cvtepi32_ps(a), scale));
+		_mm_storeu_ps(dest + j + 4, _mm_mul_ps(_mm_cvtepi32_ps(b), scale));
+	}
+	for (; j < length; j++, src += 3)
+		dest[j] = cop_ld_sle24(src) * (1.0f / (float)0x800000);
+}
+
+SMPLWAV_TARGET_SSSE3
+static void pcm24_stereo_ssse3(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	const __m128  scale = _mm_set1_ps(1.0f / 2147483648.0f);
+	const __m128i shuf  = _mm_setr_epi8(-1, 0, 1, 2, -1, 6, 7, 8, -1, 3, 4, 5, -1, 9, 10, 11);
+	float *out1 = dest_ptr;
+	float *out2 = out1 + dest_stride;
+	size_t j;
+	for (j = 0; j + 5 <= length; j += 4, src += 24) {
+		/* a = L0 L1 R0 R1, b = L2 L3 R2 R3 */
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 0)), shuf);
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 12)), shuf);
+		_mm_storeu_ps(out1 + j, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi64(a, b)), scale));
+		_mm_storeu_ps(out2 + j, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi64(a, b)), scale));
+	}
+	for (; j < length; j++, src += 6) {
+		out1[j] = cop_ld_sle24(src + 0) * (1.0f / (float)0x800000);
+		out2[j] = cop_ld_sle24(src + 3) * (1.0f / (float)0x800000);
+	}
+}
+
+SMPLWAV_TARGET_SSE2
+static void pcm24_channel_sse2(float *dest, const unsigned char *src, size_t length, size_t frame_bytes)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+	size_t j;
+	for (j = 0; j + 4 < length; j += 4, src += 4 * frame_bytes) {
+		__m128i v = _mm_setr_epi32
+			(ld_u32_unaligned(src + 0 * frame_bytes)
+			,ld_u32_unaligned(src + 1 * frame_bytes)
+			,ld_u32_unaligned(src + 2 * frame_bytes)
+			,ld_u32_unaligned(src + 3 * frame_bytes)
+			);
+		_mm_storeu_ps(dest + j, _mm_mul_ps(_mm_cvtepi32_ps(_mm_slli_epi32(v, 8)), scale));
+	}
+	for (; j < length; j++, src += frame_bytes)
+		dest[j] = cop_ld_sle24(src) * (1.0f / (float)0x800000);
+}
+
+SMPLWAV_CONVERT_MAKE_MULTI_KERNEL(pcm24_multi_sse2, pcm24_channel_sse2, 3)
+
+SMPLWAV_TARGET_AVX2
+static __m256i ld_pcm24x8_avx2(const unsigned char *src, __m256i shuf)
+{
+	__m256i v = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)src));
+	v = _mm256_inserti128_si256(v, _mm_loadu_si128((const __m128i *)(src + 12)), 1);
+	return _mm256_shuffle_epi8(v, shuf);
+}
+
+SMPLWAV_TARGET_AVX2
+static void pcm24_mono_avx2(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	float *dest = dest_ptr;
+	const __m256  scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+	const __m256i shuf  = _mm256_setr_epi8
+		(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11
+		,-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11
+		);
+	size_t j;
+	for (j = 0; j + 18 <= length; j += 16, src += 48) {
+		__m256i a = ld_pcm24x8_avx2(src + 0, shuf);
+		__m256i b = ld_pcm24x8_avx2(src + 24, shuf);
+		_mm256_storeu_ps(dest + j,     _mm256_mul_ps(_mm256_cvtepi32_ps(a), scale));
+		_mm256_storeu_ps(dest + j + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(b), scale));
+	}
+	if (j < length)
+		pcm24_mono_ssse3(dest + j, dest_stride, src, length - j, nb_channels);
+}
+
+SMPLWAV_TARGET_AVX2
+static void pcm24_stereo_avx2(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	const __m256  scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+	const __m256i shuf  = _mm256_setr_epi8
+		(-1, 0, 1, 2, -1, 6, 7, 8, -1, 3, 4, 5, -1, 9, 10, 11
+		,-1, 0, 1, 2, -1, 6, 7, 8, -1, 3, 4, 5, -1, 9, 10, 11
+		);
+	float *out1 = dest_ptr;
+	float *out2 = out1 + dest_stride;
+	size_t j;
+	for (j = 0; j + 9 <= length; j += 8, src += 48) {
+		/* a = L0 L1 R0 R1 | L2 L3 R2 R3, b = L4 L5 R4 R5 | L6 L7 R6 R7 */
+		__m256i a = ld_pcm24x8_avx2(src + 0, shuf);
+		__m256i b = ld_pcm24x8_avx2(src + 24, shuf);
+		__m256i l = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), 0xD8);
+		__m256i r = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), 0xD8);
+		_mm256_storeu_ps(out1 + j, _mm256_mul_ps(_mm256_cvtepi32_ps(l), scale));
+		_mm256_storeu_ps(out2 + j, _mm256_mul_ps(_mm256_cvtepi32_ps(r), scale));
+	}
+	if (j < length)
+		pcm24_stereo_ssse3(out1 + j, dest_stride, src, length - j, nb_channels);
+}
+
+SMPLWAV_TARGET_AVX2
+static void pcm24_channel_avx2(float *dest, const unsigned char *src, size_t length, size_t frame_bytes)
+{
+	const __m256  scale   = _mm256_set1_ps(1.0f / 2147483648.0f);
+	const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int)frame_bytes));
+	size_t j;
+	for (j = 0; j + 8 < length; j += 8, src += 8 * frame_bytes) {
+		__m256i v = _mm256_i32gather_epi32((const int *)src, offsets, 1);
+		_mm256_storeu_ps(dest + j, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_slli_epi32(v, 8)), scale));
+	}
+	for (; j < length; j++, src += frame_bytes)
+		dest[j] = cop_ld_sle24(src) * (1.0f / (float)0x800000);
+}
+
+SMPLWAV_CONVERT_MAKE_MULTI_KERNEL(pcm24_multi_avx2, pcm24_channel_avx2, 3)
+
+/* PCM32
+ * -------------------------------------------------------------------------*/
+
+SMPLWAV_TARGET_SSE2
+static void pcm32_mono_sse2(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	float *dest = dest_ptr;
+	const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+	size_t j;
+	for (j = 0; j + 8 <= length; j += 8, src += 32) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + 0));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		_mm_storeu_ps(dest + j,     _mm_mul_ps(_mm_cvtepi32_ps(a), scale));
+		_mm_storeu_ps(dest + j + 4, _mm_mul_ps(_mm_cvtepi32_ps(b), scale));
+	}
+	for (; j < length; j++, src += 4)
+		dest[j] = ((int32_t)cop_ld_ule32(src)) * (1.0f / 2147483648.0f);
+}
+
+SMPLWAV_TARGET_SSE2
+static void pcm32_stereo_sse2(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+	float *out1 = dest_ptr;
+	float *out2 = out1 + dest_stride;
+	size_t j;
+	for (j = 0; j + 4 <= length; j += 4, src += 32) {
+		__m128 a = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(src + 0)));
+		__m128 b = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(src + 16)));
+		_mm_storeu_ps(out1 + j, _mm_mul_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), scale));
+		_mm_storeu_ps(out2 + j, _mm_mul_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)), scale));
+	}
+	for (; j < length; j++, src += 8) {
+		out1[j] = ((int32_t)cop_ld_ule32(src + 0)) * (1.0f / 2147483648.0f);
+		out2[j] = ((int32_t)cop_ld_ule32(src + 4)) * (1.0f / 2147483648.0f);
+	}
+}
+
+SMPLWAV_TARGET_AVX2
+static void pcm32_mono_avx2(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	float *dest = dest_ptr;
+	const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+	size_t j;
+	for (j = 0; j + 16 <= length; j += 16, src += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + 0));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+		_mm256_storeu_ps(dest + j,     _mm256_mul_ps(_mm256_cvtepi32_ps(a), scale));
+		_mm256_storeu_ps(dest + j + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(b), scale));
+	}
+	if (j < length)
+		pcm32_mono_sse2(dest + j, dest_stride, src, length - j, nb_channels);
+}
+
+SMPLWAV_TARGET_AVX2
+static void pcm32_stereo_avx2(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+	float *out1 = dest_ptr;
+	float *out2 = out1 + dest_stride;
+	size_t j;
+	for (j = 0; j + 8 <= length; j += 8, src += 64) {
+		__m256 a = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(src + 0)));
+		__m256 b = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(src + 32)));
+		__m256 l = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), 0xD8));
+		__m256 r = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))), 0xD8));
+		_mm256_storeu_ps(out1 + j, _mm256_mul_ps(l, scale));
+		_mm256_storeu_ps(out2 + j, _mm256_mul_ps(r, scale));
+	}
+	if (j < length)
+		pcm32_stereo_sse2(out1 + j, dest_stride, src, length - j, nb_channels);
+}
+
+SMPLWAV_TARGET_AVX2
+static void pcm32_channel_avx2(float *dest, const unsigned char *src, size_t length, size_t frame_bytes)
+{
+	const __m256  scale   = _mm256_set1_ps(1.0f / 2147483648.0f);
+	const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int)frame_bytes));
+	size_t j;
+	for (j = 0; j + 8 <= length; j += 8, src += 8 * frame_bytes) {
+		__m256i v = _mm256_i32gather_epi32((const int *)src, offsets, 1);
+		_mm256_storeu_ps(dest + j, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+	}
+	for (; j < length; j++, src += frame_bytes)
+		dest[j] = ((int32_t)cop_ld_ule32(src)) * (1.0f / 2147483648.0f);
+}
+
+SMPLWAV_CONVERT_MAKE_MULTI_KERNEL(pcm32_multi_avx2, pcm32_channel_avx2, 4)
+
+/* FLOAT32
+ * -------------------------------------------------------------------------*/
+
+static void float32_mono_copy(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	float *dest = dest_ptr;
+	memcpy(dest, src, length * sizeof(float));
+}
+
+/* The float kernels only move data around. They must not perform any
+ * arithmetic so that the bit patterns (including NaN payloads) are preserved
+ * exactly. */
+
+SMPLWAV_TARGET_SSE2
+static void float32_stereo_sse2(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	float *out1 = dest_ptr;
+	float *out2 = out1 + dest_stride;
+	size_t j;
+	for (j = 0; j + 4 <= length; j += 4, src += 32) {
+		__m128 a = _mm_loadu_ps((const float *)(src + 0));
+		__m128 b = _mm_loadu_ps((const float *)(src + 16));
+		_mm_storeu_ps(out1 + j, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(out2 + j, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+	for (; j < length; j++, src += 8) {
+		memcpy(out1 + j, src + 0, sizeof(float));
+		memcpy(out2 + j, src + 4, sizeof(float));
+	}
+}
+
+SMPLWAV_TARGET_AVX2
+static void float32_stereo_avx2(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	float *out1 = dest_ptr;
+	float *out2 = out1 + dest_stride;
+	size_t j;
+	for (j = 0; j + 8 <= length; j += 8, src += 64) {
+		__m256 a = _mm256_loadu_ps((const float *)(src + 0));
+		__m256 b = _mm256_loadu_ps((const float *)(src + 32));
+		__m256 l = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), 0xD8));
+		__m256 r = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))), 0xD8));
+		_mm256_storeu_ps(out1 + j, l);
+		_mm256_storeu_ps(out2 + j, r);
+	}
+	if (j < length)
+		float32_stereo_sse2(out1 + j, dest_stride, src, length - j, nb_channels);
+}
+
+SMPLWAV_TARGET_AVX2
+static void float32_channel_avx2(float *dest, const unsigned char *src, size_t length, size_t frame_bytes)
+{
+	const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int)frame_bytes));
+	size_t j;
+	for (j = 0; j + 8 <= length; j += 8, src += 8 * frame_bytes)
+		_mm256_storeu_si256((__m256i *)(dest + j), _mm256_i32gather_epi32((const int *)src, offsets, 1));
+	for (; j < length; j++, src += frame_bytes)
+		memcpy(dest + j, src, sizeof(float));
+}
+
+SMPLWAV_CONVERT_MAKE_MULTI_KERNEL(float32_multi_avx2, float32_channel_avx2, 4)
+
+/* Integer and double outputs
+ * -------------------------------------------------------------------------*/
+
+/* The loaders produce four frames of left justified 32-bit samples for each
+ * channel. The stores then only need to know the output type. */
+SMPLWAV_TARGET_SSE2
+static __m128i ld_pcm16_mono_sse2(const unsigned char *src)
+{
+	return _mm_unpacklo_epi16(_mm_setzero_si128(), _mm_loadl_epi64((const __m128i *)src));
+}
+
+SMPLWAV_TARGET_SSE2
+static void ld_pcm16_stereo_sse2(const unsigned char *src, __m128i *l, __m128i *r)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)src);
+	*l = _mm_slli_epi32(v, 16);
+	*r = _mm_and_si128(v, _mm_set1_epi32((int)0xFFFF0000u));
+}
+
+/* Reads 16 bytes so requires 6 frames to be available. */
+SMPLWAV_TARGET_SSSE3
+static __m128i ld_pcm24_mono_ssse3(const unsigned char *src)
+{
+	const __m128i shuf = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), shuf);
+}
+
+/* Reads 28 bytes so requires 5 frames to be available. */
+SMPLWAV_TARGET_SSSE3
+static void ld_pcm24_stereo_ssse3(const unsigned char *src, __m128i *l, __m128i *r)
+{
+	__m128i a  = ld_pcm24_mono_ssse3(src);
+	__m128i b  = ld_pcm24_mono_ssse3(src + 12);
+	__m128i t0 = _mm_unpacklo_epi32(a, b);
+	__m128i t1 = _mm_unpackhi_epi32(a, b);
+	*l = _mm_unpacklo_epi32(t0, t1);
+	*r = _mm_unpackhi_epi32(t0, t1);
+}
+
+SMPLWAV_TARGET_SSE2
+static void st_int16_sse2(int16_t *dest, __m128i v)
+{
+	v = _mm_srai_epi32(v, 16);
+	_mm_storel_epi64((__m128i *)dest, _mm_packs_epi32(v, v));
+}
+
+SMPLWAV_TARGET_SSE2
+static void st_int32_sse2(int32_t *dest, __m128i v)
+{
+	_mm_storeu_si128((__m128i *)dest, v);
+}
+
+SMPLWAV_TARGET_SSE2
+static void st_double_sse2(double *dest, __m128i v)
+{
+	const __m128d scale = _mm_set1_pd(1.0 / 2147483648.0);
+	_mm_storeu_pd(dest,     _mm_mul_pd(_mm_cvtepi32_pd(v), scale));
+	_mm_storeu_pd(dest + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(v, 8)), scale));
+}
+
+/* Creates mono and stereo kernels from a loader and a store. "frames_"
+ * is the number of frames which must remain for the loader to be used
+ * without reading beyond the end of the buffer. */
+#define MAKE_MONO_KERNEL(name_, target_, type_, output_, format_, ld_, st_, frames_) \
+target_ \
+static void name_(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels) \
+{ \
+	type_ *dest = dest_ptr; \
+	size_t j; \
+	for (j = 0; j + frames_ <= length; j += 4, src += 4 * smplwav_format_container_size(format_)) \
+		st_(dest + j, ld_(src)); \
+	smplwav_convert_deinterleave_scalar(output_, format_, dest + j, dest_stride, src, length - j, 1); \
+}
+
+#define MAKE_STEREO_KERNEL(name_, target_, type_, output_, format_, ld_, st_, frames_) \
+target_ \
+static void name_(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels) \
+{ \
+	type_ *out1 = dest_ptr; \
+	type_ *out2 = out1 + dest_stride; \
+	size_t j; \
+	for (j = 0; j + frames_ <= length; j += 4, src += 8 * smplwav_format_container_size(format_)) { \
+		__m128i l, r; \
+		ld_(src, &l, &r); \
+		st_(out1 + j, l); \
+		st_(out2 + j, r); \
+	} \
+	smplwav_convert_deinterleave_scalar(output_, format_, out1 + j, dest_stride, src, length - j, 2); \
+}
+
+MAKE_MONO_KERNEL(int32_pcm16_mono_sse2, SMPLWAV_TARGET_SSE2, int32_t, SMPLWAV_CONVERT_OUTPUT_INT32, SMPLWAV_FORMAT_PCM16, ld_pcm16_mono_sse2, st_int32_sse2, 4)
+MAKE_MONO_KERNEL(double_pcm16_mono_sse2, SMPLWAV_TARGET_SSE2, double, SMPLWAV_CONVERT_OUTPUT_DOUBLE, SMPLWAV_FORMAT_PCM16, ld_pcm16_mono_sse2, st_double_sse2, 4)
+MAKE_STEREO_KERNEL(int16_pcm16_stereo_sse2, SMPLWAV_TARGET_SSE2, int16_t, SMPLWAV_CONVERT_OUTPUT_INT16, SMPLWAV_FORMAT_PCM16, ld_pcm16_stereo_sse2, st_int16_sse2, 4)
+MAKE_STEREO_KERNEL(int32_pcm16_stereo_sse2, SMPLWAV_TARGET_SSE2, int32_t, SMPLWAV_CONVERT_OUTPUT_INT32, SMPLWAV_FORMAT_PCM16, ld_pcm16_stereo_sse2, st_int32_sse2, 4)
+MAKE_STEREO_KERNEL(double_pcm16_stereo_sse2, SMPLWAV_TARGET_SSE2, double, SMPLWAV_CONVERT_OUTPUT_DOUBLE, SMPLWAV_FORMAT_PCM16, ld_pcm16_stereo_sse2, st_double_sse2, 4)
+MAKE_MONO_KERNEL(int16_pcm24_mono_ssse3, SMPLWAV_TARGET_SSSE3, int16_t, SMPLWAV_CONVERT_OUTPUT_INT16, SMPLWAV_FORMAT_PCM24, ld_pcm24_mono_ssse3, st_int16_sse2, 6)
+MAKE_MONO_KERNEL(int32_pcm24_mono_ssse3, SMPLWAV_TARGET_SSSE3, int32_t, SMPLWAV_CONVERT_OUTPUT_INT32, SMPLWAV_FORMAT_PCM24, ld_pcm24_mono_ssse3, st_int32_sse2, 6)
+MAKE_MONO_KERNEL(double_pcm24_mono_ssse3, SMPLWAV_TARGET_SSSE3, double, SMPLWAV_CONVERT_OUTPUT_DOUBLE, SMPLWAV_FORMAT_PCM24, ld_pcm24_mono_ssse3, st_double_sse2, 6)
+MAKE_STEREO_KERNEL(int16_pcm24_stereo_ssse3, SMPLWAV_TARGET_SSSE3, int16_t, SMPLWAV_CONVERT_OUTPUT_INT16, SMPLWAV_FORMAT_PCM24, ld_pcm24_stereo_ssse3, st_int16_sse2, 5)
+MAKE_STEREO_KERNEL(int32_pcm24_stereo_ssse3, SMPLWAV_TARGET_SSSE3, int32_t, SMPLWAV_CONVERT_OUTPUT_INT32, SMPLWAV_FORMAT_PCM24, ld_pcm24_stereo_ssse3, st_int32_sse2, 5)
+MAKE_STEREO_KERNEL(double_pcm24_stereo_ssse3, SMPLWAV_TARGET_SSSE3, double, SMPLWAV_CONVERT_OUTPUT_DOUBLE, SMPLWAV_FORMAT_PCM24, ld_pcm24_stereo_ssse3, st_double_sse2, 5)
+
+#undef MAKE_MONO_KERNEL
+#undef MAKE_STEREO_KERNEL
+
+/* Mono 16-bit to int16 and mono 32-bit to int32 are copies on a little
+ * endian machine. */
+static void int16_pcm16_mono_copy(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	memcpy(dest_ptr, src, length * sizeof(int16_t));
+}
+
+static void int32_pcm32_mono_copy(void *dest_ptr, size_t dest_stride, const unsigned char *src, size_t length, unsigned nb_channels)
+{
+	memcpy(dest_ptr, src, length * sizeof(int32_t));
+}
+
+SMPLWAV_TARGET_F16C
+static void float_to_half_f16c(uint16_t *dest, const float *src, size_t length)
+{
+	size_t j;
+	for (j = 0; j + 8 <= length; j += 8)
+		_mm_storeu_si128((__m128i *)(dest + j), _mm256_cvtps_ph(_mm256_loadu_ps(src + j), _MM_FROUND_TO_NEAREST_INT));
+	for (; j < length; j++)
+		dest[j] = smplwav_convert_float_to_half(src[j]);
+}
+
+/* Statistics
+ * -------------------------------------------------------------------------*/
+
+/* Lanes of sum_lo and sum_hi hold partial sums 0, 1 and 2, 3 respectively.
+ * maxps returns its second operand if either is NaN so NaN samples are
+ * ignored by the peak in the same way as the scalar comparison. */
+SMPLWAV_TARGET_SSE2
+static void stats_sse2(struct smplwav_convert_channel_stats *stats, const float *src, size_t length, float clip_level)
+{
+	const __m128  abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	const __m128  hi       = _mm_set1_ps(clip_level);
+	const __m128  lo       = _mm_set1_ps(-1.0f);
+	__m128d       sum_lo   = _mm_setzero_pd();
+	__m128d       sum_hi   = _mm_setzero_pd();
+	__m128d       sq_lo    = _mm_setzero_pd();
+	__m128d       sq_hi    = _mm_setzero_pd();
+	__m128        peak     = _mm_set1_ps(stats->peak);
+	__m128i       clipped  = _mm_setzero_si128();
+	double        sum[4];
+	double        sum_sq[4];
+	float         peaks[4];
+	int32_t       counts[4];
+	uint_fast64_t nb_clipped;
+	size_t        j;
+
+	for (j = 0; j + 4 <= length; j += 4) {
+		__m128  x  = _mm_loadu_ps(src + j);
+		__m128d dl = _mm_cvtps_pd(x);
+		__m128d dh = _mm_cvtps_pd(_mm_movehl_ps(x, x));
+		sum_lo  = _mm_add_pd(sum_lo, dl);
+		sum_hi  = _mm_add_pd(sum_hi, dh);
+		sq_lo   = _mm_add_pd(sq_lo, _mm_mul_pd(dl, dl));
+		sq_hi   = _mm_add_pd(sq_hi, _mm_mul_pd(dh, dh));
+		peak    = _mm_max_ps(_mm_and_ps(x, abs_mask), peak);
+		clipped = _mm_sub_epi32(clipped, _mm_castps_si128(_mm_or_ps(_mm_cmpge_ps(x, hi), _mm_cmple_ps(x, lo))));
+	}
+
+	_mm_storeu_pd(sum, sum_lo);
+	_mm_storeu_pd(sum + 2, sum_hi);
+	_mm_storeu_pd(sum_sq, sq_lo);
+	_mm_storeu_pd(sum_sq + 2, sq_hi);
+	_mm_storeu_ps(peaks, peak);
+	_mm_storeu_si128((__m128i *)counts, clipped);
+
+	nb_clipped = (uint_fast64_t)counts[0] + (uint_fast64_t)counts[1] + (uint_fast64_t)counts[2] + (uint_fast64_t)counts[3];
+	for (; j < length; j++) {
+		float x = src[j];
+		float a = (x < 0.0f) ? -x : x;
+		sum[j & 3]    += x;
+		sum_sq[j & 3] += (double)x * x;
+		if (a > peaks[0])
+			peaks[0] = a;
+		if (x >= clip_level || x <= -1.0f)
+			nb_clipped++;
+	}
+
+	stats->peak        = peaks[0];
+	stats->peak        = (peaks[1] > stats->peak) ? peaks[1] : stats->peak;
+	stats->peak        = (peaks[2] > stats->peak) ? peaks[2] : stats->peak;
+	stats->peak        = (peaks[3] > stats->peak) ? peaks[3] : stats->peak;
+	stats->nb_clipped += nb_clipped;
+	smplwav_convert_stats_finish(stats, sum, sum_sq, length);
+}
+
+/* Interleaving
+ * -------------------------------------------------------------------------*/
+
+struct quantiser_sse2 {
+	__m128  scale;
+	__m128  lo;
+	__m128  hi;
+	__m128  abs_mask;
+	__m128i clips;
+	__m128  peak;
+};
+
+SMPLWAV_TARGET_SSE2
+static void quantiser_sse2_init(struct quantiser_sse2 *q, int format)
+{
+	q->scale    = _mm_set1_ps(SMPLWAV_QUANTISERS[format].scale);
+	q->lo       = _mm_set1_ps(SMPLWAV_QUANTISERS[format].lo);
+	q->hi       = _mm_set1_ps(SMPLWAV_QUANTISERS[format].hi);
+	q->abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	q->clips    = _mm_setzero_si128();
+	q->peak     = _mm_setzero_ps();
+}
+
+SMPLWAV_TARGET_SSE2
+static void quantiser_sse2_finish(const struct quantiser_sse2 *q, struct smplwav_convert_clip_stats *stats)
+{
+	uint32_t clips[4];
+	float    peak[4];
+	unsigned i;
+	_mm_storeu_si128((__m128i *)clips, q->clips);
+	_mm_storeu_ps(peak, q->peak);
+	for (i = 0; i < 4; i++) {
+		stats->nb_clipped += clips[i];
+		if (peak[i] > stats->peak)
+			stats->peak = peak[i];
+	}
+}
+
+/* 32-bit multiply (SSE2 only has the unsigned 32x32->64 multiply). */
+SMPLWAV_TARGET_SSE2
+static __m128i mullo_epi32_sse2(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd  = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+/* Vector version of smplwav_convert_tpdf(). */
+SMPLWAV_TARGET_SSE2
+static __m128 tpdf_sse2(__m128i x)
+{
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+	x = mullo_epi32_sse2(x, _mm_set1_epi32(0x7FEB352D));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+	x = mullo_epi32_sse2(x, _mm_set1_epi32((int)0x846CA68Bu));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+	x = _mm_sub_epi32(_mm_and_si128(x, _mm_set1_epi32(0xFFFF)), _mm_srli_epi32(x, 16));
+	return _mm_mul_ps(_mm_cvtepi32_ps(x), _mm_set1_ps(1.0f / 65536.0f));
+}
+
+/* Must match quantise() in smplwav_convert.c: maxps returns its second
+ * operand when the first is NaN so NaNs become the lower limit without being
+ * counted as clipped. */
+SMPLWAV_TARGET_SSE2
+static __m128i quantise_sse2(struct quantiser_sse2 *q, __m128 x, __m128 noise)
+{
+	__m128 v = _mm_add_ps(_mm_mul_ps(x, q->scale), noise);
+	q->clips = _mm_sub_epi32(q->clips, _mm_castps_si128(_mm_or_ps(_mm_cmplt_ps(v, q->lo), _mm_cmpgt_ps(v, q->hi))));
+	q->peak  = _mm_max_ps(_mm_and_ps(x, q->abs_mask), q->peak);
+	return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(v, q->lo), q->hi));
+}
+
+SMPLWAV_TARGET_SSE2
+static void interleave_pcm16_mono_sse2(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	struct quantiser_sse2 q;
+	__m128i idx  = _mm_add_epi32(_mm_set1_epi32((int)(uint32_t)seed), _mm_setr_epi32(0, 1, 2, 3));
+	__m128i step = _mm_set1_epi32(4);
+	__m128  zero = _mm_setzero_ps();
+	size_t  j;
+	quantiser_sse2_init(&q, SMPLWAV_FORMAT_PCM16);
+	for (j = 0; j + 8 <= length; j += 8, dest += 16) {
+		__m128  n0 = zero;
+		__m128  n1 = zero;
+		__m128i a, b;
+		if (dither) {
+			n0  = tpdf_sse2(idx);
+			idx = _mm_add_epi32(idx, step);
+			n1  = tpdf_sse2(idx);
+			idx = _mm_add_epi32(idx, step);
+		}
+		a = quantise_sse2(&q, _mm_loadu_ps(src + j), n0);
+		b = quantise_sse2(&q, _mm_loadu_ps(src + j + 4), n1);
+		_mm_storeu_si128((__m128i *)dest, _mm_packs_epi32(a, b));
+	}
+	quantiser_sse2_finish(&q, stats);
+	if (j < length)
+		smplwav_convert_interleave_scalar(SMPLWAV_FORMAT_PCM16, dest, src + j, src_stride, length - j, nb_channels, dither, seed + j, stats);
+}
+
+SMPLWAV_TARGET_SSE2
+static void interleave_pcm16_stereo_sse2(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	struct quantiser_sse2 q;
+	const float *src1 = src;
+	const float *src2 = src + src_stride;
+	__m128i idx  = _mm_add_epi32(_mm_set1_epi32((int)(uint32_t)seed), _mm_setr_epi32(0, 2, 4, 6));
+	__m128i one  = _mm_set1_epi32(1);
+	__m128i step = _mm_set1_epi32(8);
+	__m128  zero = _mm_setzero_ps();
+	size_t  j;
+	quantiser_sse2_init(&q, SMPLWAV_FORMAT_PCM16);
+	for (j = 0; j + 4 <= length; j += 4, dest += 16) {
+		__m128  n1 = zero;
+		__m128  n2 = zero;
+		__m128i p;
+		if (dither) {
+			n1  = tpdf_sse2(idx);
+			n2  = tpdf_sse2(_mm_add_epi32(idx, one));
+			idx = _mm_add_epi32(idx, step);
+		}
+		p = _mm_packs_epi32(quantise_sse2(&q, _mm_loadu_ps(src1 + j), n1), quantise_sse2(&q, _mm_loadu_ps(src2 + j), n2));
+		_mm_storeu_si128((__m128i *)dest, _mm_unpacklo_epi16(p, _mm_srli_si128(p, 8)));
+	}
+	quantiser_sse2_finish(&q, stats);
+	if (j < length)
+		smplwav_convert_interleave_scalar(SMPLWAV_FORMAT_PCM16, dest, src + j, src_stride, length - j, nb_channels, dither, seed + 2 * j, stats);
+}
+
+SMPLWAV_TARGET_SSSE3
+static void st_pcm24x4_ssse3(unsigned char *dest, __m128i v)
+{
+	const __m128i shuf = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	uint32_t      last;
+	v    = _mm_shuffle_epi8(v, shuf);
+	last = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+	_mm_storel_epi64((__m128i *)dest, v);
+	memcpy(dest + 8, &last, 4);
+}
+
+SMPLWAV_TARGET_SSSE3
+static void interleave_pcm24_mono_ssse3(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	struct quantiser_sse2 q;
+	__m128i idx  = _mm_add_epi32(_mm_set1_epi32((int)(uint32_t)seed), _mm_setr_epi32(0, 1, 2, 3));
+	__m128i step = _mm_set1_epi32(4);
+	__m128  zero = _mm_setzero_ps();
+	size_t  j;
+	quantiser_sse2_init(&q, SMPLWAV_FORMAT_PCM24);
+	for (j = 0; j + 4 <= length; j += 4, dest += 12) {
+		__m128 n = zero;
+		if (dither) {
+			n   = tpdf_sse2(idx);
+			idx = _mm_add_epi32(idx, step);
+		}
+		st_pcm24x4_ssse3(dest, quantise_sse2(&q, _mm_loadu_ps(src + j), n));
+	}
+	quantiser_sse2_finish(&q, stats);
+	if (j < length)
+		smplwav_convert_interleave_scalar(SMPLWAV_FORMAT_PCM24, dest, src + j, src_stride, length - j, nb_channels, dither, seed + j, stats);
+}
+
+SMPLWAV_TARGET_SSSE3
+static void interleave_pcm24_stereo_ssse3(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	struct quantiser_sse2 q;
+	const float *src1 = src;
+	const float *src2 = src + src_stride;
+	__m128i idx  = _mm_add_epi32(_mm_set1_epi32((int)(uint32_t)seed), _mm_setr_epi32(0, 2, 4, 6));
+	__m128i one  = _mm_set1_epi32(1);
+	__m128i step = _mm_set1_epi32(8);
+	__m128  zero = _mm_setzero_ps();
+	size_t  j;
+	quantiser_sse2_init(&q, SMPLWAV_FORMAT_PCM24);
+	for (j = 0; j + 4 <= length; j += 4, dest += 24) {
+		__m128  n1 = zero;
+		__m128  n2 = zero;
+		__m128i l, r;
+		if (dither) {
+			n1  = tpdf_sse2(idx);
+			n2  = tpdf_sse2(_mm_add_epi32(idx, one));
+			idx = _mm_add_epi32(idx, step);
+		}
+		l = quantise_sse2(&q, _mm_loadu_ps(src1 + j), n1);
+		r = quantise_sse2(&q, _mm_loadu_ps(src2 + j), n2);
+		st_pcm24x4_ssse3(dest,      _mm_unpacklo_epi32(l, r));
+		st_pcm24x4_ssse3(dest + 12, _mm_unpackhi_epi32(l, r));
+	}
+	quantiser_sse2_finish(&q, stats);
+	if (j < length)
+		smplwav_convert_interleave_scalar(SMPLWAV_FORMAT_PCM24, dest, src + j, src_stride, length - j, nb_channels, dither, seed + 2 * j, stats);
+}
+
+SMPLWAV_TARGET_SSE2
+static void interleave_pcm32_mono_sse2(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	struct quantiser_sse2 q;
+	__m128i idx  = _mm_add_epi32(_mm_set1_epi32((int)(uint32_t)seed), _mm_setr_epi32(0, 1, 2, 3));
+	__m128i step = _mm_set1_epi32(4);
+	__m128  zero = _mm_setzero_ps();
+	size_t  j;
+	quantiser_sse2_init(&q, SMPLWAV_FORMAT_PCM32);
+	for (j = 0; j + 4 <= length; j += 4, dest += 16) {
+		__m128 n = zero;
+		if (dither) {
+			n   = tpdf_sse2(idx);
+			idx = _mm_add_epi32(idx, step);
+		}
+		_mm_storeu_si128((__m128i *)dest, quantise_sse2(&q, _mm_loadu_ps(src + j), n));
+	}
+	quantiser_sse2_finish(&q, stats);
+	if (j < length)
+		smplwav_convert_interleave_scalar(SMPLWAV_FORMAT_PCM32, dest, src + j, src_stride, length - j, nb_channels, dither, seed + j, stats);
+}
+
+SMPLWAV_TARGET_SSE2
+static void interleave_pcm32_stereo_sse2(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	struct quantiser_sse2 q;
+	const float *src1 = src;
+	const float *src2 = src + src_stride;
+	__m128i idx  = _mm_add_epi32(_mm_set1_epi32((int)(uint32_t)seed), _mm_setr_epi32(0, 2, 4, 6));
+	__m128i one  = _mm_set1_epi32(1);
+	__m128i step = _mm_set1_epi32(8);
+	__m128  zero = _mm_setzero_ps();
+	size_t  j;
+	quantiser_sse2_init(&q, SMPLWAV_FORMAT_PCM32);
+	for (j = 0; j + 4 <= length; j += 4, dest += 32) {
+		__m128  n1 = zero;
+		__m128  n2 = zero;
+		__m128i l, r;
+		if (dither) {
+			n1  = tpdf_sse2(idx);
+			n2  = tpdf_sse2(_mm_add_epi32(idx, one));
+			idx = _mm_add_epi32(idx, step);
+		}
+		l = quantise_sse2(&q, _mm_loadu_ps(src1 + j), n1);
+		r = quantise_sse2(&q, _mm_loadu_ps(src2 + j), n2);
+		_mm_storeu_si128((__m128i *)(dest + 0),  _mm_unpacklo_epi32(l, r));
+		_mm_storeu_si128((__m128i *)(dest + 16), _mm_unpackhi_epi32(l, r));
+	}
+	quantiser_sse2_finish(&q, stats);
+	if (j < length)
+		smplwav_convert_interleave_scalar(SMPLWAV_FORMAT_PCM32, dest, src + j, src_stride, length - j, nb_channels, dither, seed + 2 * j, stats);
+}
+
+/* Generic channel count PCM interleaver. Each channel is quantised four
+ * frames at a time and the results are scattered into the frames. */
+SMPLWAV_TARGET_SSE2
+static void interleave_pcm_multi_sse2(int format, unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	struct quantiser_sse2 q;
+	const size_t container   = smplwav_format_container_size(format);
+	const size_t frame_bytes = container * nb_channels;
+	const size_t vec_length  = length & ~(size_t)3;
+	__m128i      offsets     = mullo_epi32_sse2(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32((int)nb_channels));
+	__m128i      step        = _mm_set1_epi32((int)(4 * nb_channels));
+	unsigned     i;
+	quantiser_sse2_init(&q, format);
+	for (i = 0; i < nb_channels; i++) {
+		const float   *s   = src + i * src_stride;
+		unsigned char *d   = dest + i * container;
+		__m128i        idx = _mm_add_epi32(_mm_set1_epi32((int)(uint32_t)(seed + i)), offsets);
+		size_t         j;
+		for (j = 0; j < vec_length; j += 4, d += 4 * frame_bytes) {
+			__m128   n = _mm_setzero_ps();
+			uint32_t u[4];
+			unsigned k;
+			if (dither) {
+				n   = tpdf_sse2(idx);
+				idx = _mm_add_epi32(idx, step);
+			}
+			_mm_storeu_si128((__m128i *)u, quantise_sse2(&q, _mm_loadu_ps(s + j), n));
+			for (k = 0; k < 4; k++) {
+				unsigned char *p = d + k * frame_bytes;
+				p[0] = u[k] & 0xFFu;
+				p[1] = (u[k] >> 8) & 0xFFu;
+				if (container > 2) {
+					p[2] = (u[k] >> 16) & 0xFFu;
+					if (container > 3)
+						p[3] = (u[k] >> 24) & 0xFFu;
+				}
+			}
+		}
+	}
+	quantiser_sse2_finish(&q, stats);
+	if (vec_length < length)
+		smplwav_convert_interleave_scalar(format, dest + vec_length * frame_bytes, src + vec_length, src_stride, length - vec_length, nb_channels, dither, seed + vec_length * nb_channels, stats);
+}
+
+SMPLWAV_TARGET_SSE2
+static void interleave_pcm16_multi_sse2(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	interleave_pcm_multi_sse2(SMPLWAV_FORMAT_PCM16, dest, src, src_stride, length, nb_channels, dither, seed, stats);
+}
+
+SMPLWAV_TARGET_SSE2
+static void interleave_pcm24_multi_sse2(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	interleave_pcm_multi_sse2(SMPLWAV_FORMAT_PCM24, dest, src, src_stride, length, nb_channels, dither, seed, stats);
+}
+
+SMPLWAV_TARGET_SSE2
+static void interleave_pcm32_multi_sse2(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	interleave_pcm_multi_sse2(SMPLWAV_FORMAT_PCM32, dest, src, src_stride, length, nb_channels, dither, seed, stats);
+}
+
+SMPLWAV_TARGET_SSE2
+static void float_stats_sse2(struct quantiser_sse2 *q, __m128 x)
+{
+	__m128 a = _mm_and_ps(x, q->abs_mask);
+	q->clips = _mm_sub_epi32(q->clips, _mm_castps_si128(_mm_cmpgt_ps(a, _mm_set1_ps(1.0f))));
+	q->peak  = _mm_max_ps(a, q->peak);
+}
+
+SMPLWAV_TARGET_SSE2
+static void interleave_float32_mono_sse2(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	struct quantiser_sse2 q;
+	size_t j;
+	quantiser_sse2_init(&q, SMPLWAV_FORMAT_PCM32);
+	for (j = 0; j + 4 <= length; j += 4, dest += 16) {
+		__m128 x = _mm_loadu_ps(src + j);
+		float_stats_sse2(&q, x);
+		_mm_storeu_ps((float *)dest, x);
+	}
+	quantiser_sse2_finish(&q, stats);
+	if (j < length)
+		smplwav_convert_interleave_scalar(SMPLWAV_FORMAT_FLOAT32, dest, src + j, src_stride, length - j, nb_channels, dither, seed, stats);
+}
+
+SMPLWAV_TARGET_SSE2
+static void interleave_float32_stereo_sse2(unsigned char *dest, const float *src, size_t src_stride, size_t length, unsigned nb_channels, int dither, uint_fast32_t seed, struct smplwav_convert_clip_stats *stats)
+{
+	struct quantiser_sse2 q;
+	const float *src1 = src;
+	const float *src2 = src + src_stride;
+	size_t j;
+	quantiser_sse2_init(&q, SMPLWAV_FORMAT_PCM32);
+	for (j = 0; j + 4 <= length; j += 4, dest += 32) {
+		__m128 l = _mm_loadu_ps(src1 + j);
+		__m128 r = _mm_loadu_ps(src2 + j);
+		float_stats_sse2(&q, l);
+		float_stats_sse2(&q, r);
+		_mm_storeu_ps((float *)(dest + 0),  _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps((float *)(dest + 16), _mm_unpackhi_ps(l, r));
+	}
+	quantiser_sse2_finish(&q, stats);
+	if (j < length)
+		smplwav_convert_interleave_scalar(SMPLWAV_FORMAT_FLOAT32, dest, src + j, src_stride, length - j, nb_channels, dither, seed, stats);
+}
+
+void smplwav_convert_x86_kernels(struct smplwav_convert_kernels *kernels)
+{
+	smplwav_deinterleave_fn (*k)[SMPLWAV_CONVERT_NB_LAYOUTS] = kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_FLOAT];
+	smplwav_deinterleave_fn (*i16)[SMPLWAV_CONVERT_NB_LAYOUTS] = kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_INT16];
+	smplwav_deinterleave_fn (*i32)[SMPLWAV_CONVERT_NB_LAYOUTS] = kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_INT32];
+	smplwav_deinterleave_fn (*f64)[SMPLWAV_CONVERT_NB_LAYOUTS] = kernels->deinterleave[SMPLWAV_CONVERT_OUTPUT_DOUBLE];
+	smplwav_interleave_fn   (*w)[SMPLWAV_CONVERT_NB_LAYOUTS] = kernels->interleave;
+	unsigned features = get_cpu_features();
+
+	k[SMPLWAV_FORMAT_FLOAT32][SMPLWAV_CONVERT_MONO] = float32_mono_copy;
+	i16[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_MONO] = int16_pcm16_mono_copy;
+	i32[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_MONO] = int32_pcm32_mono_copy;
+
+	if (features & CPU_SSE2) {
+		k[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_MONO]     = pcm16_mono_sse2;
+		k[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_STEREO]   = pcm16_stereo_sse2;
+		k[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_MULTI]    = pcm16_multi_sse2;
+		k[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_MULTI]    = pcm24_multi_sse2;
+		k[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_MONO]     = pcm32_mono_sse2;
+		k[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_STEREO]   = pcm32_stereo_sse2;
+		k[SMPLWAV_FORMAT_FLOAT32][SMPLWAV_CONVERT_STEREO] = float32_stereo_sse2;
+
+		kernels->channel[SMPLWAV_FORMAT_PCM16]            = pcm16_channel_sse2;
+		kernels->channel[SMPLWAV_FORMAT_PCM24]            = pcm24_channel_sse2;
+		kernels->stats                                    = stats_sse2;
+
+		w[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_MONO]     = interleave_pcm16_mono_sse2;
+		w[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_STEREO]   = interleave_pcm16_stereo_sse2;
+		w[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_MULTI]    = interleave_pcm16_multi_sse2;
+		w[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_MULTI]    = interleave_pcm24_multi_sse2;
+		w[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_MONO]     = interleave_pcm32_mono_sse2;
+		w[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_STEREO]   = interleave_pcm32_stereo_sse2;
+		w[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_MULTI]    = interleave_pcm32_multi_sse2;
+		w[SMPLWAV_FORMAT_FLOAT32][SMPLWAV_CONVERT_MONO]   = interleave_float32_mono_sse2;
+		w[SMPLWAV_FORMAT_FLOAT32][SMPLWAV_CONVERT_STEREO] = interleave_float32_stereo_sse2;
+
+		i16[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_STEREO] = int16_pcm16_stereo_sse2;
+		i32[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_MONO]   = int32_pcm16_mono_sse2;
+		i32[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_STEREO] = int32_pcm16_stereo_sse2;
+		f64[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_MONO]   = double_pcm16_mono_sse2;
+		f64[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_STEREO] = double_pcm16_stereo_sse2;
+	}
+
+	if (features & CPU_SSSE3) {
+		k[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_MONO]     = pcm24_mono_ssse3;
+		k[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_STEREO]   = pcm24_stereo_ssse3;
+
+		w[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_MONO]     = interleave_pcm24_mono_ssse3;
+		w[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_STEREO]   = interleave_pcm24_stereo_ssse3;
+
+		i16[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_MONO]   = int16_pcm24_mono_ssse3;
+		i16[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_STEREO] = int16_pcm24_stereo_ssse3;
+		i32[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_MONO]   = int32_pcm24_mono_ssse3;
+		i32[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_STEREO] = int32_pcm24_stereo_ssse3;
+		f64[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_MONO]   = double_pcm24_mono_ssse3;
+		f64[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_STEREO] = double_pcm24_stereo_ssse3;
+	}
+
+	if (features & CPU_AVX2) {
+		k[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_MONO]     = pcm16_mono_avx2;
+		k[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_STEREO]   = pcm16_stereo_avx2;
+		k[SMPLWAV_FORMAT_PCM16][SMPLWAV_CONVERT_MULTI]    = pcm16_multi_avx2;
+		k[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_MONO]     = pcm24_mono_avx2;
+		k[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_STEREO]   = pcm24_stereo_avx2;
+		k[SMPLWAV_FORMAT_PCM24][SMPLWAV_CONVERT_MULTI]    = pcm24_multi_avx2;
+		k[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_MONO]     = pcm32_mono_avx2;
+		k[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_STEREO]   = pcm32_stereo_avx2;
+		k[SMPLWAV_FORMAT_PCM32][SMPLWAV_CONVERT_MULTI]    = pcm32_multi_avx2;
+		k[SMPLWAV_FORMAT_FLOAT32][SMPLWAV_CONVERT_STEREO] = float32_stereo_avx2;
+		k[SMPLWAV_FORMAT_FLOAT32][SMPLWAV_CONVERT_MULTI]  = float32_multi_avx2;
+
+		kernels->channel[SMPLWAV_FORMAT_PCM16]            = pcm16_channel_avx2;
+		kernels->channel[SMPLWAV_FORMAT_PCM24]            = pcm24_channel_avx2;
+		kernels->channel[SMPLWAV_FORMAT_PCM32]            = pcm32_channel_avx2;
+		kernels->channel[SMPLWAV_FORMAT_FLOAT32]          = float32_channel_avx2;
+	}
+
+	if (features & CPU_F16C)
+		kernels->float_to_half = float_to_half_f16c;
+}
+
+#else
+
+void smplwav_convert_x86_kernels(struct smplwav_convert_kernels *kernels)
+{
+	(void)kernels;
+}
+
+#endif
@@ -22,6 +22,7 @@
 #define SMPLWAV_INTERNAL_H
 
 #include "smplwav/smplwav.h"
+#include "cop/cop_conversions.h"
 
 struct smplwav_info_item {
 #ifndef NDEBUG
@@ -33,11 +34,17 @@ struct smplwav_info_item {
 
 extern const struct smplwav_info_item SMPLWAV_INFO_ITEMS[SMPLWAV_NB_INFO_TAGS];
 
-#define SMPLWAV_RIFF_ID(c1, c2, c3, c4) \
-	(   ((uint_fast32_t)(c1)) \
-	|   (((uint_fast32_t)(c2)) << 8) \
-	|   (((uint_fast32_t)(c3)) << 16) \
-	|   (((uint_fast32_t)(c4)) << 24) \
-	)
+/* 64-bit little-endian loads and stores for the RF64 ds64 chunk and cache
+ * records. */
+static COP_ATTR_UNUSED uint_fast64_t smplwav_ld_ule64(const unsigned char *buf)
+{
+	return (((uint_fast64_t)cop_ld_ule32(buf + 4)) << 32) | cop_ld_ule32(buf);
+}
+
+static COP_ATTR_UNUSED void smplwav_st_ule64(unsigned char *buf, uint_fast64_t val)
+{
+	cop_st_ule32(buf, (uint_fast32_t)(val & 0xFFFFFFFFu));
+	cop_st_ule32(buf + 4, (uint_fast32_t)((val >> 32) & 0xFFFFFFFFu));
+}
 
 #endif /* SMPLWAV_INTERNAL_H */
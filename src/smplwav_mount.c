@@ -26,7 +26,7 @@
 static struct smplwav_marker *get_new_marker(struct smplwav *wav)
 {
 	struct smplwav_marker *m;
-	if (wav->nb_marker >= SMPLWAV_MAX_MARKERS)
+	if (wav->nb_marker >= wav->max_marker)
 		return NULL;
 	m = wav->markers + wav->nb_marker++;
 	m->id           = 0;
@@ -40,25 +40,138 @@ static struct smplwav_marker *get_new_marker(struct smplwav *wav)
 	return m;
 }
 
-static struct smplwav_marker *get_marker(struct smplwav *wav, uint_fast32_t id)
+/* Markers are looked up by ID while the adtl and cue chunks are loaded and
+ * by position while sampler loops are matched with cue points. Both lookups
+ * use open addressing tables whose slots hold a marker index plus one with
+ * zero meaning empty. The tables are sized from the chunks so they only cost
+ * as much to clear as the file has markers, and are kept at most half full.
+ * They live on the stack unless the caller supplied larger scratch space
+ * (see smplwav_mount_arena()). Files with only a few markers, or with more
+ * than fit in either, are searched by scanning every marker; the results are
+ * the same either way. */
+#define MARKER_INDEX_MIN         (16)
+#define MARKER_INDEX_STACK_SLOTS (2048)
+
+struct marker_index {
+	/* log2 of the number of slots in each table or zero if there is no
+	 * index. */
+	unsigned        bits;
+	uint_least32_t *by_id;
+	uint_least32_t *by_position;
+};
+
+static unsigned marker_hash(const struct marker_index *index, uint_fast32_t key)
+{
+	return (unsigned)(((key * 0x9E3779B1u) & 0xFFFFFFFFu) >> (32 - index->bits));
+}
+
+static void marker_index_insert(const struct marker_index *index, uint_least32_t *table, uint_fast32_t key, unsigned marker_idx)
+{
+	unsigned mask = (1u << index->bits) - 1;
+	unsigned h    = marker_hash(index, key);
+	while (table[h])
+		h = (h + 1) & mask;
+	table[h] = (uint_least32_t)(marker_idx + 1);
+}
+
+/* Works out the most markers which the adtl, cue and smpl chunks could
+ * describe without looking at anything but their headers. */
+static uint_fast64_t marker_bound(const struct smplwav_mount_chunks *chunks)
+{
+	uint_fast64_t bound = 0;
+	if (chunks->adtl.id != 0 && chunks->adtl.size >= 4)
+		bound += (chunks->adtl.size - 4) / 12;
+	if (chunks->cue.id != 0 && chunks->cue.size >= 4) {
+		uint_fast64_t ncue = cop_ld_ule32(chunks->cue.data);
+		uint_fast64_t nmax = (chunks->cue.size - 4) / 24;
+		bound += (ncue < nmax) ? ncue : nmax;
+	}
+	if (chunks->smpl.id != 0 && chunks->smpl.size >= 36) {
+		uint_fast64_t nloop = cop_ld_ule32(chunks->smpl.data + 28);
+		uint_fast64_t nmax  = (chunks->smpl.size - 36) / 24;
+		bound += (nloop < nmax) ? nloop : nmax;
+	}
+	return bound;
+}
+
+/* The number of slots in each table of an index for at most "bound" markers
+ * or zero if they are not worth indexing (or too many to index). */
+static size_t marker_index_slots(uint_fast64_t bound)
+{
+	size_t slots = 1;
+	if (bound <= MARKER_INDEX_MIN || bound > 0x3FFFFFFFu || bound > SIZE_MAX / 32)
+		return 0;
+	while (slots < 2 * bound)
+		slots *= 2;
+	return slots;
+}
+
+/* The scratch space which must be passed to mount_memory() for a file with at
+ * most "bound" markers to be indexed when the stack tables are too small. */
+static size_t marker_index_scratch_size(uint_fast64_t bound)
+{
+	size_t slots = marker_index_slots(bound);
+	return (slots > MARKER_INDEX_STACK_SLOTS) ? 2 * slots * sizeof(uint_least32_t) : 0;
+}
+
+static void marker_index_init(struct smplwav *wav, struct marker_index *index, const struct smplwav_mount_chunks *chunks, uint_least32_t *stack, void *scratch, size_t scratch_size)
+{
+	uint_fast64_t bound = marker_bound(chunks);
+	size_t        slots;
+
+	if (bound > wav->max_marker)
+		bound = wav->max_marker;
+
+	index->bits        = 0;
+	index->by_id       = NULL;
+	index->by_position = NULL;
+	if ((slots = marker_index_slots(bound)) == 0)
+		return;
+
+	if (slots <= MARKER_INDEX_STACK_SLOTS)
+		index->by_id = stack;
+	else if (scratch_size / (2 * sizeof(uint_least32_t)) >= slots)
+		index->by_id = scratch;
+	else
+		return;
+
+	while (((size_t)1 << index->bits) < slots)
+		index->bits++;
+	index->by_position = index->by_id + slots;
+	memset(index->by_id, 0, 2 * slots * sizeof(uint_least32_t));
+}
+
+static struct smplwav_marker *get_marker(struct smplwav *wav, struct marker_index *index, uint_fast32_t id)
 {
 	unsigned i;
 	struct smplwav_marker *marker;
-	for (i = 0; i < wav->nb_marker; i++) {
-		if (wav->markers[i].id == id)
-			return &(wav->markers[i]);
+	if (index->bits) {
+		unsigned mask = (1u << index->bits) - 1;
+		for (i = marker_hash(index, id); index->by_id[i]; i = (i + 1) & mask) {
+			if (wav->markers[index->by_id[i] - 1].id == id)
+				return &(wav->markers[index->by_id[i] - 1]);
+		}
+	} else {
+		for (i = 0; i < wav->nb_marker; i++) {
+			if (wav->markers[i].id == id)
+				return &(wav->markers[i]);
+		}
 	}
-	if ((marker = get_new_marker(wav)) != NULL)
+	if ((marker = get_new_marker(wav)) != NULL) {
 		marker->id = id;
+		if (index->bits)
+			marker_index_insert(index, index->by_id, id, wav->nb_marker - 1);
+	}
 	return marker;
 }
 
 static
 unsigned
 load_adtl
-	(struct smplwav *wav
-	,unsigned char     *adtl
-	,size_t             adtl_len
+	(struct smplwav      *wav
+	,struct marker_index *index
+	,unsigned char       *adtl
+	,size_t               adtl_len
 	)
 {
 	unsigned warnings = 0;
@@ -100,7 +213,7 @@ load_adtl
 
 		/* The a metadata item with the given ID associated with this adtl
 		 * metadata chunk. */
-		marker = get_marker(wav, cop_ld_ule32(meta_base));
+		marker = get_marker(wav, index, cop_ld_ule32(meta_base));
 		if (marker == NULL)
 			return warnings | SMPLWAV_ERROR_TOO_MANY_MARKERS;
 
@@ -137,9 +250,10 @@ load_adtl
 static
 unsigned
 load_cue
-	(struct smplwav *wav
-	,unsigned char     *cue
-	,size_t             cue_len
+	(struct smplwav      *wav
+	,struct marker_index *index
+	,unsigned char       *cue
+	,size_t               cue_len
 	)
 {
 	uint_fast32_t  ncue;
@@ -150,7 +264,7 @@ load_cue
 	cue += 4;
 	while (ncue--) {
 		uint_fast32_t cue_id      = cop_ld_ule32(cue);
-		struct smplwav_marker *marker = get_marker(wav, cue_id);
+		struct smplwav_marker *marker = get_marker(wav, index, cue_id);
 		if (marker == NULL)
 			return SMPLWAV_ERROR_TOO_MANY_MARKERS;
 
@@ -165,16 +279,82 @@ load_cue
 	return 0;
 }
 
+/* Finds the first marker which a sampler loop can be associated with, or
+ * returns nb_marker if there is none. See load_smpl(). */
+static
+unsigned
+find_loop_marker
+	(const struct smplwav      *wav
+	,const struct marker_index *index
+	,unsigned                   nb_old
+	,uint_fast32_t              id
+	,uint_fast32_t              start
+	,uint_fast32_t              length
+	)
+{
+	unsigned mask = (1u << index->bits) - 1;
+	unsigned i;
+	unsigned j;
+
+	if (!index->bits) {
+		for (j = 0; j < wav->nb_marker; j++) {
+			/* If the loop has the same id as some metadata, but the
+			 * metadata has no cue point, we can associate it with this
+			 * metadata item. */
+			if (id == wav->markers[j].id && !wav->markers[j].in_cue)
+				break;
+
+			/* If the loop matches an existing loop, we can associate it
+			 * with this metadata item. */
+			if  (   (wav->markers[j].in_cue)
+			    &&  (wav->markers[j].position == start)
+			    &&  (!wav->markers[j].has_ltxt || wav->markers[j].length == length)
+			    )
+				break;
+		}
+		return j;
+	}
+
+	/* The same search using the index. IDs are unique amongst the "nb_old"
+	 * markers which existed before the smpl chunk was loaded; markers created
+	 * for loops follow them and all have an ID of zero. Markers with a cue
+	 * point are never modified in a way which affects the position match so
+	 * the position index does not need updating. */
+	j = wav->nb_marker;
+	for (i = marker_hash(index, id); index->by_id[i]; i = (i + 1) & mask) {
+		const struct smplwav_marker *m = wav->markers + index->by_id[i] - 1;
+		if (m->id == id) {
+			if (!m->in_cue)
+				j = index->by_id[i] - 1;
+			break;
+		}
+	}
+	if (id == 0 && nb_old < j)
+		j = nb_old;
+
+	for (i = marker_hash(index, start); index->by_position[i]; i = (i + 1) & mask) {
+		unsigned                     k = index->by_position[i] - 1;
+		const struct smplwav_marker *m = wav->markers + k;
+		if (k < j && m->position == start && (!m->has_ltxt || m->length == length))
+			j = k;
+	}
+
+	return j;
+}
+
 static
 unsigned
 load_smpl
-	(struct smplwav *wav
-	,unsigned char     *smpl
-	,size_t             smpl_len
+	(struct smplwav      *wav
+	,struct marker_index *index
+	,unsigned char       *smpl
+	,size_t               smpl_len
 	)
 {
 	uint_fast32_t nloop;
 	uint_fast32_t i;
+	unsigned      nb_old = wav->nb_marker;
+	unsigned      j;
 
 	if (smpl_len < 36 || (smpl_len < (36 + (nloop = cop_ld_ule32(smpl + 28)) * 24 + cop_ld_ule32(smpl + 32))))
 		return SMPLWAV_ERROR_SMPL_INVALID;
@@ -182,13 +362,18 @@ load_smpl
 	wav->has_pitch_info = 1;
 	wav->pitch_info = (((uint_fast64_t)cop_ld_ule32(smpl + 12)) << 32) | cop_ld_ule32(smpl + 16);
 
+	if (index->bits) {
+		for (j = 0; j < wav->nb_marker; j++)
+			if (wav->markers[j].in_cue)
+				marker_index_insert(index, index->by_position, wav->markers[j].position, j);
+	}
+
 	smpl += 36;
 	for (i = 0; i < nloop; i++) {
 		uint_fast32_t      id    = cop_ld_ule32(smpl);
 		uint_fast32_t      start = cop_ld_ule32(smpl + 8);
 		uint_fast32_t      end   = cop_ld_ule32(smpl + 12);
 		uint_fast32_t      length;
-		unsigned           j;
 		struct smplwav_marker *marker;
 
 		if (start > end)
@@ -196,21 +381,7 @@ load_smpl
 
 		length = end - start + 1;
 
-		for (j = 0; j < wav->nb_marker; j++) {
-			/* If the loop has the same id as some metadata, but the
-			 * metadata has no cue point, we can associate it with this
-			 * metadata item. */
-			if (id == wav->markers[j].id && !wav->markers[j].in_cue)
-				break;
-
-			/* If the loop matches an existing loop, we can associate it
-			 * with this metadata item. */
-			if  (   (wav->markers[j].in_cue)
-			    &&  (wav->markers[j].position == start)
-			    &&  (!wav->markers[j].has_ltxt || wav->markers[j].length == length)
-			    )
-				break;
-		}
+		j = find_loop_marker(wav, index, nb_old, id, start, length);
 
 		if (j < wav->nb_marker) {
 			marker = wav->markers + j;
@@ -254,7 +425,7 @@ check_and_finalise_markers
 			return SMPLWAV_ERROR_MARKER_RANGE;
 		if (wav->markers[i].length > 0) {
 			/* Check duration does not go outside audio region. */
-			if (wav->markers[i].position + wav->markers[i].length > wav->data_frames)
+			if ((uint_fast64_t)wav->markers[i].position + wav->markers[i].length > wav->data_frames)
 				return SMPLWAV_ERROR_MARKER_RANGE;
 			if (wav->markers[i].in_smpl && !wav->markers[i].in_cue)
 				nb_smpl_only_loops++;
@@ -400,160 +571,909 @@ static unsigned load_info(char **infoset, unsigned char *buf, size_t sz)
 	return warnings;
 }
 
-unsigned smplwav_mount(struct smplwav *wav, unsigned char *buf, size_t bufsz, unsigned flags)
+static void begin_mount(struct smplwav *wav, struct smplwav_mount_chunks *chunks)
 {
-	uint_fast32_t riff_sz;
-	unsigned warnings = 0;
-	struct smplwav_extra_ck info;
-	struct smplwav_extra_ck adtl;
-	struct smplwav_extra_ck cue;
-	struct smplwav_extra_ck smpl;
-	struct smplwav_extra_ck fact;
-	struct smplwav_extra_ck data;
-	struct smplwav_extra_ck fmt;
-
-	if  (   (bufsz < 12)
-	    ||  (cop_ld_ule32(buf) != SMPLWAV_RIFF_ID('R', 'I', 'F', 'F'))
-	    ||  ((riff_sz = cop_ld_ule32(buf + 4)) < 4)
-	    ||  (cop_ld_ule32(buf + 8) != SMPLWAV_RIFF_ID('W', 'A', 'V', 'E'))
-	    )
-		return SMPLWAV_ERROR_NOT_A_WAVE;
-
-	riff_sz -= 4;
-	bufsz   -= 12;
-	buf     += 12;
-
-	if (riff_sz > bufsz) {
-		warnings |= SMPLWAV_WARNING_FILE_TRUNCATION;
-		riff_sz = (uint_fast32_t)bufsz;
-	}
-
 	wav->nb_unsupported = 0;
 	wav->nb_marker = 0;
 	wav->has_pitch_info = 0;
 	wav->pitch_info = 0;
 	memset(wav->info, 0, sizeof(wav->info));
+	memset(chunks, 0, sizeof(*chunks));
+	if (wav->directory != NULL) {
+		wav->directory->nb_chunk = 0;
+		memset(wav->directory->bucket, 0, sizeof(wav->directory->bucket));
+	}
+}
 
-	info.data = NULL;
-	adtl.data = NULL;
-	cue.data  = NULL;
-	smpl.data = NULL;
-	fact.data = NULL;
-	data.data = NULL;
-	fmt.data  = NULL;
+/* LIST chunks are looked up by their list type. */
+static uint_fast32_t directory_key(uint_fast32_t id, uint_fast32_t list_type)
+{
+	return (id == SMPLWAV_RIFF_ID('L', 'I', 'S', 'T') && list_type != 0) ? list_type : id;
+}
 
-	while (riff_sz >= 8) {
-		uint_fast32_t            ckid           = cop_ld_ule32(buf);
-		uint_fast32_t            cksz           = cop_ld_ule32(buf + 4);
-		int                      required_chunk = 0;
-		unsigned char           *ckbase         = buf + 8;
-		struct smplwav_extra_ck *known_ptr      = NULL;
-
-		/* Compute the amount of data left and move buf to point to the next
-		 * chunk. We always truncate the length of the chunk if it would go
-		 * beyond the length of the main RIFF body. */
-		riff_sz -= 8;
-		buf     += 8;
-		if (cksz >= riff_sz) {
-			cksz    = riff_sz;
-			riff_sz = 0;
-		} else {
-			buf     += cksz + (cksz & 1);
-			riff_sz -= cksz + (cksz & 1);
+static unsigned directory_bucket(uint_fast32_t key)
+{
+	return (unsigned)(((key * 0x9E3779B1u) & 0xFFFFFFFFu) >> 26);
+}
+
+/* Appends a chunk to the directory. Entries are linked into their bucket in
+ * file order (bucket and next hold an entry index plus one) so that
+ * smplwav_chunk_find() returns the first chunk with a given identifier. */
+static unsigned directory_add(struct smplwav_chunk_directory *dir, uint_fast32_t ckid, uint_fast32_t list_type, uint_fast64_t offset, uint_fast64_t cksz)
+{
+	struct smplwav_chunk *ck;
+	unsigned             *link;
+
+	if (dir->nb_chunk++ >= dir->max_chunk)
+		return SMPLWAV_WARNING_DIRECTORY_TRUNCATED;
+
+	ck            = dir->chunks + dir->nb_chunk - 1;
+	ck->id        = ckid;
+	ck->list_type = list_type;
+	ck->offset    = offset;
+	ck->size      = cksz;
+	ck->next      = 0;
+
+	link = &(dir->bucket[directory_bucket(directory_key(ckid, list_type))]);
+	while (*link != 0)
+		link = &(dir->chunks[*link - 1].next);
+	*link = dir->nb_chunk;
+
+	return 0;
+}
+
+static const struct smplwav_chunk *directory_scan(const struct smplwav_chunk_directory *directory, unsigned link, uint_fast32_t key)
+{
+	while (link != 0) {
+		const struct smplwav_chunk *ck = directory->chunks + link - 1;
+		if (directory_key(ck->id, ck->list_type) == key)
+			return ck;
+		link = ck->next;
+	}
+	return NULL;
+}
+
+const struct smplwav_chunk *smplwav_chunk_find(const struct smplwav_chunk_directory *directory, uint_fast32_t id)
+{
+	return directory_scan(directory, directory->bucket[directory_bucket(id)], id);
+}
+
+const struct smplwav_chunk *smplwav_chunk_find_next(const struct smplwav_chunk_directory *directory, const struct smplwav_chunk *chunk)
+{
+	return directory_scan(directory, chunk->next, directory_key(chunk->id, chunk->list_type));
+}
+
+/* Decides what should happen to a chunk and records it in the chunk
+ * directory of the wave. On success, *slot is set to the structure which
+ * should receive the chunk data or NULL if the chunk is to be dropped. The id
+ * and size of the slot are filled in; the caller must set the data pointer.
+ * list_type must contain the first four bytes of the chunk body if ckid is
+ * LIST and cksz is at least 4. offset is the position of the body in the
+ * file. */
+static
+unsigned
+select_chunk
+	(struct smplwav              *wav
+	,struct smplwav_mount_chunks *chunks
+	,uint_fast32_t                ckid
+	,uint_fast64_t                cksz
+	,uint_fast32_t                list_type
+	,uint_fast64_t                offset
+	,unsigned                     flags
+	,struct smplwav_extra_ck    **slot
+	)
+{
+	int                      required_chunk = 0;
+	struct smplwav_extra_ck *known_ptr      = NULL;
+	unsigned                 warnings       = 0;
+
+	*slot = NULL;
+
+	if (ckid != SMPLWAV_RIFF_ID('L', 'I', 'S', 'T') || cksz < 4)
+		list_type = 0;
+
+	if (wav->directory != NULL)
+		warnings = directory_add(wav->directory, ckid, list_type, offset, cksz);
+
+	/* The ds64 chunk of an RF64 file has already been used to find the
+	 * sizes of the form and the data chunk. */
+	if (ckid == SMPLWAV_RIFF_ID('d', 's', '6', '4'))
+		return warnings;
+
+	/* Figure out if this is a required chunk, a "known" chunk or if we
+	 * don't know what the chunk is for. */
+	if (ckid == SMPLWAV_RIFF_ID('L', 'I', 'S', 'T') && cksz >= 4) {
+		switch (list_type) {
+			case SMPLWAV_RIFF_ID('a', 'd', 't', 'l'): known_ptr = &chunks->adtl; break;
+			case SMPLWAV_RIFF_ID('I', 'N', 'F', 'O'): known_ptr = &chunks->info; break;
+			default: break;
+		}
+	} else {
+		switch (ckid) {
+			case SMPLWAV_RIFF_ID('d', 'a', 't', 'a'): known_ptr = &chunks->data; required_chunk = 1; break;
+			case SMPLWAV_RIFF_ID('f', 'm', 't', ' '): known_ptr = &chunks->fmt;  required_chunk = 1; break;
+			case SMPLWAV_RIFF_ID('f', 'a', 'c', 't'): known_ptr = &chunks->fact; required_chunk = 1; break;
+			case SMPLWAV_RIFF_ID('c', 'u', 'e', ' '): known_ptr = &chunks->cue;  break;
+			case SMPLWAV_RIFF_ID('s', 'm', 'p', 'l'): known_ptr = &chunks->smpl; break;
+			default: break;
 		}
+	}
 
-		/* Figure out if this is a required chunk, a "known" chunk or if we
-		 * don't know what the chunk is for. */
-		if (ckid == SMPLWAV_RIFF_ID('L', 'I', 'S', 'T') && cksz >= 4) {
-			switch (cop_ld_ule32(ckbase)) {
-				case SMPLWAV_RIFF_ID('a', 'd', 't', 'l'): known_ptr = &adtl; break;
-				case SMPLWAV_RIFF_ID('I', 'N', 'F', 'O'): known_ptr = &info; break;
-				default: break;
-			}
+	/* If the chunk is required OR we know what the chunk is for and we
+	 * are not resetting OR we don't know what the chunks is for but we
+	 * for whatever reason want to preserve chunks we don't know how to
+	 * handle: figure out where we need to place the information. Also,
+	 * all the chunks which are "known" we do not support duplicates of,
+	 * so figure out if that's happened here also. */ 
+	if  (   required_chunk
+	    ||  (known_ptr != NULL && !(flags & SMPLWAV_MOUNT_RESET))
+	    ||  (known_ptr == NULL && (flags & SMPLWAV_MOUNT_PRESERVE_UNKNOWN))
+	    ) {
+
+		if (known_ptr != NULL) {
+			/* There are no chunks which we know how to interpret which
+			 * can occur more than once. */
+			if (known_ptr->id != 0)
+				return warnings | SMPLWAV_ERROR_DUPLICATE_CHUNKS;
 		} else {
-			switch (ckid) {
-				case SMPLWAV_RIFF_ID('d', 'a', 't', 'a'): known_ptr = &data; required_chunk = 1; break;
-				case SMPLWAV_RIFF_ID('f', 'm', 't', ' '): known_ptr = &fmt;  required_chunk = 1; break;
-				case SMPLWAV_RIFF_ID('f', 'a', 'c', 't'): known_ptr = &fact; required_chunk = 1; break;
-				case SMPLWAV_RIFF_ID('c', 'u', 'e', ' '): known_ptr = &cue;  break;
-				case SMPLWAV_RIFF_ID('s', 'm', 'p', 'l'): known_ptr = &smpl; break;
-				default: break;
-			}
+			if (wav->nb_unsupported >= wav->max_unsupported)
+				return warnings | SMPLWAV_ERROR_TOO_MANY_CHUNKS;
+
+			known_ptr = wav->unsupported + wav->nb_unsupported++;
 		}
 
-		/* If the chunk is required OR we know what the chunk is for and we
-		 * are not resetting OR we don't know what the chunks is for but we
-		 * for whatever reason want to preserve chunks we don't know how to
-		 * handle: figure out where we need to place the information. Also,
-		 * all the chunks which are "known" we do not support duplicates of,
-		 * so figure out if that's happened here also. */ 
-		if  (   required_chunk
-		    ||  (known_ptr != NULL && !(flags & SMPLWAV_MOUNT_RESET))
-		    ||  (known_ptr == NULL && (flags & SMPLWAV_MOUNT_PRESERVE_UNKNOWN))
-		    ) {
+		/* Only the data chunk can be larger than 4 GB. */
+		if (known_ptr == &chunks->data)
+			chunks->data_size = cksz;
 
-			if (known_ptr != NULL) {
-				/* There are no chunks which we know how to interpret which
-				 * can occur more than once. */
-				if (known_ptr->data != NULL)
-					return warnings | SMPLWAV_ERROR_DUPLICATE_CHUNKS;
-			} else {
-				if (wav->nb_unsupported >= SMPLWAV_MAX_UNSUPPORTED_CHUNKS)
-					return warnings | SMPLWAV_ERROR_TOO_MANY_CHUNKS;
+		known_ptr->id   = ckid;
+		known_ptr->size = (cksz > 0xFFFFFFFFu) ? 0xFFFFFFFFu : (uint_fast32_t)cksz;
+		known_ptr->data = NULL;
+		*slot           = known_ptr;
+	}
 
-				known_ptr = wav->unsupported + wav->nb_unsupported++;
-			}
+	return warnings;
+}
 
-			known_ptr->id   = ckid;
-			known_ptr->size = cksz;
-			known_ptr->data = ckbase;
-		}
+/* Loads the format and finds the audio once the RIFF chunk has been
+ * walked. */
+static unsigned mount_format(struct smplwav *wav, const struct smplwav_mount_chunks *chunks)
+{
+	unsigned      err;
+	uint_fast16_t block_align;
+
+	/* The wave file was missing the format or the data chunk. Totally
+	 * broken. */
+	if (chunks->fmt.id == 0 || chunks->data.id == 0)
+		return SMPLWAV_ERROR_NOT_A_WAVE;
+
+	/* Load the format chunk into our "simple" format descriptor. */
+	if ((err = load_sample_format(&(wav->format), chunks->fmt.data, chunks->fmt.size)) != 0)
+		return err;
+
+	/* Compute the number of frames in the audio. */
+	block_align      = (wav->format.channels * smplwav_format_container_size(wav->format.format));
+
+	/* If the data chunk does not contain a whole multiple of frames, it
+	 * is missing audio and we should probably (??) abort the load. */
+	if (chunks->data_size % block_align)
+		return SMPLWAV_ERROR_DATA_INVALID;
+
+	wav->data        = chunks->data.data;
+	wav->data_frames = chunks->data_size / block_align;
+	return 0;
+}
+
+static unsigned mount_info(struct smplwav *wav, const struct smplwav_mount_chunks *chunks)
+{
+	if (chunks->info.id == 0)
+		return 0;
+	return load_info(wav->info, chunks->info.data, chunks->info.size);
+}
+
+/* Builds the markers from the adtl, cue and smpl chunks. The format must
+ * already have been loaded. "scratch" may be NULL; see marker_index_init(). */
+static unsigned mount_markers(struct smplwav *wav, const struct smplwav_mount_chunks *chunks, unsigned flags, void *scratch, size_t scratch_size)
+{
+	uint_least32_t      stack[2 * MARKER_INDEX_STACK_SLOTS];
+	struct marker_index index;
+	unsigned            warnings = 0;
+
+	assert(wav->nb_marker == 0);
+
+	marker_index_init(wav, &index, chunks, stack, scratch, scratch_size);
+
+	if (chunks->adtl.id != 0) {
+		if (SMPLWAV_ERROR_CODE(warnings |= load_adtl(wav, &index, chunks->adtl.data, chunks->adtl.size)))
+			return warnings;
 	}
 
-	if (fmt.data != NULL && data.data != NULL) {
-		uint_fast16_t block_align;
+	if (chunks->cue.id != 0) {
+		if (SMPLWAV_ERROR_CODE(warnings |= load_cue(wav, &index, chunks->cue.data, chunks->cue.size)))
+			return warnings;
+	}
 
-		/* Load the format chunk into our "simple" format descriptor. */
-		if (SMPLWAV_ERROR_CODE(warnings |= load_sample_format(&(wav->format), fmt.data, fmt.size)))
+	if (chunks->smpl.id != 0) {
+		if (SMPLWAV_ERROR_CODE(warnings |= load_smpl(wav, &index, chunks->smpl.data, chunks->smpl.size)))
 			return warnings;
+	}
+
+	return warnings | check_and_finalise_markers(wav, flags);
+}
+
+/* Interprets the chunks once the RIFF chunk has been walked. */
+static unsigned finish_mount(struct smplwav *wav, const struct smplwav_mount_chunks *chunks, unsigned flags, unsigned warnings, void *scratch, size_t scratch_size)
+{
+	if (SMPLWAV_ERROR_CODE(warnings |= mount_format(wav, chunks)))
+		return warnings;
+
+	if (SMPLWAV_ERROR_CODE(warnings |= mount_info(wav, chunks)))
+		return warnings;
 
-		/* Compute the number of frames in the audio. */
-		block_align      = (wav->format.channels * smplwav_format_container_size(wav->format.format));
+	return warnings | mount_markers(wav, chunks, flags, scratch, scratch_size);
+}
+
+/* The location of the chunks of a wave file as described by its header. For
+ * RF64 and BW64 files, the sizes of the form and of the data chunk come from
+ * the ds64 chunk (which is skipped). */
+struct riff_header {
+	uint_fast64_t body_offset;
+	uint_fast64_t riff_sz;
+	uint_fast64_t data_size;
+	int           rf64;
+};
+
+/* The smallest number of bytes which must be passed to parse_header() for
+ * an RF64 file: the form header, the ds64 chunk header and the riff, data
+ * and sample count fields. */
+#define RIFF_HEADER_MAX (44)
+
+/* Parses the first "hdr_sz" bytes of a file. The form size is not checked
+ * against the size of the file. */
+static unsigned parse_header(struct riff_header *h, const unsigned char *hdr, uint_fast64_t hdr_sz)
+{
+	uint_fast32_t form;
+	uint_fast32_t riff_sz;
 
-		/* If the data chunk does not contain a whole multiple of frames, it
-		 * is missing audio and we should probably (??) abort the load. */
-		if (data.size % block_align)
-			return warnings | SMPLWAV_ERROR_DATA_INVALID;
+	if  (   (hdr_sz < 12)
+	    ||  ((riff_sz = cop_ld_ule32(hdr + 4)) < 4)
+	    ||  (cop_ld_ule32(hdr + 8) != SMPLWAV_RIFF_ID('W', 'A', 'V', 'E'))
+	    )
+		return SMPLWAV_ERROR_NOT_A_WAVE;
 
-		wav->data        = data.data;
-		wav->data_frames = data.size / block_align;
+	form = cop_ld_ule32(hdr);
+	if (form == SMPLWAV_RIFF_ID('R', 'I', 'F', 'F')) {
+		h->body_offset = 12;
+		h->riff_sz     = riff_sz - 4;
+		h->data_size   = 0;
+		h->rf64        = 0;
+	} else if (form == SMPLWAV_RIFF_ID('R', 'F', '6', '4') || form == SMPLWAV_RIFF_ID('B', 'W', '6', '4')) {
+		uint_fast32_t ds64_sz;
+		uint_fast64_t form_sz;
+
+		if  (   (hdr_sz < RIFF_HEADER_MAX)
+		    ||  (cop_ld_ule32(hdr + 12) != SMPLWAV_RIFF_ID('d', 's', '6', '4'))
+		    ||  ((ds64_sz = cop_ld_ule32(hdr + 16)) < 24)
+		    )
+			return SMPLWAV_ERROR_NOT_A_WAVE;
+
+		/* The form size includes the "WAVE" identifier and the ds64 chunk. */
+		h->body_offset = 20 + (uint_fast64_t)ds64_sz + (ds64_sz & 1);
+		form_sz        = smplwav_ld_ule64(hdr + 20);
+		h->data_size   = smplwav_ld_ule64(hdr + 28);
+		h->rf64        = 1;
+		if (form_sz < h->body_offset - 8)
+			return SMPLWAV_ERROR_NOT_A_WAVE;
+		h->riff_sz     = form_sz - (h->body_offset - 8);
 	} else {
-		/* The wave file was missing the format or the data chunk. Totally
-		 * broken. */
-		return warnings | SMPLWAV_ERROR_NOT_A_WAVE;
+		return SMPLWAV_ERROR_NOT_A_WAVE;
 	}
 
-	if (info.data != NULL) {
-		if (SMPLWAV_ERROR_CODE(warnings |= load_info(wav->info, info.data, info.size)))
-			return warnings;
+	return 0;
+}
+
+/* Returns the real size of a chunk given the 32-bit size in its header. */
+static uint_fast64_t header_chunk_size(const struct riff_header *h, uint_fast32_t ckid, uint_fast32_t cksz)
+{
+	if (h->rf64 && cksz == 0xFFFFFFFFu && ckid == SMPLWAV_RIFF_ID('d', 'a', 't', 'a'))
+		return h->data_size;
+	return cksz;
+}
+
+/* Moves to the next chunk of a wave file which is in memory. Returns zero
+ * when there are no more chunks. The size of the chunk is always truncated
+ * if it would go beyond the end of the form. */
+static int next_chunk(const struct riff_header *h, unsigned char **buf, uint_fast64_t *riff_sz, uint_fast32_t *ckid, uint_fast64_t *cksz, unsigned char **ckbase)
+{
+	if (*riff_sz < 8)
+		return 0;
+
+	*ckid     = cop_ld_ule32(*buf);
+	*cksz     = header_chunk_size(h, *ckid, cop_ld_ule32(*buf + 4));
+	*ckbase   = *buf + 8;
+	*riff_sz -= 8;
+	*buf     += 8;
+	if (*cksz >= *riff_sz) {
+		*cksz    = *riff_sz;
+		*riff_sz = 0;
+	} else {
+		*buf     += *cksz + (*cksz & 1);
+		*riff_sz -= *cksz + (*cksz & 1);
 	}
 
-	assert(wav->nb_marker == 0);
+	return 1;
+}
 
-	if (adtl.data != NULL) {
-		if (SMPLWAV_ERROR_CODE(warnings |= load_adtl(wav, adtl.data, adtl.size)))
+/* Parses the header of a wave file which is in memory and finds the first
+ * chunk and the amount of data which follows it. */
+static unsigned begin_walk(struct riff_header *h, unsigned char **buf, size_t bufsz, uint_fast64_t *riff_sz)
+{
+	unsigned err;
+
+	if ((err = parse_header(h, *buf, bufsz)) != 0 || h->body_offset > bufsz)
+		return SMPLWAV_ERROR_NOT_A_WAVE;
+
+	*buf     += h->body_offset;
+	*riff_sz  = h->riff_sz;
+	if (*riff_sz > bufsz - h->body_offset) {
+		*riff_sz = bufsz - h->body_offset;
+		return SMPLWAV_WARNING_FILE_TRUNCATION;
+	}
+
+	return 0;
+}
+
+/* smplwav_mount_memory() with scratch space for indexing the markers. */
+static unsigned mount_memory(struct smplwav *wav, unsigned char *buf, size_t bufsz, unsigned flags, void *scratch, size_t scratch_size)
+{
+	struct riff_header          h;
+	uint_fast64_t               riff_sz;
+	uint_fast32_t               ckid;
+	uint_fast64_t               cksz;
+	unsigned char              *ckbase;
+	unsigned char              *file = buf;
+	unsigned                    warnings;
+	struct smplwav_mount_chunks chunks;
+
+	if (SMPLWAV_ERROR_CODE(warnings = begin_walk(&h, &buf, bufsz, &riff_sz)))
+		return warnings;
+
+	begin_mount(wav, &chunks);
+
+	while (next_chunk(&h, &buf, &riff_sz, &ckid, &cksz, &ckbase)) {
+		struct smplwav_extra_ck *slot;
+
+		if (SMPLWAV_ERROR_CODE(warnings |= select_chunk(wav, &chunks, ckid, cksz, (cksz >= 4) ? cop_ld_ule32(ckbase) : 0, ckbase - file, flags, &slot)))
 			return warnings;
+
+		if (slot != NULL)
+			slot->data = ckbase;
 	}
 
-	if (cue.data != NULL) {
-		if (SMPLWAV_ERROR_CODE(warnings |= load_cue(wav, cue.data, cue.size)))
+	return finish_mount(wav, &chunks, flags, warnings, scratch, scratch_size);
+}
+
+unsigned smplwav_mount_memory(struct smplwav *wav, unsigned char *buf, size_t bufsz, unsigned flags)
+{
+	return mount_memory(wav, buf, bufsz, flags, NULL, 0);
+}
+
+#define LAZY_INFO    (1u)
+#define LAZY_MARKERS (2u)
+
+unsigned smplwav_mount_lazy(struct smplwav *wav, struct smplwav_lazy *lazy, unsigned char *buf, size_t bufsz, unsigned flags)
+{
+	struct riff_header  h;
+	uint_fast64_t       riff_sz;
+	uint_fast32_t       ckid;
+	uint_fast64_t       cksz;
+	unsigned char      *ckbase;
+	unsigned char      *file = buf;
+	unsigned            warnings;
+
+	if (SMPLWAV_ERROR_CODE(warnings = begin_walk(&h, &buf, bufsz, &riff_sz)))
+		return warnings;
+
+	begin_mount(wav, &(lazy->chunks));
+	lazy->wav           = wav;
+	lazy->flags         = flags;
+	lazy->loaded        = 0;
+	lazy->info_result   = 0;
+	lazy->marker_result = 0;
+
+	while (next_chunk(&h, &buf, &riff_sz, &ckid, &cksz, &ckbase)) {
+		struct smplwav_extra_ck *slot;
+
+		if (SMPLWAV_ERROR_CODE(warnings |= select_chunk(wav, &(lazy->chunks), ckid, cksz, (cksz >= 4) ? cop_ld_ule32(ckbase) : 0, ckbase - file, flags, &slot)))
 			return warnings;
+
+		if (slot != NULL)
+			slot->data = ckbase;
+	}
+
+	return warnings | mount_format(wav, &(lazy->chunks));
+}
+
+unsigned smplwav_lazy_load_info(struct smplwav_lazy *lazy)
+{
+	if (!(lazy->loaded & LAZY_INFO)) {
+		lazy->loaded     |= LAZY_INFO;
+		lazy->info_result = mount_info(lazy->wav, &(lazy->chunks));
+		if (SMPLWAV_ERROR_CODE(lazy->info_result))
+			memset(lazy->wav->info, 0, sizeof(lazy->wav->info));
+	}
+	return lazy->info_result;
+}
+
+unsigned smplwav_lazy_load_markers(struct smplwav_lazy *lazy)
+{
+	if (!(lazy->loaded & LAZY_MARKERS)) {
+		lazy->loaded       |= LAZY_MARKERS;
+		lazy->marker_result = mount_markers(lazy->wav, &(lazy->chunks), lazy->flags, NULL, 0);
+	}
+	return lazy->marker_result;
+}
+
+/* Used to find the alignment required by the storage in an arena. */
+struct arena_align_probe {
+	char c;
+	union {
+		struct smplwav_marker   marker;
+		struct smplwav_extra_ck ck;
+	} u;
+};
+
+#define ARENA_ALIGN (offsetof(struct arena_align_probe, u))
+
+static size_t arena_round(size_t sz)
+{
+	return (sz + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
+
+/* Walks the chunks of a wave file in the same way as smplwav_mount_memory() to find
+ * upper bounds on the number of markers and unsupported chunks that mounting
+ * it could produce. The bounds come from the smallest possible size of each
+ * cue point, sampler loop and adtl entry. Chunks which select_chunk() knows
+ * about are never stored as unsupported chunks so they are not counted. */
+static void arena_bounds(unsigned char *buf, size_t bufsz, unsigned flags, size_t *nb_marker, size_t *nb_unsupported)
+{
+	struct riff_header h;
+	uint_fast64_t      riff_sz;
+	uint_fast32_t      ckid;
+	uint_fast64_t      cksz;
+	unsigned char     *ckbase;
+
+	*nb_marker      = 0;
+	*nb_unsupported = 0;
+
+	if (SMPLWAV_ERROR_CODE(begin_walk(&h, &buf, bufsz, &riff_sz)))
+		return;
+
+	while (next_chunk(&h, &buf, &riff_sz, &ckid, &cksz, &ckbase)) {
+		uint_fast32_t list_type = (ckid == SMPLWAV_RIFF_ID('L', 'I', 'S', 'T') && cksz >= 4) ? cop_ld_ule32(ckbase) : 0;
+		switch (ckid) {
+			case SMPLWAV_RIFF_ID('c', 'u', 'e', ' '):
+				if (cksz >= 4)
+					*nb_marker += (size_t)((cksz - 4) / 24);
+				break;
+			case SMPLWAV_RIFF_ID('s', 'm', 'p', 'l'):
+				if (cksz >= 36)
+					*nb_marker += (size_t)((cksz - 36) / 24);
+				break;
+			case SMPLWAV_RIFF_ID('d', 's', '6', '4'):
+			case SMPLWAV_RIFF_ID('d', 'a', 't', 'a'):
+			case SMPLWAV_RIFF_ID('f', 'm', 't', ' '):
+			case SMPLWAV_RIFF_ID('f', 'a', 'c', 't'):
+				break;
+			case SMPLWAV_RIFF_ID('L', 'I', 'S', 'T'):
+				if (list_type == SMPLWAV_RIFF_ID('a', 'd', 't', 'l')) {
+					*nb_marker += (size_t)((cksz - 4) / 12);
+					break;
+				}
+				if (list_type == SMPLWAV_RIFF_ID('I', 'N', 'F', 'O'))
+					break;
+				/* fall through */
+			default:
+				if (flags & SMPLWAV_MOUNT_PRESERVE_UNKNOWN)
+					*nb_unsupported += 1;
+				break;
+		}
+	}
+}
+
+unsigned smplwav_mount_arena(struct smplwav *wav, unsigned char *buf, size_t bufsz, unsigned flags, void *arena, size_t arena_size, size_t *arena_used)
+{
+	size_t         max_marker;
+	size_t         max_unsupported;
+	size_t         markers_offset;
+	size_t         scratch_offset;
+	size_t         scratch_size;
+	size_t         required;
+	unsigned char *base = arena;
+	unsigned       ret;
+
+	struct riff_header h;
+
+	if (parse_header(&h, buf, bufsz) != 0)
+		return SMPLWAV_ERROR_NOT_A_WAVE;
+
+	arena_bounds(buf, bufsz, flags, &max_marker, &max_unsupported);
+
+	/* Unsupported chunks come first as their number is final once the chunks
+	 * have been walked; markers are then moved down to follow them. Files
+	 * with too many markers to index on the stack use the space after the
+	 * markers to index them while they are loaded. */
+	markers_offset = arena_round(max_unsupported * sizeof(struct smplwav_extra_ck));
+	scratch_offset = arena_round(markers_offset + max_marker * sizeof(struct smplwav_marker));
+	scratch_size   = marker_index_scratch_size(max_marker);
+	required       = arena_round(scratch_offset + scratch_size);
+	if (required > arena_size) {
+		*arena_used = required;
+		return SMPLWAV_ERROR_BUFFER_TOO_SMALL;
+	}
+
+	smplwav_set_storage(wav, (struct smplwav_marker *)(base + markers_offset), (unsigned)max_marker, (struct smplwav_extra_ck *)base, (unsigned)max_unsupported);
+	ret = mount_memory(wav, buf, bufsz, flags, scratch_size ? base + scratch_offset : NULL, scratch_size);
+
+	markers_offset = arena_round(wav->nb_unsupported * sizeof(struct smplwav_extra_ck));
+	if (wav->nb_marker)
+		memmove(base + markers_offset, wav->markers, wav->nb_marker * sizeof(struct smplwav_marker));
+	wav->markers         = (struct smplwav_marker *)(base + markers_offset);
+	wav->max_marker      = wav->nb_marker;
+	wav->max_unsupported = wav->nb_unsupported;
+	*arena_used          = arena_round(markers_offset + wav->nb_marker * sizeof(struct smplwav_marker));
+
+	return ret;
+}
+
+unsigned
+smplwav_mount_reader
+	(struct smplwav  *wav
+	,smplwav_read_fn  read
+	,void            *context
+	,uint_fast64_t    file_size
+	,unsigned char   *buf
+	,size_t           bufsz
+	,unsigned         flags
+	,uint_fast64_t   *data_offset
+	,uint_fast64_t   *data_size
+	)
+{
+	unsigned char               hdr[RIFF_HEADER_MAX];
+	struct riff_header          h;
+	uint_fast64_t               riff_sz;
+	uint_fast64_t               pos;
+	unsigned                    warnings = 0;
+	struct smplwav_mount_chunks chunks;
+
+	if (file_size < 12)
+		return SMPLWAV_ERROR_NOT_A_WAVE;
+
+	if (read(context, hdr, (file_size < RIFF_HEADER_MAX) ? 12 : RIFF_HEADER_MAX, 0))
+		return SMPLWAV_ERROR_READ;
+
+	if (parse_header(&h, hdr, (file_size < RIFF_HEADER_MAX) ? 12 : RIFF_HEADER_MAX) != 0 || h.body_offset > file_size)
+		return SMPLWAV_ERROR_NOT_A_WAVE;
+
+	riff_sz = h.riff_sz;
+	pos     = h.body_offset;
+
+	if (riff_sz > file_size - pos) {
+		warnings |= SMPLWAV_WARNING_FILE_TRUNCATION;
+		riff_sz = file_size - pos;
 	}
 
-	if (smpl.data != NULL) {
-		if (SMPLWAV_ERROR_CODE(warnings |= load_smpl(wav, smpl.data, smpl.size)))
+	begin_mount(wav, &chunks);
+
+	while (riff_sz >= 8) {
+		/* Read the first four bytes of the body along with the header where
+		 * possible as they are needed to identify LIST chunks. */
+		size_t                   hdr_sz = (riff_sz >= 12) ? 12 : 8;
+		uint_fast32_t            ckid;
+		uint_fast64_t            cksz;
+		uint_fast64_t            ckpos;
+		struct smplwav_extra_ck *slot;
+
+		if (read(context, hdr, hdr_sz, pos))
+			return warnings | SMPLWAV_ERROR_READ;
+
+		ckid     = cop_ld_ule32(hdr);
+		cksz     = header_chunk_size(&h, ckid, cop_ld_ule32(hdr + 4));
+		riff_sz -= 8;
+		pos     += 8;
+		ckpos    = pos;
+		if (cksz >= riff_sz) {
+			cksz    = riff_sz;
+			riff_sz = 0;
+		} else {
+			pos     += cksz + (cksz & 1);
+			riff_sz -= cksz + (cksz & 1);
+		}
+
+		if (SMPLWAV_ERROR_CODE(warnings |= select_chunk(wav, &chunks, ckid, cksz, (cksz >= 4) ? cop_ld_ule32(hdr + 8) : 0, ckpos, flags, &slot)))
 			return warnings;
+
+		/* The data chunk is never read and the fact chunk is not used for
+		 * anything. Everything else which is being kept is copied into the
+		 * caller's buffer. */
+		if (slot == &chunks.data) {
+			*data_offset = ckpos;
+		} else if (slot != NULL && slot != &chunks.fact) {
+			if (cksz > bufsz)
+				return warnings | SMPLWAV_ERROR_BUFFER_TOO_SMALL;
+			if (read(context, buf, (size_t)cksz, ckpos))
+				return warnings | SMPLWAV_ERROR_READ;
+			slot->data = buf;
+			buf       += cksz;
+			bufsz     -= (size_t)cksz;
+		}
 	}
 
-	return warnings | check_and_finalise_markers(wav, flags);
+	warnings = finish_mount(wav, &chunks, flags, warnings, NULL, 0);
+	if (!SMPLWAV_ERROR_CODE(warnings))
+		*data_size = chunks.data_size;
+	return warnings;
+}
+
+int smplwav_read_frames(const struct smplwav *wav, smplwav_read_fn read, void *context, uint_fast64_t data_offset, uint_fast64_t start, uint_fast32_t count, void *dest)
+{
+	uint_fast64_t frame_bytes = wav->format.channels * (uint_fast64_t)smplwav_format_container_size(wav->format.format);
+
+	if (start > wav->data_frames || count > wav->data_frames - start || count * frame_bytes > SIZE_MAX)
+		return 1;
+
+	if (count == 0)
+		return 0;
+
+	return read(context, dest, (size_t)(count * frame_bytes), data_offset + start * frame_bytes);
+}
+
+/* Stream states. */
+#define STREAM_RIFF_HEADER  (0)
+#define STREAM_CHUNK_HEADER (1)
+#define STREAM_LIST_TYPE    (2)
+#define STREAM_BODY         (3)
+#define STREAM_PAD          (4)
+#define STREAM_END          (5)
+#define STREAM_FAILED       (6)
+
+void smplwav_stream_init(struct smplwav_stream *stream, struct smplwav *wav, unsigned char *buf, size_t bufsz, unsigned flags)
+{
+	begin_mount(wav, &(stream->chunks));
+	stream->wav             = wav;
+	stream->slot            = NULL;
+	stream->buf             = buf;
+	stream->bufsz           = bufsz;
+	stream->hdr_fill        = 0;
+	stream->flags           = flags;
+	stream->warnings        = 0;
+	stream->state           = STREAM_RIFF_HEADER;
+	stream->riff_sz         = 0;
+	stream->ck_size         = 0;
+	stream->ck_received     = 0;
+	stream->offset          = 0;
+	stream->pad             = 0;
+	stream->format_reported = 0;
+}
+
+/* Moves bytes from the input into the header buffer until it contains "want"
+ * bytes. Returns non-zero once the header is complete. */
+static int stream_fill_header(struct smplwav_stream *stream, const unsigned char **data, size_t *size, size_t *consumed, unsigned want)
+{
+	while (stream->hdr_fill < want && *size) {
+		stream->hdr[stream->hdr_fill++] = **data;
+		(*data)++;
+		(*size)--;
+		(*consumed)++;
+	}
+	return stream->hdr_fill == want;
+}
+
+/* Copies part of the body of a chunk which is being kept into the metadata
+ * buffer. Space is only taken as bytes arrive so that a chunk with a size
+ * which is larger than the stream (which happens with truncated files)
+ * does not fail unnecessarily. */
+static unsigned stream_store(struct smplwav_stream *stream, const unsigned char *data, size_t size)
+{
+	if (size > stream->bufsz)
+		return SMPLWAV_ERROR_BUFFER_TOO_SMALL;
+	memcpy(stream->buf, data, size);
+	stream->buf   += size;
+	stream->bufsz -= size;
+	return 0;
+}
+
+/* Called once the ID (and for LIST chunks the list type) of a chunk is known.
+ * Decides where the body is going and stores any body bytes which were read
+ * along with the header (the list type). */
+static unsigned stream_begin_body(struct smplwav_stream *stream)
+{
+	uint_fast32_t ckid      = cop_ld_ule32(stream->hdr);
+	uint_fast32_t list_type = (stream->hdr_fill == 12) ? cop_ld_ule32(stream->hdr + 8) : 0;
+	unsigned      err;
+
+	if (SMPLWAV_ERROR_CODE(err = select_chunk(stream->wav, &(stream->chunks), ckid, stream->ck_size, list_type, stream->offset, stream->flags, &(stream->slot))))
+		return err;
+	stream->warnings |= err;
+
+	if (stream->slot == &(stream->chunks.fact)) {
+		stream->slot = NULL;
+	} else if (stream->slot != NULL && stream->slot != &(stream->chunks.data)) {
+		stream->slot->data = stream->buf;
+		if ((err = stream_store(stream, stream->hdr + 8, stream->hdr_fill - 8)) != 0)
+			return err;
+	}
+
+	stream->ck_received = stream->hdr_fill - 8;
+	stream->hdr_fill    = 0;
+	stream->state       = STREAM_BODY;
+	return 0;
+}
+
+/* Called when the body of a chunk has been received. */
+static unsigned stream_end_body(struct smplwav_stream *stream)
+{
+	stream->state = (stream->pad) ? STREAM_PAD : ((stream->riff_sz >= 8) ? STREAM_CHUNK_HEADER : STREAM_END);
+	if (stream->slot == &(stream->chunks.fmt))
+		return load_sample_format(&(stream->wav->format), stream->chunks.fmt.data, stream->chunks.fmt.size);
+	return 0;
+}
+
+unsigned smplwav_stream_push(struct smplwav_stream *stream, const unsigned char *data, size_t size, struct smplwav_stream_event *event)
+{
+	unsigned err = 0;
+
+	event->type       = SMPLWAV_STREAM_EVENT_NONE;
+	event->consumed   = 0;
+	event->audio      = NULL;
+	event->audio_size = 0;
+
+	while (!err) {
+		/* The format is reported once both the fmt chunk and the header of
+		 * the data chunk have been seen. */
+		if  (   !stream->format_reported
+		    &&  stream->chunks.data.id != 0
+		    &&  stream->chunks.fmt.id != 0
+		    &&  (stream->slot != &(stream->chunks.fmt) || stream->state != STREAM_BODY)
+		    ) {
+			size_t frame_bytes = stream->wav->format.channels * (size_t)smplwav_format_container_size(stream->wav->format.format);
+			stream->format_reported  = 1;
+			stream->wav->data_frames = (frame_bytes) ? (stream->chunks.data_size / frame_bytes) : 0;
+			event->type              = SMPLWAV_STREAM_EVENT_FORMAT;
+			return 0;
+		}
+
+		if (!size && stream->state != STREAM_BODY)
+			return 0;
+
+		switch (stream->state) {
+			case STREAM_RIFF_HEADER:
+				if (!stream_fill_header(stream, &data, &size, &(event->consumed), 12))
+					return 0;
+				if  (   (cop_ld_ule32(stream->hdr) != SMPLWAV_RIFF_ID('R', 'I', 'F', 'F'))
+				    ||  ((stream->riff_sz = cop_ld_ule32(stream->hdr + 4)) < 4)
+				    ||  (cop_ld_ule32(stream->hdr + 8) != SMPLWAV_RIFF_ID('W', 'A', 'V', 'E'))
+				    ) {
+					err = SMPLWAV_ERROR_NOT_A_WAVE;
+					break;
+				}
+				stream->riff_sz  -= 4;
+				stream->offset    = 12;
+				stream->hdr_fill  = 0;
+				stream->state     = (stream->riff_sz >= 8) ? STREAM_CHUNK_HEADER : STREAM_END;
+				break;
+
+			case STREAM_CHUNK_HEADER:
+				if (!stream_fill_header(stream, &data, &size, &(event->consumed), 8))
+					return 0;
+				stream->offset  += stream->ck_size + (stream->ck_size & 1) + 8;
+				stream->ck_size  = cop_ld_ule32(stream->hdr + 4);
+				stream->riff_sz -= 8;
+				if (stream->ck_size >= stream->riff_sz) {
+					stream->ck_size = stream->riff_sz;
+					stream->pad     = 0;
+					stream->riff_sz = 0;
+				} else {
+					stream->pad      = stream->ck_size & 1;
+					stream->riff_sz -= stream->ck_size + stream->pad;
+				}
+				if (cop_ld_ule32(stream->hdr) == SMPLWAV_RIFF_ID('L', 'I', 'S', 'T') && stream->ck_size >= 4)
+					stream->state = STREAM_LIST_TYPE;
+				else
+					err = stream_begin_body(stream);
+				break;
+
+			case STREAM_LIST_TYPE:
+				if (!stream_fill_header(stream, &data, &size, &(event->consumed), 12))
+					return 0;
+				err = stream_begin_body(stream);
+				break;
+
+			case STREAM_BODY:
+			{
+				size_t count = stream->ck_size - stream->ck_received;
+				if (!count) {
+					err = stream_end_body(stream);
+					break;
+				}
+				if (!size)
+					return 0;
+				if (count > size)
+					count = size;
+				if (stream->slot == &(stream->chunks.data)) {
+					event->type         = SMPLWAV_STREAM_EVENT_AUDIO;
+					event->audio        = data;
+					event->audio_size   = count;
+					event->audio_offset = stream->ck_received;
+				} else if (stream->slot != NULL && (err = stream_store(stream, data, count)) != 0) {
+					break;
+				}
+				stream->ck_received += (uint_fast32_t)count;
+				event->consumed     += count;
+				data                += count;
+				size                -= count;
+				if (event->type == SMPLWAV_STREAM_EVENT_AUDIO)
+					return 0;
+				break;
+			}
+
+			case STREAM_PAD:
+				event->consumed++;
+				data++;
+				size--;
+				stream->pad   = 0;
+				stream->state = (stream->riff_sz >= 8) ? STREAM_CHUNK_HEADER : STREAM_END;
+				break;
+
+			case STREAM_END:
+				/* The end of the RIFF chunk is too short to hold a chunk and
+				 * anything after the RIFF chunk is ignored. */
+				if (stream->riff_sz > size)
+					stream->riff_sz -= (uint_fast32_t)size;
+				else
+					stream->riff_sz = 0;
+				event->consumed += size;
+				return 0;
+
+			default:
+				return SMPLWAV_ERROR_NOT_A_WAVE;
+		}
+	}
+
+	stream->state = STREAM_FAILED;
+	return err;
+}
+
+unsigned smplwav_stream_finish(struct smplwav_stream *stream)
+{
+	unsigned warnings = stream->warnings;
+
+	if (stream->state == STREAM_FAILED || stream->state == STREAM_RIFF_HEADER)
+		return SMPLWAV_ERROR_NOT_A_WAVE;
+
+	/* The input ended before the end of the RIFF chunk. Truncate the chunk
+	 * which was being received in the same way as smplwav_mount_memory() would. A
+	 * LIST chunk which ended before its list type is an unknown chunk. */
+	if (stream->state != STREAM_END || stream->riff_sz) {
+		warnings |= SMPLWAV_WARNING_FILE_TRUNCATION;
+		if (stream->state == STREAM_LIST_TYPE) {
+			stream->ck_size = stream->hdr_fill - 8;
+			if (SMPLWAV_ERROR_CODE(warnings |= stream_begin_body(stream)))
+				return warnings;
+			warnings |= stream->warnings;
+		}
+		if (stream->state == STREAM_BODY && stream->slot != NULL) {
+			stream->slot->size = stream->ck_received;
+			if (stream->slot == &(stream->chunks.data))
+				stream->chunks.data_size = stream->ck_received;
+		}
+		if  (   stream->state == STREAM_BODY
+		    &&  stream->wav->directory != NULL
+		    &&  stream->wav->directory->nb_chunk <= stream->wav->directory->max_chunk
+		    )
+			stream->wav->directory->chunks[stream->wav->directory->nb_chunk - 1].size = stream->ck_received;
+	}
+
+	stream->state = STREAM_FAILED;
+	return finish_mount(stream->wav, &(stream->chunks), stream->flags, warnings, NULL, 0);
 }
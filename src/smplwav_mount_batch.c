@@ -0,0 +1,71 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#include "smplwav/smplwav_mount.h"
+
+struct batch_job {
+	struct smplwav_mount_batch_item *items;
+	unsigned                         nb_items;
+	unsigned                         flags;
+};
+
+static void run_batch_job(void *context, unsigned job)
+{
+	const struct batch_job *b     = context;
+	unsigned                start = job * SMPLWAV_MOUNT_BATCH_JOB_ITEMS;
+	unsigned                end   = (b->nb_items - start > SMPLWAV_MOUNT_BATCH_JOB_ITEMS) ? (start + SMPLWAV_MOUNT_BATCH_JOB_ITEMS) : b->nb_items;
+	unsigned                i;
+
+	for (i = start; i < end; i++) {
+		struct smplwav_mount_batch_item *item = b->items + i;
+		if (item->fd < 0) {
+			item->result      = smplwav_mount_memory(&(item->wav), item->buf, item->bufsz, b->flags);
+			item->data_offset = 0;
+			item->data_size   = 0;
+		} else {
+			item->result      = smplwav_mount_fd(&(item->wav), item->fd, item->buf, item->bufsz, b->flags, &(item->data_offset), &(item->data_size));
+		}
+	}
+}
+
+unsigned smplwav_mount_batch(struct smplwav_mount_batch_item *items, unsigned nb_items, unsigned flags, smplwav_executor_fn executor, void *executor_context)
+{
+	struct batch_job b;
+	unsigned         nb_jobs = (unsigned)((nb_items + (size_t)SMPLWAV_MOUNT_BATCH_JOB_ITEMS - 1) / SMPLWAV_MOUNT_BATCH_JOB_ITEMS);
+	unsigned         nb_failed;
+	unsigned         i;
+
+	b.items    = items;
+	b.nb_items = nb_items;
+	b.flags    = flags;
+
+	if (executor != NULL && nb_jobs > 1) {
+		executor(executor_context, run_batch_job, &b, nb_jobs);
+	} else {
+		for (i = 0; i < nb_jobs; i++)
+			run_batch_job(&b, i);
+	}
+
+	for (i = 0, nb_failed = 0; i < nb_items; i++)
+		if (SMPLWAV_ERROR_CODE(items[i].result))
+			nb_failed++;
+
+	return nb_failed;
+}
@@ -0,0 +1,129 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "smplwav/smplwav_mount.h"
+#include "smplwav/smplwav_cache.h"
+#include "smplwav_internal.h"
+
+#if defined(_WIN32)
+
+#include <windows.h>
+#include <io.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+int smplwav_read_fd(void *context, unsigned char *dest, size_t size, uint_fast64_t offset)
+{
+	HANDLE h = (HANDLE)_get_osfhandle(*(const int *)context);
+	if (h == INVALID_HANDLE_VALUE)
+		return 1;
+	while (size) {
+		OVERLAPPED ov;
+		DWORD      request = (size > 0x40000000u) ? 0x40000000u : (DWORD)size;
+		DWORD      got;
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset     = (DWORD)(offset & 0xFFFFFFFFu);
+		ov.OffsetHigh = (DWORD)(offset >> 32);
+		if (!ReadFile(h, dest, request, &got, &ov) || !got)
+			return 1;
+		dest   += got;
+		size   -= got;
+		offset += got;
+	}
+	return 0;
+}
+
+unsigned smplwav_mount_fd(struct smplwav *wav, int fd, unsigned char *buf, size_t bufsz, unsigned flags, uint_fast64_t *data_offset, uint_fast64_t *data_size)
+{
+	__int64 file_size = _filelengthi64(fd);
+	if (file_size < 0)
+		return SMPLWAV_ERROR_READ;
+	return smplwav_mount_reader(wav, smplwav_read_fd, &fd, (uint_fast64_t)file_size, buf, bufsz, flags, data_offset, data_size);
+}
+
+int smplwav_cache_key_fd(struct smplwav_cache_key *key, int fd)
+{
+	struct _stati64 st;
+	if (_fstati64(fd, &st) != 0)
+		return 1;
+	key->file_size = (uint_fast64_t)st.st_size;
+	key->mtime     = (uint_fast64_t)st.st_mtime * 1000000000u;
+	key->inode     = 0;
+	return 0;
+}
+
+#else
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* The nanoseconds part of the modification time. Darwin names it
+ * st_mtimespec when extensions are enabled and st_mtimensec otherwise. */
+#if defined(__APPLE__) && defined(_DARWIN_C_SOURCE)
+#define STAT_MTIME_NSEC(st_) ((st_).st_mtimespec.tv_nsec)
+#elif defined(__APPLE__)
+#define STAT_MTIME_NSEC(st_) ((st_).st_mtimensec)
+#else
+#define STAT_MTIME_NSEC(st_) ((st_).st_mtim.tv_nsec)
+#endif
+
+int smplwav_read_fd(void *context, unsigned char *dest, size_t size, uint_fast64_t offset)
+{
+	int fd = *(const int *)context;
+	while (size) {
+		ssize_t got = pread(fd, dest, size, (off_t)offset);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return 1;
+		dest   += got;
+		size   -= (size_t)got;
+		offset += (uint_fast64_t)got;
+	}
+	return 0;
+}
+
+unsigned smplwav_mount_fd(struct smplwav *wav, int fd, unsigned char *buf, size_t bufsz, unsigned flags, uint_fast64_t *data_offset, uint_fast64_t *data_size)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return SMPLWAV_ERROR_READ;
+	return smplwav_mount_reader(wav, smplwav_read_fd, &fd, (uint_fast64_t)st.st_size, buf, bufsz, flags, data_offset, data_size);
+}
+
+int smplwav_cache_key_fd(struct smplwav_cache_key *key, int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return 1;
+	key->file_size = (uint_fast64_t)st.st_size;
+	key->mtime     = (uint_fast64_t)st.st_mtime * 1000000000u + (uint_fast64_t)STAT_MTIME_NSEC(st);
+	key->inode     = (uint_fast64_t)st.st_ino;
+	return 0;
+}
+
+#endif
@@ -19,168 +19,344 @@
  * DEALINGS IN THE SOFTWARE. */
 
 #include "smplwav/smplwav_serialise.h"
+#include "smplwav/smplwav_mount.h"
 #include "smplwav_internal.h"
 #include "cop/cop_conversions.h"
 #include <string.h>
 #include <assert.h>
 
-static void serialise_ltxt(unsigned char *buf, uint_fast64_t *size, uint_fast32_t id, uint_fast32_t length)
+#define DS64_CHUNK_SIZE (36)
+
+/* Collects the output of smplwav_serialise_segments(). Generated bytes are
+ * written to the metadata buffer and become a segment whenever the body of
+ * a chunk is referenced instead of being copied. */
+struct segment_list {
+	struct smplwav_segment *segments;
+	unsigned                nb_segment;
+	const unsigned char    *buf;
+	uint_fast64_t           start;
+};
+
+/* Ends the generated bytes before position "pos" of the metadata buffer and
+ * adds a reference to "size" bytes at "data". */
+static void segments_reference(struct segment_list *list, uint_fast64_t pos, const void *data, size_t size)
 {
-	if (buf != NULL) {
-		buf += *size;
-		cop_st_ule32(buf + 0, SMPLWAV_RIFF_ID('l', 't', 'x', 't'));
-		cop_st_ule32(buf + 4, 20);
-		cop_st_ule32(buf + 8, id);
-		cop_st_ule32(buf + 12, length);
-		cop_st_ule32(buf + 16, SMPLWAV_RIFF_ID('r', 'g', 'n', ' '));
-		cop_st_ule16(buf + 20, 0);
-		cop_st_ule16(buf + 22, 0);
-		cop_st_ule16(buf + 24, 0);
-		cop_st_ule16(buf + 26, 0);
+	if (pos > list->start) {
+		list->segments[list->nb_segment].data = list->buf + list->start;
+		list->segments[list->nb_segment].size = (size_t)(pos - list->start);
+		list->nb_segment++;
 	}
-	*size += 28;
+	if (size) {
+		list->segments[list->nb_segment].data = data;
+		list->segments[list->nb_segment].size = size;
+		list->nb_segment++;
+	}
+	list->start = pos;
 }
 
-static int serialise_notelabl(unsigned char *buf, uint_fast64_t *size, uint_fast32_t ctyp, uint_fast32_t id, const char *s)
+/* Returns the size of a string including its terminator or zero if it is
+ * NULL. Fails if a chunk containing the string could not be described by a
+ * 32-bit size. */
+static int plan_string(uint_fast32_t *length, const char *s)
 {
-	size_t len = strlen(s);
+	size_t len;
+	if (s == NULL) {
+		*length = 0;
+		return 0;
+	}
+	len = strlen(s);
 	if (len++ > 0xFFFFFFFF - 5)
 		return 1; /* can not write the chunk size. */
-	if (buf != NULL) {
-		buf += *size;
-		cop_st_ule32(buf + 0, ctyp);
-		cop_st_ule32(buf + 4, (uint_fast32_t)(4 + len)); /* cast is safe because of the previous check. */
-		cop_st_ule32(buf + 8, id);
-		memcpy(buf + 12, s, len);
-		if (len & 1)
-			(buf + 12)[len] = 0;
-	}
-	*size += ((uint_fast64_t)len) + 12 + (len & 1);
+	*length = (uint_fast32_t)len;
 	return 0;
 }
 
-static int serialise_adtl(const struct smplwav *wav, unsigned char *buf, uint_fast64_t *size, int store_cue_loops)
+static uint_fast32_t marker_string_length(const struct smplwav_serialise_plan *plan, unsigned idx, const char *s)
+{
+	uint_fast32_t len;
+	if (plan->marker_lengths != NULL)
+		return plan->marker_lengths[idx];
+	len = 0;
+	(void)plan_string(&len, s); /* already checked by smplwav_serialise_plan() */
+	return len;
+}
+
+static int plan_adtl(struct smplwav_serialise_plan *plan, const struct smplwav *wav)
 {
-	uint_fast64_t old_sz = *size;
-	uint_fast64_t new_sz = old_sz + 12;
+	uint_fast64_t sz = 4;
 	unsigned i;
 
-	/* Serialise any metadata that might exist. */
 	for (i = 0; i < wav->nb_marker; i++) {
-		if (store_cue_loops)
-			serialise_ltxt(buf, &new_sz, i + 1, wav->markers[i].length);
-		if (wav->markers[i].name != NULL && serialise_notelabl(buf, &new_sz, SMPLWAV_RIFF_ID('l', 'a', 'b', 'l'), i + 1, wav->markers[i].name))
+		uint_fast32_t name_len;
+		uint_fast32_t desc_len;
+		if  (   plan_string(&name_len, wav->markers[i].name)
+		    ||  plan_string(&desc_len, wav->markers[i].desc)
+		    )
 			return 1;
-		if (wav->markers[i].desc != NULL && serialise_notelabl(buf, &new_sz, SMPLWAV_RIFF_ID('n', 'o', 't', 'e'), i + 1, wav->markers[i].desc))
-			return 1;
-		if (new_sz - old_sz - 8 > 0xFFFFFFFF)
+		if (plan->marker_lengths != NULL) {
+			plan->marker_lengths[2*i+0] = name_len;
+			plan->marker_lengths[2*i+1] = desc_len;
+		}
+		if (plan->store_cue_loops)
+			sz += 28;
+		if (name_len)
+			sz += ((uint_fast64_t)name_len) + 12 + (name_len & 1);
+		if (desc_len)
+			sz += ((uint_fast64_t)desc_len) + 12 + (desc_len & 1);
+		if (sz > 0xFFFFFFFF)
 			return 1;
 	}
 
-	/* Only bother serialising if there were actually metadata items
-	 * written. */
-	if (new_sz != old_sz + 12) {
-		if (buf != NULL) {
-			buf += old_sz;
-			cop_st_ule32(buf + 0, SMPLWAV_RIFF_ID('L', 'I', 'S', 'T'));
-			cop_st_ule32(buf + 4, (uint_fast32_t)(new_sz - old_sz - 8));
-			cop_st_ule32(buf + 8, SMPLWAV_RIFF_ID('a', 'd', 't', 'l'));
+	/* Only bother serialising if there were actually metadata items. */
+	plan->adtl_size = (sz != 4) ? (uint_fast32_t)sz : 0;
+	return 0;
+}
+
+static int plan_info(struct smplwav_serialise_plan *plan, char * const *infoset)
+{
+	uint_fast64_t sz = 4;
+	unsigned i;
+
+	for (i = 0; i < SMPLWAV_NB_INFO_TAGS; i++) {
+		size_t len;
+		plan->info_lengths[i] = 0;
+		if (infoset[i] != NULL && (len = strlen(infoset[i])) > 0) {
+			if (len > 0xFFFFFFFF - 1)
+				return 1;
+			plan->info_lengths[i] = (uint_fast32_t)(len + 1);
+			sz += ((uint_fast64_t)len) + 9 + ((len + 1) & 1);
 		}
-		*size = new_sz;
+		if (sz > 0xFFFFFFFF)
+			return 1;
 	}
 
+	/* Only bother serialising if there were actually metadata items. */
+	plan->info_size = (sz != 4) ? (uint_fast32_t)sz : 0;
 	return 0;
 }
 
-static int serialise_cue(const struct smplwav *wav, unsigned char *buf, uint_fast64_t *size, int store_cue_loops)
+static void plan_format(struct smplwav_serialise_plan *plan, const struct smplwav_format *fmt)
 {
-	unsigned i;
-	unsigned nb_cue = 0;
-	uint_fast64_t cksz;
+	uint_fast16_t container_bits   = smplwav_format_container_size(fmt->format) * 8;
+	int           extensible       = container_bits != fmt->bits_per_sample;
+	uint_fast16_t basic_format_tag = (fmt->format == SMPLWAV_FORMAT_FLOAT32) ? 0x0003u : 0x0001u;
 
-	if (buf != NULL)
-		buf += *size;
+	plan->fmt_size = (extensible) ? 48 : ((basic_format_tag == 1) ? 24 : 26);
+	plan->has_fact = extensible || basic_format_tag != 1;
+}
+
+/* Returns the size of the JUNK chunk which moves audio at "offset" onto a
+ * multiple of "alignment" bytes. The chunk is never smaller than its header. */
+static uint_fast64_t plan_padding(uint_fast64_t offset, uint_fast32_t alignment)
+{
+	uint_fast64_t pad;
+	if (alignment <= 1)
+		return 0;
+	pad = (alignment - (offset & (alignment - 1))) & (alignment - 1);
+	while (pad && pad < 8)
+		pad += alignment;
+	return pad;
+}
+
+int smplwav_serialise_plan_aligned(struct smplwav_serialise_plan *plan, const struct smplwav *wav, int store_cue_loops, uint_fast32_t *marker_lengths, uint_fast32_t data_alignment)
+{
+	uint_fast64_t body_sz;
+	uint_fast64_t data_size = wav->data_frames * wav->format.channels * smplwav_format_container_size(wav->format.format);
+	uint_fast64_t header_sz;
+	uint_fast64_t nb_cue  = 0;
+	uint_fast64_t nb_loop = 0;
+	unsigned      i;
+
+	if (data_alignment & (data_alignment - 1))
+		return 1;
+
+	plan->store_cue_loops = store_cue_loops;
+	plan->marker_lengths  = marker_lengths;
+
+	if (plan_info(plan, wav->info) || plan_adtl(plan, wav))
+		return 1;
+
+	plan_format(plan, &wav->format);
 
 	for (i = 0; i < wav->nb_marker; i++) {
-		if (store_cue_loops || wav->markers[i].length == 0) {
-			if (buf != NULL) {
-				cop_st_ule32(buf + 12 + nb_cue * 24, i + 1);
-				cop_st_ule32(buf + 16 + nb_cue * 24, 0);
-				cop_st_ule32(buf + 20 + nb_cue * 24, SMPLWAV_RIFF_ID('d', 'a', 't', 'a'));
-				cop_st_ule32(buf + 24 + nb_cue * 24, 0);
-				cop_st_ule32(buf + 28 + nb_cue * 24, 0);
-				cop_st_ule32(buf + 32 + nb_cue * 24, wav->markers[i].position);
-			}
+		if (store_cue_loops || wav->markers[i].length == 0)
 			nb_cue++;
+		if (wav->markers[i].length > 0) {
+			/* The smpl chunk stores the last sample of the loop in 32 bits. */
+			if ((uint_fast64_t)wav->markers[i].position + wav->markers[i].length - 1 > 0xFFFFFFFF)
+				return 1;
+			nb_loop++;
 		}
 	}
-
-	cksz = nb_cue;
-	cksz = (cksz * 24) + 4;
-	if (cksz > 0xFFFFFFFF)
+	if (nb_cue * 24 + 4 > 0xFFFFFFFF || nb_loop * 24 + 36 > 0xFFFFFFFF)
 		return 1;
+	plan->nb_cue   = (uint_fast32_t)nb_cue;
+	plan->nb_loop  = (uint_fast32_t)nb_loop;
+	plan->has_smpl = nb_loop || wav->has_pitch_info;
+
+	/* Everything before the audio. */
+	body_sz  = (plan->info_size) ? (plan->info_size + 8) : 0;
+	body_sz += plan->fmt_size + ((plan->has_fact) ? 12 : 0) + 8;
+	plan->data_offset = body_sz;
+
+	/* The audio and everything after it. */
+	body_sz += data_size + (data_size & 1);
+	if (plan->adtl_size)
+		body_sz += plan->adtl_size + 8;
+	if (nb_cue)
+		body_sz += nb_cue * 24 + 12;
+	if (plan->has_smpl)
+		body_sz += nb_loop * 24 + 44;
+	for (i = 0; i < wav->nb_unsupported; i++) {
+		if (wav->unsupported[i].size > 0xFFFFFFFF)
+			return 1;
+		body_sz += wav->unsupported[i].size + 8 + (wav->unsupported[i].size & 1);
+	}
 
-	if (nb_cue) {
-		if (buf != NULL) {
-			cop_st_ule32(buf + 0, SMPLWAV_RIFF_ID('c', 'u', 'e', ' '));
-			cop_st_ule32(buf + 4, (uint_fast32_t)cksz); /* cast is safe due to previous check. */
-			cop_st_ule32(buf + 8, nb_cue);
-		}
-		*size += cksz + 8;
+	/* The padding depends on the size of the header and an RF64 header is
+	 * needed if the padding makes the file too large for RIFF. */
+	plan->rf64 = (data_size > 0xFFFFFFFF);
+	for (;;) {
+		header_sz      = (plan->rf64) ? (12 + DS64_CHUNK_SIZE) : 12;
+		plan->pad_size = plan_padding(plan->data_offset + header_sz, data_alignment);
+		if (plan->rf64 || body_sz + plan->pad_size + 4 <= 0xFFFFFFFF)
+			break;
+		plan->rf64 = 1;
 	}
+	body_sz += plan->pad_size;
+
+	if (body_sz + header_sz > SIZE_MAX)
+		return 1;
 
+	plan->data_offset  += header_sz + plan->pad_size;
+	plan->size          = (size_t)(body_sz + header_sz);
+	plan->metadata_size = plan->size - (size_t)data_size;
+	for (i = 0; i < wav->nb_unsupported; i++)
+		plan->metadata_size -= wav->unsupported[i].size;
 	return 0;
 }
 
-static int serialise_smpl(const struct smplwav *wav, unsigned char *buf, uint_fast64_t *size)
+int smplwav_serialise_plan(struct smplwav_serialise_plan *plan, const struct smplwav *wav, int store_cue_loops, uint_fast32_t *marker_lengths)
+{
+	return smplwav_serialise_plan_aligned(plan, wav, store_cue_loops, marker_lengths, 0);
+}
+
+static void serialise_ltxt(unsigned char *buf, uint_fast64_t *size, uint_fast32_t id, uint_fast32_t length)
+{
+	buf += *size;
+	cop_st_ule32(buf + 0, SMPLWAV_RIFF_ID('l', 't', 'x', 't'));
+	cop_st_ule32(buf + 4, 20);
+	cop_st_ule32(buf + 8, id);
+	cop_st_ule32(buf + 12, length);
+	cop_st_ule32(buf + 16, SMPLWAV_RIFF_ID('r', 'g', 'n', ' '));
+	cop_st_ule16(buf + 20, 0);
+	cop_st_ule16(buf + 22, 0);
+	cop_st_ule16(buf + 24, 0);
+	cop_st_ule16(buf + 26, 0);
+	*size += 28;
+}
+
+static void serialise_notelabl(unsigned char *buf, uint_fast64_t *size, uint_fast32_t ctyp, uint_fast32_t id, const char *s, uint_fast32_t len)
+{
+	buf += *size;
+	cop_st_ule32(buf + 0, ctyp);
+	cop_st_ule32(buf + 4, 4 + len);
+	cop_st_ule32(buf + 8, id);
+	memcpy(buf + 12, s, len);
+	if (len & 1)
+		(buf + 12)[len] = 0;
+	*size += ((uint_fast64_t)len) + 12 + (len & 1);
+}
+
+static void serialise_adtl(const struct smplwav_serialise_plan *plan, const struct smplwav *wav, unsigned char *buf, uint_fast64_t *size)
 {
 	unsigned i;
-	unsigned nb_loop = 0;
-	uint_fast64_t cksz;
 
-	if (buf != NULL)
-		buf += *size;
+	if (!plan->adtl_size)
+		return;
+
+	cop_st_ule32(buf + *size + 0, SMPLWAV_RIFF_ID('L', 'I', 'S', 'T'));
+	cop_st_ule32(buf + *size + 4, plan->adtl_size);
+	cop_st_ule32(buf + *size + 8, SMPLWAV_RIFF_ID('a', 'd', 't', 'l'));
+	*size += 12;
 
 	for (i = 0; i < wav->nb_marker; i++) {
-		if (wav->markers[i].length > 0) {
-			if (buf != NULL) {
-				cop_st_ule32(buf + 44 + 24 * nb_loop, i + 1);
-				cop_st_ule32(buf + 48 + 24 * nb_loop, 0);
-				cop_st_ule32(buf + 52 + 24 * nb_loop, wav->markers[i].position);
-				cop_st_ule32(buf + 56 + 24 * nb_loop, wav->markers[i].position + wav->markers[i].length - 1);
-				cop_st_ule32(buf + 60 + 24 * nb_loop, 0);
-				cop_st_ule32(buf + 64 + 24 * nb_loop, 0);
-			}
-			nb_loop++;
+		uint_fast32_t name_len = marker_string_length(plan, 2*i+0, wav->markers[i].name);
+		uint_fast32_t desc_len = marker_string_length(plan, 2*i+1, wav->markers[i].desc);
+		if (plan->store_cue_loops)
+			serialise_ltxt(buf, size, i + 1, wav->markers[i].length);
+		if (name_len)
+			serialise_notelabl(buf, size, SMPLWAV_RIFF_ID('l', 'a', 'b', 'l'), i + 1, wav->markers[i].name, name_len);
+		if (desc_len)
+			serialise_notelabl(buf, size, SMPLWAV_RIFF_ID('n', 'o', 't', 'e'), i + 1, wav->markers[i].desc, desc_len);
+	}
+}
+
+static void serialise_cue(const struct smplwav_serialise_plan *plan, const struct smplwav *wav, unsigned char *buf, uint_fast64_t *size)
+{
+	unsigned i;
+	unsigned nb_cue = 0;
+
+	if (!plan->nb_cue)
+		return;
+
+	buf += *size;
+
+	for (i = 0; i < wav->nb_marker; i++) {
+		if (plan->store_cue_loops || wav->markers[i].length == 0) {
+			cop_st_ule32(buf + 12 + nb_cue * 24, i + 1);
+			cop_st_ule32(buf + 16 + nb_cue * 24, 0);
+			cop_st_ule32(buf + 20 + nb_cue * 24, SMPLWAV_RIFF_ID('d', 'a', 't', 'a'));
+			cop_st_ule32(buf + 24 + nb_cue * 24, 0);
+			cop_st_ule32(buf + 28 + nb_cue * 24, 0);
+			cop_st_ule32(buf + 32 + nb_cue * 24, wav->markers[i].position);
+			nb_cue++;
 		}
 	}
 
-	cksz = nb_loop;
-	cksz = (cksz * 24) + 36;
-	if (cksz > 0xFFFFFFFF)
-		return 1;
+	cop_st_ule32(buf + 0, SMPLWAV_RIFF_ID('c', 'u', 'e', ' '));
+	cop_st_ule32(buf + 4, plan->nb_cue * 24 + 4);
+	cop_st_ule32(buf + 8, plan->nb_cue);
+	*size += plan->nb_cue * (uint_fast64_t)24 + 12;
+}
+
+static void serialise_smpl(const struct smplwav_serialise_plan *plan, const struct smplwav *wav, unsigned char *buf, uint_fast64_t *size)
+{
+	unsigned i;
+	unsigned nb_loop = 0;
+
+	if (!plan->has_smpl)
+		return;
 
-	if (nb_loop || wav->has_pitch_info) {
-		if (buf != NULL) {
-			cop_st_ule32(buf + 0, SMPLWAV_RIFF_ID('s', 'm', 'p', 'l'));
-			cop_st_ule32(buf + 4, (uint_fast32_t)cksz); /* cast is safe due to previous check. */
-			cop_st_ule32(buf + 8, 0);
-			cop_st_ule32(buf + 12, 0);
-			cop_st_ule32(buf + 16, 0);
-			cop_st_ule32(buf + 20, ((uint_fast32_t)((wav->pitch_info) >> 32)) & 0xFFFFFFFFu);
-			cop_st_ule32(buf + 24, ((uint_fast32_t)wav->pitch_info) & 0xFFFFFFFFu);
-			cop_st_ule32(buf + 28, 0);
-			cop_st_ule32(buf + 32, 0);
-			cop_st_ule32(buf + 36, nb_loop);
-			cop_st_ule32(buf + 40, 0);
+	buf += *size;
+
+	for (i = 0; i < wav->nb_marker; i++) {
+		if (wav->markers[i].length > 0) {
+			cop_st_ule32(buf + 44 + 24 * nb_loop, i + 1);
+			cop_st_ule32(buf + 48 + 24 * nb_loop, 0);
+			cop_st_ule32(buf + 52 + 24 * nb_loop, wav->markers[i].position);
+			cop_st_ule32(buf + 56 + 24 * nb_loop, wav->markers[i].position + wav->markers[i].length - 1);
+			cop_st_ule32(buf + 60 + 24 * nb_loop, 0);
+			cop_st_ule32(buf + 64 + 24 * nb_loop, 0);
+			nb_loop++;
 		}
-		*size += cksz + 8;
 	}
 
-	return 0;
+	cop_st_ule32(buf + 0, SMPLWAV_RIFF_ID('s', 'm', 'p', 'l'));
+	cop_st_ule32(buf + 4, plan->nb_loop * 24 + 36);
+	cop_st_ule32(buf + 8, 0);
+	cop_st_ule32(buf + 12, 0);
+	cop_st_ule32(buf + 16, 0);
+	cop_st_ule32(buf + 20, ((uint_fast32_t)((wav->pitch_info) >> 32)) & 0xFFFFFFFFu);
+	cop_st_ule32(buf + 24, ((uint_fast32_t)wav->pitch_info) & 0xFFFFFFFFu);
+	cop_st_ule32(buf + 28, 0);
+	cop_st_ule32(buf + 32, 0);
+	cop_st_ule32(buf + 36, plan->nb_loop);
+	cop_st_ule32(buf + 40, 0);
+	*size += plan->nb_loop * (uint_fast64_t)24 + 44;
 }
 
-static int serialise_format(const struct smplwav_format *fmt, unsigned char *buf, uint_fast64_t *size)
+static void serialise_format(const struct smplwav_serialise_plan *plan, const struct smplwav_format *fmt, unsigned char *buf, uint_fast64_t *size)
 {
 	static const unsigned char EXTENSIBLE_GUID_SUFFIX[14] = {/* AA, BB, */ 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71};
 	int           format_code      = fmt->format;
@@ -190,150 +366,361 @@ static int serialise_format(const struct smplwav_format *fmt, unsigned char *buf
 	int           extensible       = container_bits != bits_per_sample;
 	uint_fast16_t basic_format_tag = (format_code == SMPLWAV_FORMAT_FLOAT32) ? 0x0003u : 0x0001u;
 	uint_fast16_t format_tag       = (extensible) ? 0xFFFEu : basic_format_tag;
-	uint_fast32_t fmt_sz           = (extensible) ? 48 : ((basic_format_tag == 1) ? 24 : 26);
-
-	if (buf != NULL) {
-		uint_fast16_t channels    = fmt->channels;
-		uint_fast32_t sample_rate = fmt->sample_rate;
-		uint_fast16_t block_align = container_size * channels;
-
-		buf += *size;
-
-		cop_st_ule32(buf + 0, SMPLWAV_RIFF_ID('f', 'm', 't', ' '));
-		cop_st_ule32(buf + 4, fmt_sz - 8);
-		cop_st_ule16(buf + 8, format_tag);
-		cop_st_ule16(buf + 10, channels);
-		cop_st_ule32(buf + 12, sample_rate);
-		cop_st_ule32(buf + 16, sample_rate * block_align);
-		cop_st_ule16(buf + 20, block_align);
-		cop_st_ule16(buf + 22, container_bits);
-		if (extensible || basic_format_tag != 1) {
-			cop_st_ule16(buf + 24, fmt_sz - 26);
-		}
-		if (extensible) {
-			cop_st_ule16(buf + 26, bits_per_sample);
-			cop_st_ule32(buf + 28, 0);
-			cop_st_ule16(buf + 32, basic_format_tag);
-			memcpy(buf + 34, EXTENSIBLE_GUID_SUFFIX, 14);
-		}
+	uint_fast32_t fmt_sz           = plan->fmt_size;
+	uint_fast16_t channels         = fmt->channels;
+	uint_fast32_t sample_rate      = fmt->sample_rate;
+	uint_fast16_t block_align      = container_size * channels;
+
+	buf += *size;
+
+	cop_st_ule32(buf + 0, SMPLWAV_RIFF_ID('f', 'm', 't', ' '));
+	cop_st_ule32(buf + 4, fmt_sz - 8);
+	cop_st_ule16(buf + 8, format_tag);
+	cop_st_ule16(buf + 10, channels);
+	cop_st_ule32(buf + 12, sample_rate);
+	cop_st_ule32(buf + 16, sample_rate * block_align);
+	cop_st_ule16(buf + 20, block_align);
+	cop_st_ule16(buf + 22, container_bits);
+	if (extensible || basic_format_tag != 1) {
+		cop_st_ule16(buf + 24, fmt_sz - 26);
+	}
+	if (extensible) {
+		cop_st_ule16(buf + 26, bits_per_sample);
+		cop_st_ule32(buf + 28, 0);
+		cop_st_ule16(buf + 32, basic_format_tag);
+		memcpy(buf + 34, EXTENSIBLE_GUID_SUFFIX, 14);
 	}
 
 	*size += fmt_sz;
-
-	return (format_tag != 1);
 }
 
-static void serialise_fact(uint_fast32_t data_frames, unsigned char *buf, uint_fast64_t *size)
+static void serialise_fact(uint_fast64_t data_frames, unsigned char *buf, uint_fast64_t *size)
 {
-	if (buf != NULL) {
-		buf += *size;
-		cop_st_ule32(buf,     SMPLWAV_RIFF_ID('f', 'a', 'c', 't'));
-		cop_st_ule32(buf + 4, 4);
-		cop_st_ule32(buf + 8, data_frames);
-	}
+	buf += *size;
+	cop_st_ule32(buf,     SMPLWAV_RIFF_ID('f', 'a', 'c', 't'));
+	cop_st_ule32(buf + 4, 4);
+	cop_st_ule32(buf + 8, (data_frames > 0xFFFFFFFFu) ? 0xFFFFFFFFu : (uint_fast32_t)data_frames);
 	*size += 12;
 }
 
-static void serialise_blob(uint_fast32_t id, const unsigned char *ckdata, uint_fast64_t cksize, unsigned char *buf, uint_fast64_t *size)
+/* Writes a JUNK chunk of "pad_size" bytes (including its header) filled with
+ * zeros. */
+static void serialise_pad(uint_fast64_t pad_size, unsigned char *buf, uint_fast64_t *size)
+{
+	buf += *size;
+	cop_st_ule32(buf,     SMPLWAV_RIFF_ID('J', 'U', 'N', 'K'));
+	cop_st_ule32(buf + 4, (uint_fast32_t)(pad_size - 8));
+	memset(buf + 8, 0, (size_t)(pad_size - 8));
+	*size += pad_size;
+}
+
+/* If "segments" is not NULL, the body of the chunk is referenced rather than
+ * copied into buf. */
+static void serialise_blob(uint_fast32_t id, const unsigned char *ckdata, uint_fast64_t cksize, unsigned char *buf, uint_fast64_t *size, struct segment_list *segments)
 {
 	assert(cksize < 0xFFFFFFFF);
-	if (buf != NULL) {
-		buf += *size;
-		cop_st_ule32(buf, id);
-		cop_st_ule32(buf + 4, (uint_fast32_t)cksize);
-		memcpy(buf + 8, ckdata, (size_t)cksize);
+	buf += *size;
+	cop_st_ule32(buf, id);
+	cop_st_ule32(buf + 4, (uint_fast32_t)cksize);
+	if (segments != NULL) {
+		segments_reference(segments, *size + 8, ckdata, (size_t)cksize);
 		if (cksize & 1)
-			buf[8+cksize] = 0;
+			buf[8] = 0;
+		*size += 8 + (cksize & 1);
+		return;
 	}
+	memcpy(buf + 8, ckdata, (size_t)cksize);
+	if (cksize & 1)
+		buf[8+cksize] = 0;
 	*size += cksize + 8 + (cksize & 1);
 }
 
-static int serialise_data(const struct smplwav_format *format, void *data, uint_fast32_t data_frames, unsigned char *buf, uint_fast64_t *size)
+/* In an RF64 file, the size of the data chunk is always taken from the ds64
+ * chunk. */
+static void serialise_data(const struct smplwav_format *format, void *data, uint_fast64_t data_frames, int rf64, unsigned char *buf, uint_fast64_t *size, struct segment_list *segments)
 {
 	uint_fast16_t container_size = smplwav_format_container_size(format->format);
 	uint_fast16_t block_align = container_size * format->channels;
-	uint_fast64_t data_size = ((uint_fast64_t)data_frames) * block_align;
-	if (data_size > 0xFFFFFFFF)
-		return 1;
-	serialise_blob(SMPLWAV_RIFF_ID('d', 'a', 't', 'a'), data, data_size, buf, size);
-	return 0;
-}
-
-static int serialise_zstrblob(uint_fast32_t id, const char *value, unsigned char *buf, uint_fast64_t *size)
-{
-	size_t len;
-	if (value != NULL && (len = strlen(value)) > 0) {
-		if (len > 0xFFFFFFFF - 1)
-			return 1;
-		serialise_blob(id, (const unsigned char *)value, ((uint_fast64_t)len) + 1, buf, size);
+	uint_fast64_t data_size = data_frames * block_align;
+	buf += *size;
+	cop_st_ule32(buf, SMPLWAV_RIFF_ID('d', 'a', 't', 'a'));
+	cop_st_ule32(buf + 4, (rf64) ? 0xFFFFFFFFu : (uint_fast32_t)data_size);
+	if (segments != NULL) {
+		segments_reference(segments, *size + 8, data, (size_t)data_size);
+		if (data_size & 1)
+			buf[8] = 0;
+		*size += 8 + (data_size & 1);
+		return;
 	}
-	return 0;
+	memcpy(buf + 8, data, (size_t)data_size);
+	if (data_size & 1)
+		buf[8+data_size] = 0;
+	*size += data_size + 8 + (data_size & 1);
 }
 
-static int serialise_info(char * const *infoset, unsigned char *buf, uint_fast64_t *size)
+static void serialise_info(const struct smplwav_serialise_plan *plan, char * const *infoset, unsigned char *buf, uint_fast64_t *size)
 {
-	uint_fast64_t old_sz = *size;
-	uint_fast64_t new_sz = old_sz + 12;
 	unsigned i;
 
+	if (!plan->info_size)
+		return;
+
+	cop_st_ule32(buf + *size + 0, SMPLWAV_RIFF_ID('L', 'I', 'S', 'T'));
+	cop_st_ule32(buf + *size + 4, plan->info_size);
+	cop_st_ule32(buf + *size + 8, SMPLWAV_RIFF_ID('I', 'N', 'F', 'O'));
+	*size += 12;
+
 	for (i = 0; i < SMPLWAV_NB_INFO_TAGS; i++) {
 #ifndef NDEBUG
 		assert(SMPLWAV_INFO_ITEMS[i].index == i);
 #endif
-		if (serialise_zstrblob(SMPLWAV_INFO_ITEMS[i].fourccid, infoset[i], buf, &new_sz))
-			return 1;
-		if (new_sz - old_sz - 8 > 0xFFFFFFFF)
-			return 1;
+		if (plan->info_lengths[i])
+			serialise_blob(SMPLWAV_INFO_ITEMS[i].fourccid, (const unsigned char *)infoset[i], plan->info_lengths[i], buf, size, NULL);
 	}
+}
 
-	/* Only bother serialising if there were actually metadata items
-	 * written. */
-	if (new_sz != old_sz + 12) {
-		if (buf != NULL) {
-			buf += old_sz;
-			cop_st_ule32(buf + 0, SMPLWAV_RIFF_ID('L', 'I', 'S', 'T'));
-			cop_st_ule32(buf + 4, (uint_fast32_t)(new_sz - old_sz - 8));
-			cop_st_ule32(buf + 8, SMPLWAV_RIFF_ID('I', 'N', 'F', 'O'));
-		}
-		*size = new_sz;
+/* Writes the serialised wave into buf. If "segments" is not NULL, the audio
+ * and the unsupported chunks are referenced rather than copied so buf only
+ * receives plan->metadata_size bytes. */
+static void emit(const struct smplwav_serialise_plan *plan, const struct smplwav *wav, unsigned char *buf, struct segment_list *segments)
+{
+	uint_fast64_t pos = (plan->rf64) ? (12 + DS64_CHUNK_SIZE) : 12;
+	unsigned      i;
+
+	serialise_info(plan, wav->info, buf, &pos);
+	serialise_format(plan, &wav->format, buf, &pos);
+	if (plan->has_fact)
+		serialise_fact(wav->data_frames, buf, &pos);
+	if (plan->pad_size)
+		serialise_pad(plan->pad_size, buf, &pos);
+	assert(pos + 8 == plan->data_offset);
+	serialise_data(&wav->format, wav->data, wav->data_frames, plan->rf64, buf, &pos, segments);
+	serialise_adtl(plan, wav, buf, &pos);
+	serialise_cue(plan, wav, buf, &pos);
+	serialise_smpl(plan, wav, buf, &pos);
+	for (i = 0; i < wav->nb_unsupported; i++)
+		serialise_blob(wav->unsupported[i].id, wav->unsupported[i].data, wav->unsupported[i].size, buf, &pos, segments);
+	assert(pos == ((segments != NULL) ? plan->metadata_size : plan->size));
+
+	if (plan->rf64) {
+		cop_st_ule32(buf + 0, SMPLWAV_RIFF_ID('R', 'F', '6', '4'));
+		cop_st_ule32(buf + 4, 0xFFFFFFFFu);
+		cop_st_ule32(buf + 12, SMPLWAV_RIFF_ID('d', 's', '6', '4'));
+		cop_st_ule32(buf + 16, DS64_CHUNK_SIZE - 8);
+		smplwav_st_ule64(buf + 20, plan->size - 8);
+		smplwav_st_ule64(buf + 28, wav->data_frames * wav->format.channels * smplwav_format_container_size(wav->format.format));
+		smplwav_st_ule64(buf + 36, wav->data_frames);
+		cop_st_ule32(buf + 44, 0);
+	} else {
+		cop_st_ule32(buf + 0, SMPLWAV_RIFF_ID('R', 'I', 'F', 'F'));
+		cop_st_ule32(buf + 4, (uint_fast32_t)(plan->size - 8));
 	}
+	cop_st_ule32(buf + 8, SMPLWAV_RIFF_ID('W', 'A', 'V', 'E'));
 
-	return 0;
+	if (segments != NULL)
+		segments_reference(segments, pos, NULL, 0);
+}
+
+void smplwav_serialise_emit(const struct smplwav_serialise_plan *plan, const struct smplwav *wav, unsigned char *buf)
+{
+	emit(plan, wav, buf, NULL);
+}
+
+unsigned smplwav_serialise_segments(const struct smplwav_serialise_plan *plan, const struct smplwav *wav, unsigned char *buf, struct smplwav_segment *segments)
+{
+	struct segment_list list;
+	list.segments   = segments;
+	list.nb_segment = 0;
+	list.buf        = buf;
+	list.start      = 0;
+	emit(plan, wav, buf, &list);
+	return list.nb_segment;
 }
 
 int smplwav_serialise(const struct smplwav *wav, unsigned char *buf, size_t *size, int store_cue_loops)
 {
-	unsigned i;
-	uint_fast64_t sz = 12;
+	struct smplwav_serialise_plan plan;
 
-	if (serialise_info(wav->info, buf, &sz))
+	if (smplwav_serialise_plan(&plan, wav, store_cue_loops, NULL))
 		return 1;
 
-	if (serialise_format(&wav->format, buf, &sz))
-		serialise_fact(wav->data_frames, buf, &sz);
+	if (buf != NULL)
+		smplwav_serialise_emit(&plan, wav, buf);
 
-	if  (   serialise_data(&wav->format, wav->data, wav->data_frames, buf, &sz)
-	    ||  serialise_adtl(wav, buf, &sz, store_cue_loops)
-	    ||  serialise_cue(wav, buf, &sz, store_cue_loops)
-	    ||  serialise_smpl(wav, buf, &sz)
-	    )
-		return 1;
+	*size = plan.size;
+	return 0;
+}
 
-	for (i = 0; i < wav->nb_unsupported; i++) {
-		if (sz - 8 > 0xFFFFFFFF || wav->unsupported[i].size > 0xFFFFFFFF)
+/* The total size of the INFO, adtl, cue and smpl chunks of the plan. */
+static uint_fast64_t patch_metadata_size(const struct smplwav_serialise_plan *plan)
+{
+	uint_fast64_t sz = 0;
+	if (plan->info_size)
+		sz += plan->info_size + 8;
+	if (plan->adtl_size)
+		sz += plan->adtl_size + 8;
+	if (plan->nb_cue)
+		sz += plan->nb_cue * (uint_fast64_t)24 + 12;
+	if (plan->has_smpl)
+		sz += plan->nb_loop * (uint_fast64_t)24 + 44;
+	return sz;
+}
+
+/* Chunks which a patch may overwrite: the metadata chunks which it replaces
+ * and padding. */
+static int patch_replaces(const struct smplwav_chunk *ck)
+{
+	switch (ck->id) {
+		case SMPLWAV_RIFF_ID('L', 'I', 'S', 'T'):
+			return  (ck->list_type == SMPLWAV_RIFF_ID('I', 'N', 'F', 'O'))
+			    ||  (ck->list_type == SMPLWAV_RIFF_ID('a', 'd', 't', 'l'))
+			    ;
+		case SMPLWAV_RIFF_ID('c', 'u', 'e', ' '):
+		case SMPLWAV_RIFF_ID('s', 'm', 'p', 'l'):
+		case SMPLWAV_RIFF_ID('J', 'U', 'N', 'K'):
+		case SMPLWAV_RIFF_ID('j', 'u', 'n', 'k'):
+		case SMPLWAV_RIFF_ID('P', 'A', 'D', ' '):
 			return 1;
-		serialise_blob(wav->unsupported[i].id, wav->unsupported[i].data, wav->unsupported[i].size, buf, &sz);
+		default:
+			return 0;
 	}
+}
+
+static uint_fast64_t chunk_end(const struct smplwav_chunk *ck)
+{
+	return ck->offset + ck->size + (ck->size & 1);
+}
+
+/* Finds the next run of adjacent chunks, starting from chunk "*idx", which
+ * may be overwritten. The run covers the bytes [*start, *end) of the file
+ * (including the chunk headers). Returns zero if there are no more runs. */
+static int patch_next_region(const struct smplwav_chunk_directory *directory, unsigned *idx, uint_fast64_t *start, uint_fast64_t *end)
+{
+	unsigned i = *idx;
+
+	while (i < directory->nb_chunk && !patch_replaces(&(directory->chunks[i])))
+		i++;
+	if (i >= directory->nb_chunk)
+		return 0;
 
-	if (sz - 8 > 0xFFFFFFFF || sz > SIZE_MAX)
+	*start = directory->chunks[i].offset - 8;
+	*end   = chunk_end(&(directory->chunks[i]));
+	while (++i < directory->nb_chunk && patch_replaces(&(directory->chunks[i])) && directory->chunks[i].offset - 8 == *end)
+		*end = chunk_end(&(directory->chunks[i]));
+
+	*idx = i;
+	return 1;
+}
+
+static void patch_add(struct smplwav_patch_write *writes, unsigned *nb_write, uint_fast64_t offset, const unsigned char *data, size_t size)
+{
+	writes[*nb_write].offset = offset;
+	writes[*nb_write].data   = data;
+	writes[*nb_write].size   = size;
+	(*nb_write)++;
+}
+
+/* Adds a write of the header of a JUNK chunk which fills [start, end). */
+static void patch_junk(struct smplwav_patch_write *writes, unsigned *nb_write, unsigned char **buf, uint_fast64_t start, uint_fast64_t end)
+{
+	cop_st_ule32(*buf + 0, SMPLWAV_RIFF_ID('J', 'U', 'N', 'K'));
+	cop_st_ule32(*buf + 4, (uint_fast32_t)(end - start - 8));
+	patch_add(writes, nb_write, start, *buf, 8);
+	*buf += 8;
+}
+
+size_t smplwav_serialise_patch_size(const struct smplwav_serialise_plan *plan, const struct smplwav_chunk_directory *directory)
+{
+	/* The metadata, a JUNK header for every region and what is left after
+	 * the metadata and the form size. */
+	return (size_t)patch_metadata_size(plan) + 8 * ((size_t)directory->nb_chunk + 2);
+}
+
+int smplwav_serialise_patch(const struct smplwav_serialise_plan *plan, const struct smplwav *wav, const struct smplwav_chunk_directory *directory, const unsigned char *header, unsigned char *buf, struct smplwav_patch_write *writes, unsigned *nb_write, uint_fast64_t *file_size)
+{
+	uint_fast64_t  meta_size = patch_metadata_size(plan);
+	uint_fast64_t  form_end;
+	uint_fast64_t  new_end;
+	uint_fast64_t  start;
+	uint_fast64_t  end;
+	uint_fast64_t  place     = 0;
+	uint_fast64_t  place_end = 0;
+	int            have_place;
+	int            have_tail;
+	uint_fast64_t  tail      = 0;
+	uint_fast32_t  form_id   = cop_ld_ule32(header);
+	unsigned char *junk      = buf + meta_size;
+	unsigned       i;
+
+	if  (   directory->nb_chunk == 0
+	    ||  directory->nb_chunk > directory->max_chunk
+	    ||  cop_ld_ule32(header + 8) != SMPLWAV_RIFF_ID('W', 'A', 'V', 'E')
+	    ||  (   form_id != SMPLWAV_RIFF_ID('R', 'I', 'F', 'F')
+	        &&  form_id != SMPLWAV_RIFF_ID('R', 'F', '6', '4')
+	        &&  form_id != SMPLWAV_RIFF_ID('B', 'W', '6', '4')
+	        )
+	    )
 		return 1;
 
-	if (buf != NULL) {
-		cop_st_ule32(buf + 0, SMPLWAV_RIFF_ID('R', 'I', 'F', 'F'));
-		cop_st_ule32(buf + 4, (uint_fast32_t)(sz - 8));
-		cop_st_ule32(buf + 8, SMPLWAV_RIFF_ID('W', 'A', 'V', 'E'));
+	form_end = chunk_end(&(directory->chunks[directory->nb_chunk - 1]));
+
+	/* Choose where the metadata goes. The smallest run which it fills
+	 * exactly or with room for a JUNK chunk after it is best as the size of
+	 * the file does not change. Otherwise it replaces a run at the end of
+	 * the file or is appended. */
+	have_place = 0;
+	have_tail  = 0;
+	for (i = 0; patch_next_region(directory, &i, &start, &end);) {
+		if (end == form_end) {
+			have_tail = 1;
+			tail      = start;
+		}
+		if  (   meta_size
+		    &&  (end - start == meta_size || end - start >= meta_size + 8)
+		    &&  (!have_place || end - start < place_end - place)
+		    ) {
+			have_place = 1;
+			place      = start;
+			place_end  = end;
+		}
+	}
+	new_end = form_end;
+	if (meta_size && !have_place) {
+		place     = (have_tail) ? tail : form_end;
+		place_end = form_end;
+		new_end   = place + meta_size;
+	}
+	if (new_end - 8 > 0xFFFFFFFF && form_id == SMPLWAV_RIFF_ID('R', 'I', 'F', 'F'))
+		return 1;
+
+	/* Every run which does not receive the metadata becomes JUNK. */
+	*nb_write = 0;
+	for (i = 0; patch_next_region(directory, &i, &start, &end);)
+		if (!meta_size || start < place || start >= place_end)
+			patch_junk(writes, nb_write, &junk, start, end);
+
+	if (meta_size) {
+		uint_fast64_t pos = 0;
+		serialise_info(plan, wav->info, buf, &pos);
+		serialise_adtl(plan, wav, buf, &pos);
+		serialise_cue(plan, wav, buf, &pos);
+		serialise_smpl(plan, wav, buf, &pos);
+		assert(pos == meta_size);
+		patch_add(writes, nb_write, place, buf, (size_t)meta_size);
+		if (new_end == form_end && place_end - place > meta_size)
+			patch_junk(writes, nb_write, &junk, place + meta_size, place_end);
+	}
+
+	if (new_end != form_end) {
+		if (form_id == SMPLWAV_RIFF_ID('R', 'I', 'F', 'F')) {
+			cop_st_ule32(junk, (uint_fast32_t)(new_end - 8));
+			patch_add(writes, nb_write, 4, junk, 4);
+		} else {
+			smplwav_st_ule64(junk, new_end - 8);
+			patch_add(writes, nb_write, 20, junk, 8);
+		}
 	}
 
-	*size = (size_t)sz;
+	*file_size = new_end;
 	return 0;
 }
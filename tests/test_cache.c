@@ -0,0 +1,318 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+/* Stores mounted waves as cache records and loads them back, and checks that
+ * stale, truncated and corrupt records are rejected. */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "smplwav/smplwav_cache.h"
+#include "test_wave.h"
+
+#if defined(_WIN32)
+#define fileno _fileno
+#endif
+
+/* Two records are stored one after another in a buffer of this size. */
+#define MAX_RECORD_SIZE (2 * MAX_FILE_SIZE)
+
+/* Offsets of the record header members which the corruption tests modify.
+ * These are described in smplwav_cache.c. */
+#define RECORD_MAGIC     (0)
+#define RECORD_VERSION   (4)
+#define RECORD_SIZE      (8)
+#define RECORD_NB_MARKER (12)
+#define RECORD_NB_CHUNK  (16)
+#define RECORD_INFO_MASK (20)
+#define RECORD_FORMAT    (64)
+#define RECORD_MARKERS   (104)
+
+static void make_key(struct smplwav_cache_key *key, unsigned variant, size_t file_size)
+{
+	char path[32];
+	sprintf(path, "samples/%u.wav", variant);
+	key->path_hash    = smplwav_cache_hash(SMPLWAV_CACHE_HASH_INIT, path, strlen(path));
+	key->file_size    = file_size;
+	key->mtime        = 1476000000000000000u + variant;
+	key->inode        = 1000 + variant;
+	key->content_hash = 0;
+}
+
+/* Compares the members of the markers which are not written to files but
+ * are kept by a record. */
+static int same_marker_state(const struct smplwav *a, const struct smplwav *b)
+{
+	unsigned i;
+	for (i = 0; i < a->nb_marker; i++) {
+		const struct smplwav_marker *x = a->markers + i;
+		const struct smplwav_marker *y = b->markers + i;
+		if (x->id != y->id || x->in_cue != y->in_cue || x->in_smpl != y->in_smpl || x->has_ltxt != y->has_ltxt)
+			return 0;
+	}
+	return 1;
+}
+
+/* Stores the mounts of two variants one after another and loads them both
+ * back using the size of the first record to find the second. */
+static void test_round_trip(struct smplwav *wav, unsigned char *audio, unsigned variant)
+{
+	static unsigned char       files[2][MAX_FILE_SIZE];
+	static unsigned char       records[MAX_RECORD_SIZE];
+	static struct wave_storage mounted[2];
+	static struct wave_storage loaded;
+	struct smplwav_cache_key   keys[2];
+	struct smplwav            *m[2];
+	size_t                     sizes[2];
+	size_t                     pos = 0;
+	unsigned                   k;
+
+	for (k = 0; k < 2; k++) {
+		size_t file_size;
+		build_wave(wav, variant + k, audio);
+		if (serialise_wave(wav, files[k], &file_size, 1) || (m[k] = mount_wave(&(mounted[k]), files[k], file_size)) == NULL) {
+			test_fail("cache: variant %u could not be mounted", variant + k);
+			return;
+		}
+		make_key(keys + k, variant + k, file_size);
+		if (smplwav_cache_store(m[k], keys + k, (const unsigned char *)m[k]->data - files[k], NULL, sizes + k) || pos + sizes[k] > sizeof(records)) {
+			test_fail("cache: variant %u could not be sized", variant + k);
+			return;
+		}
+		if (smplwav_cache_store(m[k], keys + k, (const unsigned char *)m[k]->data - files[k], records + pos, sizes + k)) {
+			test_fail("cache: variant %u could not be stored", variant + k);
+			return;
+		}
+		pos += sizes[k];
+	}
+
+	for (k = 0, pos = 0; k < 2; k++) {
+		struct smplwav *l = init_wave(&loaded);
+		size_t          record_size = 0;
+		uint_fast64_t   data_offset;
+		uint_fast64_t   data_size;
+		unsigned        ret;
+
+		if ((ret = smplwav_cache_load(l, records + pos, sizeof(records) - pos, keys + k, &record_size, &data_offset, &data_size)) != 0) {
+			test_fail("cache: variant %u could not be loaded (%u)", variant + k, ret);
+			return;
+		}
+
+		if (record_size != sizes[k])
+			test_fail("cache: variant %u gave a record size of %lu rather than %lu", variant + k, (unsigned long)record_size, (unsigned long)sizes[k]);
+
+		if (l->data != NULL || !same_wave(m[k], l) || !same_marker_state(m[k], l))
+			test_fail("cache: variant %u differs", variant + k);
+
+		if  (   data_offset != (uint_fast64_t)((const unsigned char *)m[k]->data - files[k])
+		    ||  data_size != m[k]->data_frames * m[k]->format.channels * smplwav_format_container_size(m[k]->format.format)
+		    )
+			test_fail("cache: variant %u has the audio in the wrong place", variant + k);
+
+		pos += record_size;
+	}
+}
+
+/* Loads a record which must fail with "expected". */
+static void expect_load(const unsigned char *record, size_t size, const struct smplwav_cache_key *key, unsigned expected, const char *what)
+{
+	static struct wave_storage loaded;
+	size_t                     record_size;
+	uint_fast64_t              data_offset;
+	uint_fast64_t              data_size;
+	unsigned                   ret = smplwav_cache_load(init_wave(&loaded), record, size, key, &record_size, &data_offset, &data_size);
+	if (ret != expected)
+		test_fail("cache: %s gave %u rather than %u", what, ret, expected);
+}
+
+static void test_rejected(struct smplwav *wav, unsigned char *audio)
+{
+	/* Variant 7 has markers, some of which have names, an INFO string and
+	 * ends with the body of an unsupported chunk which is not terminated by
+	 * a zero. */
+	static const unsigned      VARIANT = 7;
+	static unsigned char       file[MAX_FILE_SIZE];
+	static unsigned char       record[MAX_RECORD_SIZE];
+	static unsigned char       bad[MAX_RECORD_SIZE];
+	static struct wave_storage mounted;
+	static struct wave_storage loaded;
+	struct smplwav_cache_key   key;
+	struct smplwav_cache_key   other;
+	struct smplwav            *m;
+	struct smplwav             small;
+	struct smplwav_marker      one_marker;
+	size_t                     file_size;
+	size_t                     size;
+	size_t                     record_size = 0;
+	size_t                     strings;
+	size_t                     info;
+	uint_fast64_t              data_offset;
+	uint_fast64_t              data_size;
+	unsigned                   name = 0;
+	unsigned                   i;
+
+	build_wave(wav, VARIANT, audio);
+	if  (   serialise_wave(wav, file, &file_size, 1)
+	    ||  (m = mount_wave(&mounted, file, file_size)) == NULL
+	    ||  m->nb_marker < 2
+	    ||  m->nb_unsupported != 1
+	    ||  m->info[SMPLWAV_INFO_INAM] == NULL
+	    ) {
+		test_fail("cache: variant %u is not suitable for the corruption tests", VARIANT);
+		return;
+	}
+
+	make_key(&key, VARIANT, file_size);
+	if (smplwav_cache_store(m, &key, (const unsigned char *)m->data - file, NULL, &size) || size > sizeof(record) || smplwav_cache_store(m, &key, (const unsigned char *)m->data - file, record, &size)) {
+		test_fail("cache: variant %u could not be stored", VARIANT);
+		return;
+	}
+	info    = RECORD_MARKERS + 24 * m->nb_marker;
+	strings = info + 4 + 12;
+
+	for (i = 0; i < m->nb_marker && !name; i++)
+		if (ld_le32(record + RECORD_MARKERS + 24 * i + 12))
+			name = RECORD_MARKERS + 24 * i + 12;
+	if (!name || record[size - 1] == 0) {
+		test_fail("cache: variant %u does not have the expected layout", VARIANT);
+		return;
+	}
+
+	/* Every member of the key is compared and the size of a stale record is
+	 * still reported so it can be skipped. */
+	for (i = 0; i < 5; i++) {
+		other = key;
+		switch (i) {
+			case 0:  other.path_hash    ^= 1; break;
+			case 1:  other.file_size    += 1; break;
+			case 2:  other.mtime        += 1; break;
+			case 3:  other.inode        += 1; break;
+			default: other.content_hash  = 1; break;
+		}
+		record_size = 0;
+		if (smplwav_cache_load(init_wave(&loaded), record, size, &other, &record_size, &data_offset, &data_size) != SMPLWAV_ERROR_CACHE_STALE || record_size != size)
+			test_fail("cache: a change to key member %u was not detected", i);
+	}
+
+	/* Every truncation of the record is rejected. */
+	for (i = 0; i < size; i++) {
+		memcpy(bad, record, i);
+		expect_load(bad, i, &key, SMPLWAV_ERROR_CACHE_INVALID, "a truncated record");
+	}
+
+	/* Damaged headers. */
+	for (i = 0; i < 8; i++) {
+		static const unsigned HEADER[8][2] =
+			{{RECORD_MAGIC, 0x46464952u}
+			,{RECORD_VERSION, 2}
+			,{RECORD_SIZE, 103}
+			,{RECORD_SIZE, 0xFFFFFFFFu}
+			,{RECORD_NB_MARKER, 0x10000000u}
+			,{RECORD_NB_CHUNK, 0x10000000u}
+			,{RECORD_INFO_MASK, 0xFFFFFFFFu}
+			,{RECORD_FORMAT, SMPLWAV_FORMAT_FLOAT32 + 1}
+			};
+		memcpy(bad, record, size);
+		st_le32(bad + HEADER[i][0], HEADER[i][1]);
+		expect_load(bad, size, &key, SMPLWAV_ERROR_CACHE_INVALID, "a damaged header");
+	}
+
+	/* String offsets which point into the tables, beyond the record or at
+	 * the unterminated body of the last chunk. */
+	{
+		uint_fast32_t STRING_OFFSETS[3];
+		STRING_OFFSETS[0] = (uint_fast32_t)strings - 1;
+		STRING_OFFSETS[1] = (uint_fast32_t)size;
+		STRING_OFFSETS[2] = (uint_fast32_t)size - 1;
+		for (i = 0; i < 3; i++) {
+			memcpy(bad, record, size);
+			st_le32(bad + name, STRING_OFFSETS[i]);
+			expect_load(bad, size, &key, SMPLWAV_ERROR_CACHE_INVALID, "a bad marker string offset");
+			memcpy(bad, record, size);
+			st_le32(bad + info, STRING_OFFSETS[i]);
+			expect_load(bad, size, &key, SMPLWAV_ERROR_CACHE_INVALID, "a bad INFO string offset");
+		}
+	}
+
+	/* Chunk bodies which start in the tables or run past the end. */
+	memcpy(bad, record, size);
+	st_le32(bad + strings - 4, (uint_fast32_t)strings - 1);
+	expect_load(bad, size, &key, SMPLWAV_ERROR_CACHE_INVALID, "a bad chunk offset");
+	memcpy(bad, record, size);
+	st_le32(bad + strings - 8, ld_le32(bad + strings - 8) + 1);
+	expect_load(bad, size, &key, SMPLWAV_ERROR_CACHE_INVALID, "a bad chunk size");
+	memcpy(bad, record, size);
+	st_le32(bad + strings - 8, 0xFFFFFFFFu);
+	expect_load(bad, size, &key, SMPLWAV_ERROR_CACHE_INVALID, "a bad chunk size");
+
+	/* Storage which is too small. */
+	smplwav_set_storage(&small, &one_marker, 1, NULL, 0);
+	if (smplwav_cache_load(&small, record, size, &key, &record_size, &data_offset, &data_size) != SMPLWAV_ERROR_TOO_MANY_MARKERS)
+		test_fail("cache: a record with too many markers was loaded");
+	smplwav_set_storage(&small, loaded.markers, MAX_MARKERS, NULL, 0);
+	if (smplwav_cache_load(&small, record, size, &key, &record_size, &data_offset, &data_size) != SMPLWAV_ERROR_TOO_MANY_CHUNKS)
+		test_fail("cache: a record with too many chunks was loaded");
+}
+
+static void test_key(void)
+{
+	static const unsigned char contents[100] = {0};
+	struct smplwav_cache_key   key;
+	FILE                      *f;
+
+	/* FNV-1a test vectors. */
+	if  (   smplwav_cache_hash(SMPLWAV_CACHE_HASH_INIT, "", 0) != SMPLWAV_CACHE_HASH_INIT
+	    ||  smplwav_cache_hash(SMPLWAV_CACHE_HASH_INIT, "a", 1) != 0xAF63DC4C8601EC8Cu
+	    ||  smplwav_cache_hash(SMPLWAV_CACHE_HASH_INIT, "foobar", 6) != 0x85944171F73967E8u
+	    ||  smplwav_cache_hash(smplwav_cache_hash(SMPLWAV_CACHE_HASH_INIT, "foo", 3), "bar", 3) != 0x85944171F73967E8u
+	    )
+		test_fail("cache: smplwav_cache_hash() gave the wrong hash");
+
+	if ((f = tmpfile()) == NULL || fwrite(contents, 1, sizeof(contents), f) != sizeof(contents) || fflush(f)) {
+		test_fail("cache: could not write a temporary file");
+	} else {
+		memset(&key, 0, sizeof(key));
+		key.path_hash = 1;
+		if (smplwav_cache_key_fd(&key, fileno(f)) || key.file_size != sizeof(contents) || key.path_hash != 1 || key.content_hash != 0)
+			test_fail("cache: smplwav_cache_key_fd() gave the wrong key");
+	}
+	if (f != NULL)
+		fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned char       audio[MAX_FILE_SIZE];
+	static struct wave_storage source;
+	unsigned                   variant;
+
+	(void)argc;
+	(void)argv;
+
+	for (variant = 0; variant + 1 < NB_VARIANTS; variant++)
+		test_round_trip(init_wave(&source), audio, variant);
+
+	test_rejected(init_wave(&source), audio);
+	test_key();
+
+	return test_result();
+}
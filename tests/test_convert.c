@@ -0,0 +1,378 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+/* Checks the conversion functions which are built on top of the deinterleave
+ * kernels against smplwav_convert_deinterleave(). */
+
+#include "smplwav/smplwav_convert.h"
+#include "test_util.h"
+
+#define NB_FORMATS (4)
+#define NB_OUTPUTS (5)
+
+static const unsigned CHANNEL_COUNTS[] = {1, 2, 3, 6, 11};
+#define NB_CHANNEL_COUNTS (sizeof(CHANNEL_COUNTS) / sizeof(CHANNEL_COUNTS[0]))
+
+/* Converted elements are compared as bytes; this fills destinations so that
+ * elements which should not have been written can be recognised. */
+#define DEST_PATTERN (0xA5)
+
+/* Builds a wave with "frames" frames of random audio. The audio must be
+ * freed by the caller. */
+static void make_wave(struct smplwav *wav, int format, unsigned nb_channels, uint_fast64_t frames)
+{
+	size_t size = (size_t)frames * nb_channels * smplwav_format_container_size(format);
+	memset(wav, 0, sizeof(*wav));
+	wav->format.format          = format;
+	wav->format.channels        = nb_channels;
+	wav->format.bits_per_sample = 8 * smplwav_format_container_size(format);
+	wav->format.sample_rate     = 44100;
+	wav->data_frames            = frames;
+	wav->data                   = test_malloc(size);
+	test_random_samples(wav->data, size, format);
+}
+
+static void test_range(void)
+{
+	static const uint_fast32_t WINDOWS[][2] =
+		{{0, 0}, {0, 1}, {0, 301}, {1, 7}, {3, 64}, {17, 200}, {299, 2}, {300, 1}, {301, 0}, {150, 151}
+		};
+	int format;
+
+	for (format = 0; format < NB_FORMATS; format++) {
+		unsigned c;
+		for (c = 0; c < NB_CHANNEL_COUNTS; c++) {
+			unsigned       nb_channels = CHANNEL_COUNTS[c];
+			struct smplwav wav;
+			int            output_type;
+
+			make_wave(&wav, format, nb_channels, 301);
+
+			for (output_type = 0; output_type < NB_OUTPUTS; output_type++) {
+				size_t         element = smplwav_convert_output_size(output_type);
+				size_t         stride  = 310;
+				unsigned char *full    = test_malloc(element * wav.data_frames * nb_channels);
+				unsigned char *window  = test_malloc(element * stride * nb_channels);
+				unsigned       w;
+
+				smplwav_convert_deinterleave(full, (size_t)wav.data_frames, output_type, wav.data, (unsigned)wav.data_frames, nb_channels, format);
+
+				for (w = 0; w < sizeof(WINDOWS) / sizeof(WINDOWS[0]); w++) {
+					uint_fast32_t start = WINDOWS[w][0];
+					uint_fast32_t count = WINDOWS[w][1];
+					unsigned      ch;
+					int           err;
+
+					memset(window, DEST_PATTERN, element * stride * nb_channels);
+					if (output_type == SMPLWAV_CONVERT_OUTPUT_FLOAT)
+						err = smplwav_convert_range_floats(&wav, (float *)window, stride, start, count);
+					else
+						err = smplwav_convert_range(&wav, window, stride, output_type, start, count);
+
+					if (err) {
+						test_fail("range: format %d channels %u output %d window [%lu, +%lu) was rejected", format, nb_channels, output_type, (unsigned long)start, (unsigned long)count);
+						continue;
+					}
+
+					for (ch = 0; ch < nb_channels; ch++) {
+						const unsigned char *expect = full + element * (ch * (size_t)wav.data_frames + start);
+						const unsigned char *got    = window + element * ch * stride;
+						size_t               k;
+						if (memcmp(expect, got, element * count))
+							test_fail("range: format %d channels %u output %d window [%lu, +%lu) differs", format, nb_channels, output_type, (unsigned long)start, (unsigned long)count);
+						for (k = element * count; k < element * stride; k++) {
+							if (got[k] != DEST_PATTERN) {
+								test_fail("range: format %d channels %u output %d window [%lu, +%lu) wrote beyond the window", format, nb_channels, output_type, (unsigned long)start, (unsigned long)count);
+								break;
+							}
+						}
+					}
+				}
+
+				free(full);
+				free(window);
+			}
+
+			free(wav.data);
+		}
+	}
+}
+
+static int untouched(const void *dest, size_t size)
+{
+	size_t i;
+	for (i = 0; i < size; i++)
+		if (((const unsigned char *)dest)[i] != DEST_PATTERN)
+			return 0;
+	return 1;
+}
+
+/* Windows which do not fit in the audio and waves without audio in memory
+ * are rejected without writing anything. */
+static void test_range_rejected(void)
+{
+	static const uint_fast64_t WINDOWS[][2] =
+		{{0, 101}, {1, 100}, {100, 2}, {101, 0}, {0xFFFFFFFFu, 1}, {((uint_fast64_t)1) << 40, 1}
+		};
+	struct smplwav wav;
+	float          dest[2 * 128];
+	unsigned       w;
+
+	make_wave(&wav, SMPLWAV_FORMAT_PCM16, 2, 100);
+
+	for (w = 0; w < sizeof(WINDOWS) / sizeof(WINDOWS[0]); w++) {
+		memset(dest, DEST_PATTERN, sizeof(dest));
+		if (!smplwav_convert_range_floats(&wav, dest, 128, WINDOWS[w][0], (uint_fast32_t)WINDOWS[w][1]) || !untouched(dest, sizeof(dest)))
+			test_fail("range: window [%lu, +%lu) of 100 frames was accepted", (unsigned long)WINDOWS[w][0], (unsigned long)WINDOWS[w][1]);
+	}
+
+	free(wav.data);
+	wav.data = NULL;
+	memset(dest, DEST_PATTERN, sizeof(dest));
+	if  (   !smplwav_convert_range_floats(&wav, dest, 128, 0, 10)
+	    ||  !smplwav_convert_range(&wav, dest, 128, SMPLWAV_CONVERT_OUTPUT_INT32, 0, 10)
+	    ||  !untouched(dest, sizeof(dest))
+	    )
+		test_fail("range: a wave without audio in memory was accepted");
+}
+
+struct test_executor {
+	unsigned nb_calls;
+	unsigned nb_jobs;
+};
+
+/* Runs the jobs in reverse order so that nothing can depend on them being
+ * run in sequence. */
+static void reverse_executor(void *executor_context, smplwav_job_fn fn, void *context, unsigned nb_jobs)
+{
+	struct test_executor *e = executor_context;
+	unsigned              i;
+	e->nb_calls++;
+	e->nb_jobs += nb_jobs;
+	for (i = nb_jobs; i > 0; i--)
+		fn(context, i - 1);
+}
+
+static void test_parallel(void)
+{
+	static const unsigned LENGTHS[] =
+		{0, 1, SMPLWAV_CONVERT_MIN_JOB_FRAMES - 1, SMPLWAV_CONVERT_MIN_JOB_FRAMES + 1
+		,3 * SMPLWAV_CONVERT_MIN_JOB_FRAMES + 5, 5 * SMPLWAV_CONVERT_MIN_JOB_FRAMES + 77
+		};
+	static const unsigned MAX_JOBS[] = {1, 2, 3, 8};
+	static const unsigned PARALLEL_CHANNELS[] = {1, 2, 6};
+	int format;
+
+	for (format = 0; format < NB_FORMATS; format++) {
+		unsigned c;
+		for (c = 0; c < sizeof(PARALLEL_CHANNELS) / sizeof(PARALLEL_CHANNELS[0]); c++) {
+			unsigned nb_channels = PARALLEL_CHANNELS[c];
+			unsigned l;
+			for (l = 0; l < sizeof(LENGTHS) / sizeof(LENGTHS[0]); l++) {
+				unsigned       length = LENGTHS[l];
+				size_t         stride = (size_t)length + 5;
+				size_t         size   = stride * nb_channels * sizeof(float);
+				struct smplwav wav;
+				float         *serial = test_malloc(size);
+				float         *par    = test_malloc(size);
+				unsigned       j;
+
+				make_wave(&wav, format, nb_channels, length);
+				memset(serial, DEST_PATTERN, size);
+				smplwav_convert_deinterleave_floats(serial, stride, wav.data, length, nb_channels, format);
+
+				for (j = 0; j < sizeof(MAX_JOBS) / sizeof(MAX_JOBS[0]); j++) {
+					struct test_executor e;
+					e.nb_calls = 0;
+					e.nb_jobs  = 0;
+					memset(par, DEST_PATTERN, size);
+					smplwav_convert_deinterleave_floats_parallel(par, stride, wav.data, length, nb_channels, format, MAX_JOBS[j], reverse_executor, &e);
+					if (memcmp(serial, par, size))
+						test_fail("parallel: format %d channels %u length %u max_jobs %u differs from the serial conversion", format, nb_channels, length, MAX_JOBS[j]);
+					/* Anything longer than one job must be split when more
+					 * than one job is allowed. */
+					if  (   e.nb_calls > 1
+					    ||  e.nb_jobs > MAX_JOBS[j]
+					    ||  (length > SMPLWAV_CONVERT_MIN_JOB_FRAMES && MAX_JOBS[j] > 1 && e.nb_jobs < 2)
+					    )
+						test_fail("parallel: format %d channels %u length %u max_jobs %u ran %u jobs in %u calls", format, nb_channels, length, MAX_JOBS[j], e.nb_jobs, e.nb_calls);
+
+					/* Without an executor the jobs run on the calling thread. */
+					memset(par, DEST_PATTERN, size);
+					smplwav_convert_deinterleave_floats_parallel(par, stride, wav.data, length, nb_channels, format, MAX_JOBS[j], NULL, NULL);
+					if (memcmp(serial, par, size))
+						test_fail("parallel: format %d channels %u length %u max_jobs %u without an executor differs from the serial conversion", format, nb_channels, length, MAX_JOBS[j]);
+				}
+
+				free(wav.data);
+				free(serial);
+				free(par);
+			}
+		}
+	}
+}
+
+/* Replaces every sample of "channel" with a NaN when the wave holds floats so
+ * that reading a channel which should have been skipped shows up in the
+ * output. */
+static void poison_channel(struct smplwav *wav, unsigned channel)
+{
+	if (wav->format.format == SMPLWAV_FORMAT_FLOAT32) {
+		float         nan = (float)strtod("nan", NULL);
+		uint_fast64_t i;
+		for (i = 0; i < wav->data_frames; i++)
+			memcpy(wav->data + 4 * (i * wav->format.channels + channel), &nan, 4);
+	}
+}
+
+/* Deinterleaves the whole wave into a buffer which must be freed by the
+ * caller. */
+static float *reference_floats(const struct smplwav *wav)
+{
+	unsigned length = (unsigned)wav->data_frames;
+	float   *ref    = test_malloc(sizeof(float) * length * wav->format.channels);
+	smplwav_convert_deinterleave_floats(ref, length, wav->data, length, wav->format.channels, wav->format.format);
+	return ref;
+}
+
+static void test_select(void)
+{
+	static const unsigned LENGTH = 257;
+	int format;
+
+	for (format = 0; format < NB_FORMATS; format++) {
+		unsigned c;
+		for (c = 0; c < NB_CHANNEL_COUNTS; c++) {
+			unsigned       nb_channels = CHANNEL_COUNTS[c];
+			unsigned       nb_outputs  = nb_channels + 2;
+			size_t         stride      = LENGTH + 3;
+			size_t         size        = sizeof(float) * stride * nb_outputs;
+			unsigned      *map         = test_malloc(sizeof(unsigned) * nb_outputs);
+			float         *dest        = test_malloc(size);
+			struct smplwav wav;
+			float         *ref;
+			unsigned       o;
+
+			/* Outputs come in pairs which select the same source channel
+			 * and the last source channel is never selected when there is
+			 * more than one. */
+			for (o = 0; o < nb_outputs; o++)
+				map[o] = (nb_channels > 1) ? ((o / 2) * 3) % (nb_channels - 1) : 0;
+
+			make_wave(&wav, format, nb_channels, LENGTH);
+			if (nb_channels > 1)
+				poison_channel(&wav, nb_channels - 1);
+			ref = reference_floats(&wav);
+
+			memset(dest, DEST_PATTERN, size);
+			smplwav_convert_select_floats(dest, stride, map, nb_outputs, wav.data, LENGTH, nb_channels, format);
+
+			for (o = 0; o < nb_outputs; o++) {
+				const float *got = dest + o * stride;
+				if (memcmp(ref + map[o] * LENGTH, got, sizeof(float) * LENGTH))
+					test_fail("select: format %d channels %u output %u (source %u) differs", format, nb_channels, o, map[o]);
+				if (!untouched(got + LENGTH, sizeof(float) * (stride - LENGTH)))
+					test_fail("select: format %d channels %u output %u wrote beyond the frames", format, nb_channels, o);
+			}
+
+			free(wav.data);
+			free(ref);
+			free(map);
+			free(dest);
+		}
+	}
+}
+
+static void test_mix(void)
+{
+	/* Gains are powers of two (or zero) so that every product is exact and
+	 * the expected sums do not depend on whether the compiler contracts the
+	 * multiply and add. */
+	static const float GAINS[] = {0.0f, 0.5f, -0.25f, 1.0f, 2.0f, -1.0f, 0.125f};
+	static const unsigned LENGTH = 257;
+	int format;
+
+	for (format = 0; format < NB_FORMATS; format++) {
+		unsigned c;
+		for (c = 0; c < NB_CHANNEL_COUNTS; c++) {
+			unsigned       nb_channels = CHANNEL_COUNTS[c];
+			unsigned       nb_outputs;
+			for (nb_outputs = 1; nb_outputs <= 3; nb_outputs++) {
+				size_t         stride = LENGTH + 3;
+				size_t         size   = sizeof(float) * stride * nb_outputs;
+				float         *matrix = test_malloc(sizeof(float) * nb_outputs * nb_channels);
+				float         *dest   = test_malloc(size);
+				struct smplwav wav;
+				float         *ref;
+				unsigned       o;
+
+				/* Column 1 is zero in every row and its samples are
+				 * poisoned; the remaining gains are random. */
+				for (o = 0; o < nb_outputs * nb_channels; o++)
+					matrix[o] = (nb_channels > 1 && o % nb_channels == 1) ? 0.0f : GAINS[test_rng() % (sizeof(GAINS) / sizeof(GAINS[0]))];
+
+				make_wave(&wav, format, nb_channels, LENGTH);
+				if (nb_channels > 1)
+					poison_channel(&wav, 1);
+				ref = reference_floats(&wav);
+
+				memset(dest, DEST_PATTERN, size);
+				smplwav_convert_mix_floats(dest, stride, matrix, nb_outputs, wav.data, LENGTH, nb_channels, format);
+
+				for (o = 0; o < nb_outputs; o++) {
+					const float *got = dest + o * stride;
+					unsigned     k;
+					for (k = 0; k < LENGTH; k++) {
+						float    expect = 0.0f;
+						unsigned ch;
+						for (ch = 0; ch < nb_channels; ch++)
+							if (matrix[o * nb_channels + ch] != 0.0f)
+								expect += matrix[o * nb_channels + ch] * ref[ch * LENGTH + k];
+						if (memcmp(&expect, got + k, sizeof(float))) {
+							test_fail("mix: format %d channels %u outputs %u output %u frame %u is %g not %g", format, nb_channels, nb_outputs, o, k, got[k], expect);
+							break;
+						}
+					}
+					if (!untouched(got + LENGTH, sizeof(float) * (stride - LENGTH)))
+						test_fail("mix: format %d channels %u outputs %u output %u wrote beyond the frames", format, nb_channels, nb_outputs, o);
+				}
+
+				free(wav.data);
+				free(ref);
+				free(matrix);
+				free(dest);
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	test_range();
+	test_range_rejected();
+	test_parallel();
+	test_select();
+	test_mix();
+
+	return test_result();
+}
@@ -0,0 +1,330 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+/* Checks every kernel selected for the CPU running the test against the
+ * portable reference kernels. The outputs must be bit-identical. Lengths
+ * cover every tail of the vector loops and sources are allocated to their
+ * exact size so memory checkers catch any read beyond the last frame. */
+
+#include "../src/smplwav_convert_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEST_GUARD   (16)
+#define DEST_PATTERN (0xA5)
+
+static const unsigned CHANNEL_COUNTS[] = {1, 2, 3, 4, 5, 6, 8, 11};
+#define NB_CHANNEL_COUNTS (sizeof(CHANNEL_COUNTS) / sizeof(CHANNEL_COUNTS[0]))
+
+static const size_t LONG_LENGTHS[] = {63, 64, 65, 127, 128, 129, 255, 1000, 1001, 4099};
+#define NB_LONG_LENGTHS (sizeof(LONG_LENGTHS) / sizeof(LONG_LENGTHS[0]))
+
+#define NB_SHORT_LENGTHS (41)
+#define NB_LENGTHS       (NB_SHORT_LENGTHS + NB_LONG_LENGTHS)
+
+static size_t test_length(unsigned i)
+{
+	return (i < NB_SHORT_LENGTHS) ? i : LONG_LENGTHS[i - NB_SHORT_LENGTHS];
+}
+
+static uint_fast32_t rng_state = 1;
+
+static uint_fast32_t rng(void)
+{
+	rng_state = (rng_state * 1664525u + 1013904223u) & 0xFFFFFFFFu;
+	return rng_state >> 8;
+}
+
+/* A float in [-range, range] with a fair number of values at exactly 0 and
+ * +/-1 which sit on the clipping boundaries. */
+static float random_float(float range)
+{
+	switch (rng() % 16) {
+		case 0:  return 0.0f;
+		case 1:  return 1.0f;
+		case 2:  return -1.0f;
+		default: return (float)(((double)rng() / (double)0x800000) * 2.0 - 1.0) * range;
+	}
+}
+
+/* Fills "size" bytes of interleaved samples in the given format. */
+static void random_samples(unsigned char *dest, size_t size, int format)
+{
+	size_t i;
+	if (format == SMPLWAV_FORMAT_FLOAT32) {
+		for (i = 0; i + 4 <= size; i += 4) {
+			float f = random_float(1.5f);
+			memcpy(dest + i, &f, 4);
+		}
+	} else {
+		for (i = 0; i < size; i++)
+			dest[i] = (unsigned char)rng();
+	}
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+	if (p == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static unsigned failures = 0;
+
+static void fail(const char *kernel, int a, int b, unsigned nb_channels, size_t length)
+{
+	if (failures++ < 20)
+		fprintf(stderr, "%s kernel mismatch (%d, %d) channels=%u length=%lu\n", kernel, a, b, nb_channels, (unsigned long)length);
+}
+
+static void test_deinterleave(const struct smplwav_convert_kernels *ref, const struct smplwav_convert_kernels *simd)
+{
+	int output_type;
+	int format;
+	for (output_type = 0; output_type < SMPLWAV_CONVERT_NB_OUTPUTS; output_type++) {
+		for (format = 0; format < SMPLWAV_CONVERT_NB_FORMATS; format++) {
+			unsigned c;
+			for (c = 0; c < NB_CHANNEL_COUNTS; c++) {
+				unsigned                nb_channels = CHANNEL_COUNTS[c];
+				unsigned                layout      = smplwav_convert_layout(nb_channels);
+				smplwav_deinterleave_fn ref_fn      = ref->deinterleave[output_type][format][layout];
+				smplwav_deinterleave_fn simd_fn     = simd->deinterleave[output_type][format][layout];
+				unsigned                l;
+				if (ref_fn == simd_fn)
+					continue;
+				for (l = 0; l < NB_LENGTHS; l++) {
+					size_t         length      = test_length(l);
+					size_t         src_size    = length * nb_channels * smplwav_format_container_size(format);
+					size_t         dest_stride = length + 3;
+					size_t         dest_size   = (dest_stride * nb_channels + DEST_GUARD) * smplwav_convert_output_size(output_type);
+					unsigned char *src         = xmalloc(src_size);
+					unsigned char *a           = xmalloc(dest_size);
+					unsigned char *b           = xmalloc(dest_size);
+					random_samples(src, src_size, format);
+					memset(a, DEST_PATTERN, dest_size);
+					memset(b, DEST_PATTERN, dest_size);
+					ref_fn(a, dest_stride, src, length, nb_channels);
+					simd_fn(b, dest_stride, src, length, nb_channels);
+					if (memcmp(a, b, dest_size))
+						fail("deinterleave", output_type, format, nb_channels, length);
+					free(src);
+					free(a);
+					free(b);
+				}
+			}
+		}
+	}
+}
+
+static void test_channel(const struct smplwav_convert_kernels *ref, const struct smplwav_convert_kernels *simd)
+{
+	int format;
+	for (format = 0; format < SMPLWAV_CONVERT_NB_FORMATS; format++) {
+		unsigned c;
+		if (ref->channel[format] == simd->channel[format])
+			continue;
+		for (c = 0; c < NB_CHANNEL_COUNTS; c++) {
+			size_t   frame_bytes = CHANNEL_COUNTS[c] * (size_t)smplwav_format_container_size(format);
+			unsigned l;
+			for (l = 0; l < NB_LENGTHS; l++) {
+				size_t         length   = test_length(l);
+				size_t         src_size = length * frame_bytes;
+				unsigned char *src      = xmalloc(src_size);
+				float         *a        = xmalloc((length + DEST_GUARD) * sizeof(float));
+				float         *b        = xmalloc((length + DEST_GUARD) * sizeof(float));
+				random_samples(src, src_size, format);
+				memset(a, DEST_PATTERN, (length + DEST_GUARD) * sizeof(float));
+				memset(b, DEST_PATTERN, (length + DEST_GUARD) * sizeof(float));
+				ref->channel[format](a, src, length, frame_bytes);
+				simd->channel[format](b, src, length, frame_bytes);
+				if (memcmp(a, b, (length + DEST_GUARD) * sizeof(float)))
+					fail("channel", format, 0, CHANNEL_COUNTS[c], length);
+				free(src);
+				free(a);
+				free(b);
+			}
+		}
+	}
+}
+
+static void test_interleave(const struct smplwav_convert_kernels *ref, const struct smplwav_convert_kernels *simd)
+{
+	int format;
+	for (format = 0; format < SMPLWAV_CONVERT_NB_FORMATS; format++) {
+		unsigned c;
+		for (c = 0; c < NB_CHANNEL_COUNTS; c++) {
+			unsigned              nb_channels = CHANNEL_COUNTS[c];
+			unsigned              layout      = smplwav_convert_layout(nb_channels);
+			smplwav_interleave_fn ref_fn      = ref->interleave[format][layout];
+			smplwav_interleave_fn simd_fn     = simd->interleave[format][layout];
+			unsigned              l;
+			if (ref_fn == simd_fn)
+				continue;
+			for (l = 0; l < NB_LENGTHS; l++) {
+				size_t         length     = test_length(l);
+				size_t         src_stride = length + 1;
+				size_t         dest_size  = length * nb_channels * smplwav_format_container_size(format) + DEST_GUARD;
+				float         *src        = xmalloc(src_stride * nb_channels * sizeof(float));
+				unsigned char *a          = xmalloc(dest_size);
+				unsigned char *b          = xmalloc(dest_size);
+				int            dither;
+				size_t         i;
+				for (i = 0; i < src_stride * nb_channels; i++)
+					src[i] = random_float(1.25f);
+				for (dither = 0; dither < 2; dither++) {
+					struct smplwav_convert_clip_stats sa;
+					struct smplwav_convert_clip_stats sb;
+					uint_fast32_t                     seed = rng();
+					sa.nb_clipped = sb.nb_clipped = 0;
+					sa.peak       = sb.peak       = 0.0f;
+					memset(a, DEST_PATTERN, dest_size);
+					memset(b, DEST_PATTERN, dest_size);
+					ref_fn(a, src, src_stride, length, nb_channels, dither, seed, &sa);
+					simd_fn(b, src, src_stride, length, nb_channels, dither, seed, &sb);
+					if (memcmp(a, b, dest_size) || sa.nb_clipped != sb.nb_clipped || sa.peak != sb.peak)
+						fail("interleave", format, dither, nb_channels, length);
+				}
+				free(src);
+				free(a);
+				free(b);
+			}
+		}
+	}
+}
+
+static void test_stats(const struct smplwav_convert_kernels *ref, const struct smplwav_convert_kernels *simd)
+{
+	unsigned l;
+	if (ref->stats == simd->stats)
+		return;
+	for (l = 0; l < NB_LENGTHS; l++) {
+		size_t                               length = test_length(l);
+		float                               *src    = xmalloc(length * sizeof(float));
+		struct smplwav_convert_channel_stats sa;
+		struct smplwav_convert_channel_stats sb;
+		size_t                               i;
+		for (i = 0; i < length; i++)
+			src[i] = random_float(1.125f);
+		memset(&sa, 0, sizeof(sa));
+		memset(&sb, 0, sizeof(sb));
+		ref->stats(&sa, src, length, 1.0f);
+		simd->stats(&sb, src, length, 1.0f);
+		if  (   sa.peak != sb.peak
+		    ||  sa.sum != sb.sum
+		    ||  sa.sum_sq != sb.sum_sq
+		    ||  sa.nb_clipped != sb.nb_clipped
+		    ||  sa.nb_samples != sb.nb_samples
+		    )
+			fail("stats", 0, 0, 1, length);
+		free(src);
+	}
+}
+
+static void test_float_to_half(const struct smplwav_convert_kernels *simd)
+{
+	static const float special[] =
+		{0.0f, -0.0f, 1.0f, -1.0f, 65504.0f, 65519.0f, 65520.0f, -65520.0f, 1.0e10f
+		,6.103515625e-05f, 6.0e-05f, 5.9604644775390625e-08f, 2.98023223876953125e-08f, 2.99e-08f, 1.0e-10f
+		};
+	unsigned l;
+	if (simd->float_to_half == NULL)
+		return;
+	for (l = 0; l < NB_LENGTHS; l++) {
+		size_t    length = test_length(l);
+		float    *src    = xmalloc(length * sizeof(float));
+		uint16_t *dest   = xmalloc(length * sizeof(uint16_t));
+		size_t    i;
+		for (i = 0; i < length; i++) {
+			if (rng() % 4 == 0)
+				src[i] = special[rng() % (sizeof(special) / sizeof(special[0]))];
+			else
+				src[i] = random_float(2.0f) * (float)(1u << (rng() % 24)) / 4096.0f;
+		}
+		simd->float_to_half(dest, src, length);
+		for (i = 0; i < length; i++) {
+			if (dest[i] != smplwav_convert_float_to_half(src[i])) {
+				fail("float_to_half", 0, 0, 1, length);
+				break;
+			}
+		}
+		free(src);
+		free(dest);
+	}
+}
+
+/* The public functions split streams with many channels into blocks. The
+ * result must not depend on where the blocks fall. */
+static void test_blocked_deinterleave(const struct smplwav_convert_kernels *ref)
+{
+	int format;
+	for (format = 0; format < SMPLWAV_CONVERT_NB_FORMATS; format++) {
+		unsigned c;
+		for (c = 0; c < NB_CHANNEL_COUNTS; c++) {
+			unsigned       nb_channels = CHANNEL_COUNTS[c];
+			size_t         frame_bytes = nb_channels * (size_t)smplwav_format_container_size(format);
+			size_t         length      = 3 * (SMPLWAV_CONVERT_BLOCK_BYTES / frame_bytes) + 13;
+			size_t         dest_size   = (length * nb_channels + DEST_GUARD) * sizeof(float);
+			unsigned char *src         = xmalloc(length * frame_bytes);
+			float         *a           = xmalloc(dest_size);
+			float         *b           = xmalloc(dest_size);
+			random_samples(src, length * frame_bytes, format);
+			memset(a, DEST_PATTERN, dest_size);
+			memset(b, DEST_PATTERN, dest_size);
+			ref->deinterleave[SMPLWAV_CONVERT_OUTPUT_FLOAT][format][smplwav_convert_layout(nb_channels)](a, length, src, length, nb_channels);
+			smplwav_convert_deinterleave_floats(b, length, src, (unsigned)length, nb_channels, format);
+			if (memcmp(a, b, dest_size))
+				fail("blocked deinterleave", format, 0, nb_channels, length);
+			free(src);
+			free(a);
+			free(b);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct smplwav_convert_kernels ref;
+	struct smplwav_convert_kernels simd;
+
+	(void)argc;
+	(void)argv;
+
+	smplwav_convert_scalar_kernels(&ref);
+	smplwav_convert_scalar_kernels(&simd);
+	smplwav_convert_x86_kernels(&simd);
+
+	test_deinterleave(&ref, &simd);
+	test_channel(&ref, &simd);
+	test_interleave(&ref, &simd);
+	test_stats(&ref, &simd);
+	test_float_to_half(&simd);
+	test_blocked_deinterleave(&ref);
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,732 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+/* Builds waves by hand, serialises them and checks that mounting the result
+ * in the different ways supported by smplwav_mount.h gives back the same
+ * wave. */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "test_wave.h"
+#include <stddef.h>
+
+#if defined(_WIN32)
+#define fileno _fileno
+#endif
+
+static void test_stream(const struct smplwav *wav, unsigned variant)
+{
+	static const size_t        SLICES[] = {1, 2, 3, 5, 8, 13, 64, 200, 4096};
+	static unsigned char       file[MAX_FILE_SIZE];
+	static unsigned char       meta[MAX_FILE_SIZE];
+	static unsigned char       audio[MAX_FILE_SIZE];
+	static struct wave_storage mounted;
+	struct smplwav            *m = init_wave(&mounted);
+	struct smplwav_stream      stream;
+	size_t                     file_size;
+	size_t                     pos = 0;
+	size_t                     audio_size = 0;
+	unsigned                   slice = variant;
+	unsigned                   err = 0;
+
+	if (serialise_wave(wav, file, &file_size, 1)) {
+		test_fail("stream: variant %u could not be serialised", variant);
+		return;
+	}
+
+	/* The file is pushed in slices of varying size so that every chunk
+	 * header is split at some point. */
+	smplwav_stream_init(&stream, m, meta, sizeof(meta), SMPLWAV_MOUNT_PRESERVE_UNKNOWN);
+	while (pos < file_size && !err) {
+		size_t                      size = SLICES[slice++ % (sizeof(SLICES) / sizeof(SLICES[0]))];
+		const unsigned char        *p    = file + pos;
+		struct smplwav_stream_event event;
+
+		if (size > file_size - pos)
+			size = file_size - pos;
+		pos += size;
+
+		do {
+			if ((err = smplwav_stream_push(&stream, p, size, &event)) != 0)
+				break;
+			if (event.type == SMPLWAV_STREAM_EVENT_AUDIO) {
+				if (event.audio_offset != audio_size || audio_size + event.audio_size > sizeof(audio)) {
+					test_fail("stream: variant %u gave audio out of order", variant);
+					return;
+				}
+				memcpy(audio + audio_size, event.audio, event.audio_size);
+				audio_size += event.audio_size;
+			}
+			p    += event.consumed;
+			size -= event.consumed;
+		} while (size || event.type != SMPLWAV_STREAM_EVENT_NONE);
+	}
+
+	if (err || SMPLWAV_ERROR_CODE(smplwav_stream_finish(&stream))) {
+		test_fail("stream: variant %u could not be mounted", variant);
+		return;
+	}
+
+	smplwav_sort_markers(m);
+	if (m->data != NULL || !same_wave(wav, m))
+		test_fail("stream: variant %u differs", variant);
+
+	if (audio_size != m->data_frames * m->format.channels * smplwav_format_container_size(m->format.format) || memcmp(audio, wav->data, audio_size))
+		test_fail("stream: variant %u gave different audio", variant);
+}
+
+/* The same file rewritten as a small RF64 file must mount to the same wave
+ * and serialise back to the original RIFF file. */
+static void test_rf64(const struct smplwav *wav, unsigned variant)
+{
+	static unsigned char       riff[MAX_FILE_SIZE];
+	static unsigned char       rf64[MAX_FILE_SIZE + 64];
+	static unsigned char       again[MAX_FILE_SIZE];
+	static struct wave_storage mounted;
+	struct smplwav            *m;
+	size_t                     riff_size;
+	size_t                     rf64_size;
+	size_t                     again_size;
+
+	if (serialise_wave(wav, riff, &riff_size, 1)) {
+		test_fail("rf64: variant %u could not be serialised", variant);
+		return;
+	}
+
+	rf64_size = make_rf64(rf64, riff, riff_size, wav->data_frames);
+	if ((m = mount_wave(&mounted, rf64, rf64_size)) == NULL) {
+		test_fail("rf64: variant %u could not be mounted", variant);
+		return;
+	}
+
+	if (!same_wave(wav, m))
+		test_fail("rf64: variant %u differs", variant);
+
+	if (serialise_wave(m, again, &again_size, 1) || again_size != riff_size || memcmp(riff, again, riff_size))
+		test_fail("rf64: variant %u did not serialise back to the same RIFF file", variant);
+}
+
+/* A lazy mount must end up with the same wave as smplwav_mount_memory() and
+ * each of the load functions must only decode its chunks once. */
+static void test_lazy(const struct smplwav *wav, unsigned variant)
+{
+	static unsigned char       file[MAX_FILE_SIZE];
+	static unsigned char       copy[MAX_FILE_SIZE];
+	static struct wave_storage reference;
+	static struct wave_storage mounted;
+	struct smplwav            *r;
+	struct smplwav            *m = init_wave(&mounted);
+	struct smplwav_lazy        lazy;
+	size_t                     size;
+	unsigned                   info_result;
+	unsigned                   marker_result;
+	unsigned                   nb_marker;
+	unsigned                   i;
+
+	if (serialise_wave(wav, file, &size, 1)) {
+		test_fail("lazy: variant %u could not be serialised", variant);
+		return;
+	}
+	memcpy(copy, file, size);
+	if ((r = mount_wave(&reference, copy, size)) == NULL) {
+		test_fail("lazy: variant %u could not be mounted", variant);
+		return;
+	}
+
+	if (SMPLWAV_ERROR_CODE(smplwav_mount_lazy(m, &lazy, file, size, SMPLWAV_MOUNT_PRESERVE_UNKNOWN))) {
+		test_fail("lazy: variant %u could not be lazily mounted", variant);
+		return;
+	}
+
+	/* Nothing but the format, audio and unknown chunks yet. */
+	for (i = 0; i < SMPLWAV_NB_INFO_TAGS && m->info[i] == NULL; i++)
+		;
+	if  (   i != SMPLWAV_NB_INFO_TAGS
+	    ||  m->nb_marker != 0
+	    ||  m->has_pitch_info
+	    ||  m->data_frames != r->data_frames
+	    ||  memcmp(&(m->format), &(r->format), sizeof(m->format))
+	    ||  (unsigned char *)m->data - file != (unsigned char *)r->data - copy
+	    ||  m->nb_unsupported != r->nb_unsupported
+	    )
+		test_fail("lazy: variant %u decoded too much or too little when mounted", variant);
+
+	info_result   = smplwav_lazy_load_info(&lazy);
+	marker_result = smplwav_lazy_load_markers(&lazy);
+	if (info_result || marker_result) {
+		test_fail("lazy: variant %u could not be loaded (%u, %u)", variant, info_result, marker_result);
+		return;
+	}
+
+	smplwav_sort_markers(m);
+	if (!same_wave(r, m))
+		test_fail("lazy: variant %u differs", variant);
+
+	/* Later calls must not decode anything again, so damaging the file and
+	 * the decoded markers changes nothing. */
+	nb_marker = m->nb_marker;
+	memset(file, 0xFF, size);
+	m->nb_marker = MAX_MARKERS + 1;
+	if (smplwav_lazy_load_info(&lazy) != info_result || smplwav_lazy_load_markers(&lazy) != marker_result || m->nb_marker != MAX_MARKERS + 1)
+		test_fail("lazy: variant %u decoded its metadata twice", variant);
+	m->nb_marker = nb_marker;
+}
+
+/* Finds the body of the first chunk with the given ID in a serialised RIFF
+ * file. */
+static unsigned char *find_chunk(unsigned char *file, size_t size, const char *id, uint_fast32_t *ck_size)
+{
+	size_t pos = 12;
+	while (pos + 8 <= size) {
+		*ck_size = ld_le32(file + pos + 4);
+		if (!memcmp(file + pos, id, 4))
+			return file + pos + 8;
+		pos += 8 + *ck_size + (*ck_size & 1);
+	}
+	return NULL;
+}
+
+/* A loop whose length is different in the cue and smpl chunks is only
+ * reported as a conflict by smplwav_lazy_load_markers(). */
+static void test_lazy_conflict(void)
+{
+	static unsigned char   audio[400];
+	static unsigned char   file[MAX_FILE_SIZE];
+	static unsigned char   copy[MAX_FILE_SIZE];
+	struct wave_storage    s;
+	struct wave_storage    lazy_storage;
+	struct smplwav        *wav = init_wave(&s);
+	struct smplwav        *m;
+	struct smplwav_lazy    lazy;
+	unsigned char         *smpl;
+	uint_fast32_t          smpl_size;
+	size_t                 size;
+	unsigned               flags;
+
+	memset(wav->info, 0, sizeof(wav->info));
+	memset(audio, 0, sizeof(audio));
+	wav->format.format          = SMPLWAV_FORMAT_PCM16;
+	wav->format.channels        = 2;
+	wav->format.bits_per_sample = 16;
+	wav->format.sample_rate     = 44100;
+	wav->data_frames            = 100;
+	wav->data                   = audio;
+	wav->has_pitch_info         = 1;
+	wav->pitch_info             = ((uint_fast64_t)60) << 32;
+	wav->nb_marker              = 1;
+	wav->nb_unsupported         = 0;
+	memset(wav->markers, 0, sizeof(wav->markers[0]));
+	wav->markers[0].position    = 10;
+	wav->markers[0].length      = 20;
+	wav->markers[0].name        = TEST_STRINGS[0];
+
+	if (serialise_wave(wav, file, &size, 1) || (smpl = find_chunk(file, size, "smpl", &smpl_size)) == NULL || smpl_size < 60) {
+		test_fail("lazy: could not make a file with a conflicting loop");
+		return;
+	}
+	st_le32(smpl + 36 + 12, ld_le32(smpl + 36 + 12) + 5);
+
+	for (flags = 0; flags <= SMPLWAV_MOUNT_PREFER_SMPL_LOOPS; flags += SMPLWAV_MOUNT_PREFER_SMPL_LOOPS) {
+		unsigned expected;
+		unsigned marker_result;
+
+		memcpy(copy, file, size);
+		expected = SMPLWAV_ERROR_CODE(smplwav_mount_memory(init_wave(&s), copy, size, flags));
+		if (expected != (flags ? 0 : SMPLWAV_ERROR_SMPL_CUE_LOOP_CONFLICTS))
+			test_fail("lazy: mounting the conflicting loop with flags %u gave %u", flags, expected);
+
+		memcpy(copy, file, size);
+		m = init_wave(&lazy_storage);
+		if (SMPLWAV_ERROR_CODE(smplwav_mount_lazy(m, &lazy, copy, size, flags)) || SMPLWAV_ERROR_CODE(smplwav_lazy_load_info(&lazy))) {
+			test_fail("lazy: the conflicting loop was reported before the markers were loaded");
+			continue;
+		}
+
+		marker_result = smplwav_lazy_load_markers(&lazy);
+		if (SMPLWAV_ERROR_CODE(marker_result) != expected || smplwav_lazy_load_markers(&lazy) != marker_result)
+			test_fail("lazy: loading the conflicting loop with flags %u gave %u", flags, marker_result);
+		if (!expected && (m->nb_marker != 1 || m->markers[0].length != 25))
+			test_fail("lazy: the sampler loop was not preferred");
+	}
+}
+
+/* A file held in memory behind the pluggable I/O API. Only the first
+ * "available" bytes can be read. The number of bytes read from the range
+ * [audio_start, audio_end) is counted. */
+struct memory_file {
+	const unsigned char *data;
+	size_t               available;
+	uint_fast64_t        audio_start;
+	uint_fast64_t        audio_end;
+	uint_fast64_t        audio_read;
+};
+
+static int read_memory_file(void *context, unsigned char *dest, size_t size, uint_fast64_t offset)
+{
+	struct memory_file *f     = context;
+	uint_fast64_t       start = (offset > f->audio_start) ? offset : f->audio_start;
+	uint_fast64_t       end   = (offset + size < f->audio_end) ? offset + size : f->audio_end;
+	if (offset > f->available || size > f->available - offset)
+		return 1;
+	memcpy(dest, f->data + offset, size);
+	if (end > start)
+		f->audio_read += end - start;
+	return 0;
+}
+
+/* Mounting through a reader must give the same wave as mounting from memory
+ * without reading the audio, and smplwav_read_frames() must read the same
+ * audio as is found in memory. */
+static void test_reader(const struct smplwav *wav, unsigned variant)
+{
+	static unsigned char       file[MAX_FILE_SIZE];
+	static unsigned char       copy[MAX_FILE_SIZE];
+	static unsigned char       meta[MAX_FILE_SIZE];
+	static unsigned char       frames[MAX_FILE_SIZE];
+	static struct wave_storage reference;
+	static struct wave_storage mounted;
+	struct smplwav            *r;
+	struct smplwav            *m = init_wave(&mounted);
+	struct memory_file         mf;
+	uint_fast64_t              data_offset;
+	uint_fast64_t              data_size;
+	size_t                     size;
+	size_t                     frame_size;
+	uint_fast32_t              nb_frames;
+	unsigned                   w;
+
+	if (serialise_wave(wav, file, &size, 1)) {
+		test_fail("reader: variant %u could not be serialised", variant);
+		return;
+	}
+	memcpy(copy, file, size);
+	if ((r = mount_wave(&reference, copy, size)) == NULL) {
+		test_fail("reader: variant %u could not be mounted", variant);
+		return;
+	}
+	frame_size = r->format.channels * smplwav_format_container_size(r->format.format);
+	nb_frames  = (uint_fast32_t)r->data_frames;
+
+	mf.data        = file;
+	mf.available   = size;
+	mf.audio_start = (unsigned char *)r->data - copy;
+	mf.audio_end   = mf.audio_start + r->data_frames * frame_size;
+	mf.audio_read  = 0;
+	if (SMPLWAV_ERROR_CODE(smplwav_mount_reader(m, read_memory_file, &mf, size, meta, sizeof(meta), SMPLWAV_MOUNT_PRESERVE_UNKNOWN, &data_offset, &data_size))) {
+		test_fail("reader: variant %u could not be mounted through a reader", variant);
+		return;
+	}
+
+	smplwav_sort_markers(m);
+	if (m->data != NULL || !same_wave(r, m))
+		test_fail("reader: variant %u differs", variant);
+	if (data_offset != (uint_fast64_t)((unsigned char *)r->data - copy) || data_size != r->data_frames * frame_size)
+		test_fail("reader: variant %u has the audio in the wrong place", variant);
+	/* The first four bytes of every chunk body are read with its header. */
+	if (mf.audio_read > 4)
+		test_fail("reader: variant %u read %lu bytes of audio while mounting", variant, (unsigned long)mf.audio_read);
+
+	for (w = 0; w < 6; w++) {
+		static const uint_fast32_t WINDOWS[6][2] = {{0, 0}, {0, 1}, {1, 3}, {0, 0xFFFFFFFFu}, {0xFFFFFFFFu, 1}, {7, 50}};
+		uint_fast32_t start = (WINDOWS[w][0] == 0xFFFFFFFFu) ? nb_frames - 1 : WINDOWS[w][0];
+		uint_fast32_t count = (WINDOWS[w][1] == 0xFFFFFFFFu) ? nb_frames : WINDOWS[w][1];
+		memset(frames, 0, (size_t)count * frame_size);
+		if (smplwav_read_frames(m, read_memory_file, &mf, data_offset, start, count, frames) || memcmp(frames, (unsigned char *)r->data + start * frame_size, (size_t)count * frame_size))
+			test_fail("reader: variant %u frames [%lu, +%lu) differ", variant, (unsigned long)start, (unsigned long)count);
+	}
+
+	/* Ranges beyond the audio are rejected without reading anything. */
+	mf.audio_read = 0;
+	if  (   !smplwav_read_frames(m, read_memory_file, &mf, data_offset, nb_frames, 1, frames)
+	    ||  !smplwav_read_frames(m, read_memory_file, &mf, data_offset, 0, nb_frames + 1, frames)
+	    ||  !smplwav_read_frames(m, read_memory_file, &mf, data_offset, ((uint_fast64_t)1) << 32, 1, frames)
+	    ||  mf.audio_read != 0
+	    )
+		test_fail("reader: variant %u read frames beyond the audio", variant);
+
+	/* A file which is shorter than it claims to be. */
+	mf.available = 40;
+	if (SMPLWAV_ERROR_CODE(smplwav_mount_reader(init_wave(&mounted), read_memory_file, &mf, size, meta, sizeof(meta), SMPLWAV_MOUNT_PRESERVE_UNKNOWN, &data_offset, &data_size)) != SMPLWAV_ERROR_READ)
+		test_fail("reader: variant %u mounted from a file which could not be read", variant);
+
+	/* A metadata buffer which is too small. */
+	mf.available = size;
+	if  (   (r->nb_marker || r->nb_unsupported || r->info[SMPLWAV_INFO_INAM] != NULL)
+	    &&  SMPLWAV_ERROR_CODE(smplwav_mount_reader(init_wave(&mounted), read_memory_file, &mf, size, meta, 8, SMPLWAV_MOUNT_PRESERVE_UNKNOWN, &data_offset, &data_size)) != SMPLWAV_ERROR_BUFFER_TOO_SMALL
+	    )
+		test_fail("reader: variant %u mounted into a buffer which was too small", variant);
+}
+
+struct test_executor {
+	unsigned nb_calls;
+	unsigned nb_jobs;
+};
+
+/* Runs the jobs in reverse order so that nothing can depend on them being
+ * run in sequence. */
+static void reverse_executor(void *executor_context, smplwav_job_fn fn, void *context, unsigned nb_jobs)
+{
+	struct test_executor *e = executor_context;
+	unsigned              i;
+	e->nb_calls++;
+	e->nb_jobs += nb_jobs;
+	for (i = nb_jobs; i > 0; i--)
+		fn(context, i - 1);
+}
+
+/* Enough items for three jobs, the last of them partly filled. */
+#define NB_BATCH_ITEMS  (2 * SMPLWAV_MOUNT_BATCH_JOB_ITEMS + 5)
+#define BATCH_BAD_ITEM  (SMPLWAV_MOUNT_BATCH_JOB_ITEMS + 3)
+#define BATCH_FD_ITEM   (7)
+
+/* Mounts a batch in which one item is not a wave and one item is read from a
+ * file and checks every item against mounting the same bytes on their own. */
+static void test_batch(struct smplwav *wav, unsigned char *audio, int use_executor)
+{
+	static struct smplwav_mount_batch_item items[NB_BATCH_ITEMS];
+	static struct smplwav_marker           markers[NB_BATCH_ITEMS][MAX_MARKERS];
+	static struct smplwav_extra_ck         unsupported[NB_BATCH_ITEMS][MAX_CHUNKS];
+	static unsigned char                   files[NB_BATCH_ITEMS][MAX_FILE_SIZE];
+	static unsigned char                   copy[MAX_FILE_SIZE];
+	static struct wave_storage             reference;
+	struct test_executor                   e;
+	FILE                                  *f = NULL;
+	unsigned                               nb_failed;
+	unsigned                               i;
+
+	for (i = 0; i < NB_BATCH_ITEMS; i++) {
+		struct smplwav_mount_batch_item *item = items + i;
+		size_t                           size;
+
+		build_wave(wav, i % NB_VARIANTS, audio);
+		if (serialise_wave(wav, files[i], &size, 1)) {
+			test_fail("batch: item %u could not be serialised", i);
+			return;
+		}
+		if (i == BATCH_BAD_ITEM)
+			memcpy(files[i], "RIFX", 4);
+
+		item->fd    = -1;
+		item->buf   = files[i];
+		item->bufsz = size;
+		smplwav_set_storage(&(item->wav), markers[i], MAX_MARKERS, unsupported[i], MAX_CHUNKS);
+
+		/* The file item gets the whole of its buffer for metadata. */
+		if (i == BATCH_FD_ITEM) {
+			if  (   (f = tmpfile()) == NULL
+			    ||  fwrite(files[i], 1, size, f) != size
+			    ||  fflush(f)
+			    ) {
+				test_fail("batch: could not write a temporary file");
+				if (f != NULL)
+					fclose(f);
+				return;
+			}
+			item->fd    = fileno(f);
+			item->bufsz = MAX_FILE_SIZE;
+		}
+	}
+
+	e.nb_calls = 0;
+	e.nb_jobs  = 0;
+	nb_failed  = smplwav_mount_batch(items, NB_BATCH_ITEMS, SMPLWAV_MOUNT_PRESERVE_UNKNOWN, use_executor ? reverse_executor : NULL, &e);
+
+	if (nb_failed != 1)
+		test_fail("batch: %u items failed", nb_failed);
+	if (use_executor && (e.nb_calls != 1 || e.nb_jobs != (NB_BATCH_ITEMS + SMPLWAV_MOUNT_BATCH_JOB_ITEMS - 1) / SMPLWAV_MOUNT_BATCH_JOB_ITEMS))
+		test_fail("batch: ran %u jobs in %u calls", e.nb_jobs, e.nb_calls);
+	if (!use_executor && e.nb_calls)
+		test_fail("batch: used the executor when none was given");
+
+	for (i = 0; i < NB_BATCH_ITEMS; i++) {
+		struct smplwav_mount_batch_item *item = items + i;
+		struct smplwav                  *r    = init_wave(&reference);
+		unsigned                         result;
+		size_t                           size;
+
+		/* The file item's buffer was overwritten by the mount so its bytes
+		 * are read back from the file. */
+		if (i == BATCH_FD_ITEM) {
+			size = (size_t)ftell(f);
+			rewind(f);
+			if (fread(copy, 1, size, f) != size) {
+				test_fail("batch: could not read the temporary file");
+				continue;
+			}
+		} else {
+			size = item->bufsz;
+			memcpy(copy, files[i], size);
+		}
+
+		result = smplwav_mount_memory(r, copy, size, SMPLWAV_MOUNT_PRESERVE_UNKNOWN);
+
+		if (i == BATCH_BAD_ITEM) {
+			if (!SMPLWAV_ERROR_CODE(item->result) || item->result != result)
+				test_fail("batch: the bad item gave %u rather than %u", item->result, result);
+			continue;
+		}
+
+		if (SMPLWAV_ERROR_CODE(item->result) || item->result != result) {
+			test_fail("batch: item %u gave %u rather than %u", i, item->result, result);
+			continue;
+		}
+
+		smplwav_sort_markers(r);
+		smplwav_sort_markers(&(item->wav));
+		if (!same_wave(r, &(item->wav)))
+			test_fail("batch: item %u differs", i);
+
+		if (i == BATCH_FD_ITEM) {
+			if  (   item->wav.data != NULL
+			    ||  item->data_offset + item->data_size > size
+			    ||  item->data_size != r->data_frames * r->format.channels * smplwav_format_container_size(r->format.format)
+			    ||  memcmp(copy + item->data_offset, r->data, (size_t)item->data_size)
+			    )
+				test_fail("batch: the audio of the file item is in the wrong place");
+		} else if (item->wav.data == NULL) {
+			test_fail("batch: item %u has no audio", i);
+		}
+	}
+
+	fclose(f);
+}
+
+/* The alignment smplwav_mount_arena() keeps the end of the used part of the
+ * arena at. */
+struct arena_align_probe {
+	char c;
+	union {
+		struct smplwav_marker   marker;
+		struct smplwav_extra_ck ck;
+	} u;
+};
+
+#define ARENA_ALIGN (offsetof(struct arena_align_probe, u))
+
+/* Packs every variant into one arena, asking for the size each one needs
+ * first, and checks them all against mounting them on their own once the
+ * arena is full so that no mount overwrote an earlier one. */
+static void test_arena(struct smplwav *wav, unsigned char *audio)
+{
+	static unsigned char       files[NB_VARIANTS][MAX_FILE_SIZE];
+	static struct smplwav      packed[NB_VARIANTS];
+	static unsigned char       copy[MAX_FILE_SIZE];
+	static struct wave_storage reference;
+	size_t                     sizes[NB_VARIANTS];
+	size_t                     arena_size = 0;
+	size_t                     pos = 0;
+	unsigned char             *arena;
+	unsigned                   variant;
+
+	for (variant = 0; variant < NB_VARIANTS; variant++) {
+		size_t   needed = 0;
+		size_t   used = 0;
+		unsigned ret;
+
+		build_wave(wav, variant, audio);
+		if (serialise_wave(wav, files[variant], &(sizes[variant]), 1)) {
+			test_fail("arena: variant %u could not be serialised", variant);
+			return;
+		}
+
+		/* A file which needs no storage is mounted by the size query. */
+		ret = smplwav_mount_arena(packed + variant, files[variant], sizes[variant], SMPLWAV_MOUNT_PRESERVE_UNKNOWN, NULL, 0, &needed);
+		if (wav->nb_marker == 0 && wav->nb_unsupported == 0) {
+			if (SMPLWAV_ERROR_CODE(ret) || needed != 0)
+				test_fail("arena: variant %u needs no storage but asked for %lu bytes", variant, (unsigned long)needed);
+		} else if (SMPLWAV_ERROR_CODE(ret) != SMPLWAV_ERROR_BUFFER_TOO_SMALL || needed == 0 || needed % ARENA_ALIGN) {
+			test_fail("arena: variant %u size query gave %u and %lu bytes", variant, ret, (unsigned long)needed);
+			needed = MAX_FILE_SIZE;
+		}
+
+		/* One byte short of the size asked for must fail. */
+		if (needed) {
+			unsigned char *small_arena = test_malloc(needed);
+			if (SMPLWAV_ERROR_CODE(smplwav_mount_arena(packed + variant, files[variant], sizes[variant], SMPLWAV_MOUNT_PRESERVE_UNKNOWN, small_arena, needed - 1, &used)) != SMPLWAV_ERROR_BUFFER_TOO_SMALL || used != needed)
+				test_fail("arena: variant %u mounted into %lu bytes", variant, (unsigned long)(needed - 1));
+			free(small_arena);
+		}
+
+		/* Unknown chunks are the only storage a file without markers
+		 * needs, so the size asked for is exactly what is used. */
+		if (wav->nb_marker == 0 && needed != ((wav->nb_unsupported * sizeof(struct smplwav_extra_ck) + ARENA_ALIGN - 1) / ARENA_ALIGN) * ARENA_ALIGN)
+			test_fail("arena: variant %u without markers asked for %lu bytes", variant, (unsigned long)needed);
+
+		arena_size += needed;
+	}
+
+	arena = test_malloc(arena_size);
+
+	for (variant = 0; variant < NB_VARIANTS; variant++) {
+		struct smplwav *p    = packed + variant;
+		size_t          used = 0;
+
+		if (SMPLWAV_ERROR_CODE(smplwav_mount_arena(p, files[variant], sizes[variant], SMPLWAV_MOUNT_PRESERVE_UNKNOWN, arena + pos, arena_size - pos, &used))) {
+			test_fail("arena: variant %u could not be mounted", variant);
+			p->nb_marker = p->max_marker = p->nb_unsupported = p->max_unsupported = 0;
+			continue;
+		}
+
+		if  (   p->max_marker != p->nb_marker
+		    ||  p->max_unsupported != p->nb_unsupported
+		    ||  used % ARENA_ALIGN
+		    ||  used > arena_size - pos
+		    ||  (p->nb_unsupported && (unsigned char *)p->unsupported != arena + pos)
+		    ||  (p->nb_marker && (unsigned char *)(p->markers + p->nb_marker) > arena + pos + used)
+		    ||  (p->nb_marker && (unsigned char *)p->markers < arena + pos + p->nb_unsupported * sizeof(struct smplwav_extra_ck))
+		    )
+			test_fail("arena: variant %u is not packed (%lu bytes used)", variant, (unsigned long)used);
+
+		pos += used;
+	}
+
+	for (variant = 0; variant < NB_VARIANTS; variant++) {
+		struct smplwav *r;
+		memcpy(copy, files[variant], sizes[variant]);
+		if ((r = mount_wave(&reference, copy, sizes[variant])) == NULL) {
+			test_fail("arena: variant %u could not be mounted on its own", variant);
+			continue;
+		}
+		smplwav_sort_markers(packed + variant);
+		if (!same_wave(r, packed + variant))
+			test_fail("arena: variant %u differs", variant);
+	}
+
+	free(arena);
+}
+
+/* Builds a wave with "nb_marker" markers, half of them loops, and checks
+ * that mounting it gives the same markers whether they are found by
+ * scanning (too many for the stack index and no scratch space), with the
+ * stack index or with the index in the scratch space of an arena. */
+static void test_many_markers(unsigned nb_marker)
+{
+	size_t                 frames  = 4 * (size_t)nb_marker + 8;
+	unsigned char         *audio   = test_malloc(2 * frames);
+	struct smplwav_marker *markers = test_malloc(sizeof(struct smplwav_marker) * 2 * nb_marker);
+	struct smplwav_marker *mounted = markers + nb_marker;
+	unsigned char         *file;
+	unsigned char         *copy;
+	unsigned char         *arena;
+	struct smplwav         wav;
+	struct smplwav         m;
+	size_t                 size;
+	size_t                 needed = 0;
+	size_t                 used;
+	unsigned               i;
+
+	smplwav_set_storage(&wav, markers, nb_marker, NULL, 0);
+	memset(wav.info, 0, sizeof(wav.info));
+	wav.format.format          = SMPLWAV_FORMAT_PCM16;
+	wav.format.channels        = 1;
+	wav.format.bits_per_sample = 16;
+	wav.format.sample_rate     = 44100;
+	wav.data_frames            = frames;
+	wav.data                   = audio;
+	wav.has_pitch_info         = 1;
+	wav.pitch_info             = ((uint_fast64_t)60) << 32;
+	test_random_samples(audio, 2 * frames, SMPLWAV_FORMAT_PCM16);
+	for (i = 0; i < nb_marker; i++) {
+		struct smplwav_marker *mk = markers + i;
+		mk->id       = 0;
+		mk->in_cue   = 0;
+		mk->in_smpl  = 0;
+		mk->has_ltxt = 0;
+		mk->position = 4 * i + i % 3;
+		mk->length   = (i % 2) ? 1 + i % 5 : 0;
+		mk->name     = (i % 3) ? test_random_string() : NULL;
+		mk->desc     = (i % 7 == 0) ? test_random_string() : NULL;
+	}
+	wav.nb_marker = nb_marker;
+	smplwav_sort_markers(&wav);
+
+	if (smplwav_serialise(&wav, NULL, &size, 1)) {
+		test_fail("markers: %u markers could not be serialised", nb_marker);
+		free(audio);
+		free(markers);
+		return;
+	}
+	file = test_malloc(2 * size);
+	copy = file + size;
+	smplwav_serialise(&wav, file, &size, 1);
+
+	/* The marker storage is exactly as large as it needs to be so the
+	 * index is sized from it. */
+	memcpy(copy, file, size);
+	smplwav_set_storage(&m, mounted, nb_marker, NULL, 0);
+	if (SMPLWAV_ERROR_CODE(smplwav_mount_memory(&m, copy, size, 0))) {
+		test_fail("markers: %u markers could not be mounted", nb_marker);
+	} else {
+		smplwav_sort_markers(&m);
+		if (!same_wave(&wav, &m))
+			test_fail("markers: %u markers mounted from memory differ", nb_marker);
+	}
+
+	memcpy(copy, file, size);
+	if (SMPLWAV_ERROR_CODE(smplwav_mount_arena(&m, copy, size, 0, NULL, 0, &needed)) != SMPLWAV_ERROR_BUFFER_TOO_SMALL) {
+		test_fail("markers: the arena size query for %u markers failed", nb_marker);
+	} else {
+		arena = test_malloc(needed);
+		if (SMPLWAV_ERROR_CODE(smplwav_mount_arena(&m, copy, size, 0, arena, needed, &used))) {
+			test_fail("markers: %u markers could not be mounted into an arena", nb_marker);
+		} else {
+			smplwav_sort_markers(&m);
+			if (!same_wave(&wav, &m))
+				test_fail("markers: %u markers mounted into an arena differ", nb_marker);
+		}
+		free(arena);
+	}
+
+	free(file);
+	free(audio);
+	free(markers);
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned char       audio[MAX_FILE_SIZE];
+	static struct wave_storage source;
+	unsigned                   variant;
+
+	(void)argc;
+	(void)argv;
+
+	for (variant = 0; variant < NB_VARIANTS; variant++) {
+		struct smplwav *wav = init_wave(&source);
+		build_wave(wav, variant, audio);
+		test_stream(wav, variant);
+		test_rf64(wav, variant);
+		test_lazy(wav, variant);
+		test_reader(wav, variant);
+	}
+
+	test_batch(init_wave(&source), audio, 0);
+	test_batch(init_wave(&source), audio, 1);
+	test_arena(init_wave(&source), audio);
+	test_lazy_conflict();
+	test_many_markers(10);
+	test_many_markers(200);
+	test_many_markers(3000);
+
+	return test_result();
+}
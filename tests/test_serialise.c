@@ -0,0 +1,475 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+/* Builds waves by hand and checks the different ways of serialising them
+ * against each other and against mounting the result. */
+
+#include "test_wave.h"
+
+/* Written past the end of outputs to catch writes beyond them. */
+#define GUARD_PATTERN (0x5A)
+#define GUARD_SIZE    (16)
+
+static int guard_intact(const unsigned char *p)
+{
+	unsigned i;
+	for (i = 0; i < GUARD_SIZE; i++)
+		if (p[i] != GUARD_PATTERN)
+			return 0;
+	return 1;
+}
+
+/* Serialising a wave, mounting it and serialising it again must give the
+ * same bytes. */
+static void test_memory(const struct smplwav *wav, unsigned variant)
+{
+	static unsigned char       first[MAX_FILE_SIZE];
+	static unsigned char       second[MAX_FILE_SIZE];
+	static struct wave_storage mounted;
+	int                        store_cue_loops;
+
+	for (store_cue_loops = 0; store_cue_loops < 2; store_cue_loops++) {
+		struct smplwav *m;
+		size_t          first_size;
+		size_t          second_size;
+
+		if (serialise_wave(wav, first, &first_size, store_cue_loops)) {
+			test_fail("memory: variant %u could not be serialised", variant);
+			continue;
+		}
+
+		if (memcmp(first, "RIFF", 4))
+			test_fail("memory: variant %u was not written as RIFF", variant);
+
+		if ((m = mount_wave(&mounted, first, first_size)) == NULL) {
+			test_fail("memory: variant %u could not be mounted", variant);
+			continue;
+		}
+
+		/* Loops are only kept with their names when they are also written
+		 * as cue points. */
+		if (store_cue_loops && !same_wave(wav, m))
+			test_fail("memory: variant %u differs", variant);
+
+		if (serialise_wave(m, second, &second_size, store_cue_loops) || first_size != second_size || memcmp(first, second, first_size))
+			test_fail("memory: variant %u did not serialise to the same bytes when mounted", variant);
+	}
+}
+
+/* A plan must emit exactly what smplwav_serialise() writes, with or without
+ * storage for the marker lengths, and must keep doing so for waves which only
+ * differ in their audio. */
+static void test_plan(const struct smplwav *wav, unsigned variant)
+{
+	static unsigned char          expected[MAX_FILE_SIZE];
+	static unsigned char          emitted[MAX_FILE_SIZE + GUARD_SIZE];
+	static unsigned char          other_audio[MAX_FILE_SIZE];
+	static uint_fast32_t          lengths[2 * MAX_MARKERS];
+	struct smplwav_serialise_plan plan;
+	struct smplwav                other;
+	size_t                        audio_size = wav->data_frames * wav->format.channels * smplwav_format_container_size(wav->format.format);
+	size_t                        size;
+	int                           store_cue_loops;
+	int                           use_lengths;
+
+	for (store_cue_loops = 0; store_cue_loops < 2; store_cue_loops++) {
+		for (use_lengths = 0; use_lengths < 2; use_lengths++) {
+			if (serialise_wave(wav, expected, &size, store_cue_loops)) {
+				test_fail("plan: variant %u could not be serialised", variant);
+				return;
+			}
+
+			if (smplwav_serialise_plan(&plan, wav, store_cue_loops, use_lengths ? lengths : NULL) || plan.size != size) {
+				test_fail("plan: variant %u was planned at %lu bytes rather than %lu", variant, (unsigned long)plan.size, (unsigned long)size);
+				continue;
+			}
+
+			memset(emitted, GUARD_PATTERN, sizeof(emitted));
+			smplwav_serialise_emit(&plan, wav, emitted);
+			if (memcmp(emitted, expected, size) || !guard_intact(emitted + size))
+				test_fail("plan: variant %u (cue loops %d, lengths %d) emitted different bytes", variant, store_cue_loops, use_lengths);
+
+			if (plan.data_offset + audio_size > size || memcmp(emitted + plan.data_offset, wav->data, audio_size))
+				test_fail("plan: variant %u has the audio in the wrong place", variant);
+
+			/* The plan is a template for waves with other audio. */
+			other      = *wav;
+			other.data = other_audio;
+			test_random_samples(other_audio, audio_size, wav->format.format);
+			if (serialise_wave(&other, expected, &size, store_cue_loops)) {
+				test_fail("plan: variant %u with other audio could not be serialised", variant);
+				continue;
+			}
+			memset(emitted, GUARD_PATTERN, sizeof(emitted));
+			smplwav_serialise_emit(&plan, &other, emitted);
+			if (memcmp(emitted, expected, size) || !guard_intact(emitted + size))
+				test_fail("plan: variant %u with other audio emitted different bytes", variant);
+		}
+	}
+}
+
+/* Joining the segments must give what smplwav_serialise_emit() writes. The
+ * generated pieces must come from the metadata buffer, in order, and the
+ * others must refer to the audio and unsupported chunks in place. */
+static void test_segments(const struct smplwav *wav, unsigned variant)
+{
+	static unsigned char          expected[MAX_FILE_SIZE];
+	static unsigned char          joined[MAX_FILE_SIZE];
+	static unsigned char          metadata[MAX_FILE_SIZE + GUARD_SIZE];
+	struct smplwav_segment        segments[SMPLWAV_SERIALISE_MAX_SEGMENTS(MAX_CHUNKS)];
+	struct smplwav_serialise_plan plan;
+	size_t                        size = 0;
+	size_t                        metadata_used = 0;
+	unsigned                      nb_segment;
+	unsigned                      i;
+
+	if (smplwav_serialise_plan(&plan, wav, 1, NULL) || plan.size > MAX_FILE_SIZE || plan.metadata_size > MAX_FILE_SIZE) {
+		test_fail("segments: variant %u could not be planned", variant);
+		return;
+	}
+	smplwav_serialise_emit(&plan, wav, expected);
+
+	memset(metadata, GUARD_PATTERN, sizeof(metadata));
+	nb_segment = smplwav_serialise_segments(&plan, wav, metadata, segments);
+	if (nb_segment > SMPLWAV_SERIALISE_MAX_SEGMENTS(wav->nb_unsupported) || !guard_intact(metadata + plan.metadata_size)) {
+		test_fail("segments: variant %u wrote out of bounds", variant);
+		return;
+	}
+
+	for (i = 0; i < nb_segment; i++) {
+		const unsigned char *data = segments[i].data;
+		if (segments[i].size == 0 || segments[i].size > MAX_FILE_SIZE - size) {
+			test_fail("segments: variant %u has a bad segment", variant);
+			return;
+		}
+		if (data >= metadata && data < metadata + sizeof(metadata)) {
+			if (data != metadata + metadata_used)
+				test_fail("segments: variant %u used the metadata buffer out of order", variant);
+			metadata_used += segments[i].size;
+		} else if (data != wav->data) {
+			unsigned j;
+			for (j = 0; j < wav->nb_unsupported && data != wav->unsupported[j].data; j++)
+				;
+			if (j == wav->nb_unsupported)
+				test_fail("segments: variant %u has a copied segment", variant);
+		}
+		memcpy(joined + size, data, segments[i].size);
+		size += segments[i].size;
+	}
+
+	if (size != plan.size || memcmp(joined, expected, size) || metadata_used != plan.metadata_size)
+		test_fail("segments: variant %u differs from the emitted file", variant);
+}
+
+struct virtual_file {
+	const struct smplwav_segment *segments;
+	unsigned                      nb_segment;
+	const void                   *audio;
+};
+
+/* Serves reads of a file described by a list of segments. The audio is not
+ * stored anywhere and reads as zero. */
+static int read_virtual_file(void *context, unsigned char *dest, size_t size, uint_fast64_t offset)
+{
+	const struct virtual_file *vf   = context;
+	uint_fast64_t              base = 0;
+	unsigned                   i;
+
+	for (i = 0; i < vf->nb_segment && size; i++) {
+		uint_fast64_t end = base + vf->segments[i].size;
+		if (offset < end) {
+			size_t n = (size_t)(end - offset);
+			if (n > size)
+				n = size;
+			if (vf->segments[i].data == vf->audio)
+				memset(dest, 0, n);
+			else
+				memcpy(dest, (const unsigned char *)vf->segments[i].data + (offset - base), n);
+			dest   += n;
+			offset += n;
+			size   -= n;
+		}
+		base = end;
+	}
+
+	return size != 0;
+}
+
+/* A wave with just over 4 GB of audio is written as RF64 through segments
+ * and mounted through the pluggable I/O API without the audio ever being
+ * stored. */
+static void test_large_rf64(struct smplwav *wav, unsigned variant)
+{
+	static unsigned char          metadata[MAX_FILE_SIZE];
+	static unsigned char          buf[MAX_FILE_SIZE];
+	static struct wave_storage    mounted;
+	struct smplwav_segment        segments[SMPLWAV_SERIALISE_MAX_SEGMENTS(MAX_CHUNKS)];
+	struct smplwav_serialise_plan plan;
+	struct virtual_file           vf;
+	struct smplwav               *m = init_wave(&mounted);
+	uint_fast64_t                 data_offset;
+	uint_fast64_t                 data_size;
+	uint_fast64_t                 small_frames = wav->data_frames;
+	uint_fast32_t                 shift;
+	unsigned                      i;
+
+	/* The markers are moved to the end of the audio. The audio pointer is
+	 * only used to recognise the audio segment. */
+	wav->data_frames = (((uint_fast64_t)1) << 32) / (wav->format.channels * smplwav_format_container_size(wav->format.format)) + 1;
+	shift            = (uint_fast32_t)(wav->data_frames - small_frames);
+	for (i = 0; i < wav->nb_marker; i++)
+		wav->markers[i].position += shift;
+
+	if (smplwav_serialise_plan(&plan, wav, 1, NULL)) {
+		/* The file can not be addressed on this platform. */
+		if (sizeof(size_t) >= 8)
+			test_fail("large rf64: variant %u could not be planned", variant);
+	} else if (plan.metadata_size > sizeof(metadata)) {
+		test_fail("large rf64: variant %u has too much metadata", variant);
+	} else {
+		vf.segments   = segments;
+		vf.nb_segment = smplwav_serialise_segments(&plan, wav, metadata, segments);
+		vf.audio      = wav->data;
+
+		if (memcmp(metadata, "RF64", 4))
+			test_fail("large rf64: variant %u was not written as RF64", variant);
+
+		if (SMPLWAV_ERROR_CODE(smplwav_mount_reader(m, read_virtual_file, &vf, plan.size, buf, sizeof(buf), SMPLWAV_MOUNT_PRESERVE_UNKNOWN, &data_offset, &data_size))) {
+			test_fail("large rf64: variant %u could not be mounted", variant);
+		} else {
+			smplwav_sort_markers(m);
+			if (m->data != NULL || !same_wave(wav, m))
+				test_fail("large rf64: variant %u differs", variant);
+			if (data_offset != plan.data_offset || data_size != wav->data_frames * wav->format.channels * smplwav_format_container_size(wav->format.format))
+				test_fail("large rf64: variant %u has the audio in the wrong place", variant);
+		}
+	}
+
+	wav->data_frames = small_frames;
+	for (i = 0; i < wav->nb_marker; i++)
+		wav->markers[i].position -= shift;
+}
+
+/* Changes the metadata of a mounted wave. Strings which are replaced come
+ * from TEST_STRINGS so they stay valid while the file is being patched. */
+static void edit_wave(struct smplwav *wav, unsigned variant)
+{
+	switch (variant % 5) {
+		case 0:
+			wav->info[SMPLWAV_INFO_INAM] = TEST_STRINGS[3];
+			break;
+		case 1: {
+			unsigned i;
+			for (i = 0; i < SMPLWAV_NB_INFO_TAGS; i++)
+				wav->info[i] = NULL;
+			wav->nb_marker = 0;
+			break;
+		}
+		case 2: {
+			unsigned i;
+			for (i = 0; i < 12 && wav->nb_marker < wav->max_marker; i++) {
+				struct smplwav_marker *m = wav->markers + wav->nb_marker++;
+				m->position = (uint_fast32_t)(test_rng() % wav->data_frames);
+				m->length   = (i % 3 == 0) ? (1 + test_rng() % (wav->data_frames - m->position)) : 0;
+				m->name     = TEST_STRINGS[5];
+				m->desc     = (i % 2) ? TEST_STRINGS[4] : NULL;
+			}
+			smplwav_sort_markers(wav);
+			break;
+		}
+		case 3:
+			wav->has_pitch_info = !wav->has_pitch_info;
+			wav->pitch_info     = ((uint_fast64_t)62) << 32;
+			break;
+		default:
+			if (wav->nb_marker)
+				wav->markers[0].name = NULL;
+			wav->info[SMPLWAV_INFO_ICMT] = TEST_STRINGS[1];
+			break;
+	}
+}
+
+/* Patches the metadata of a RIFF or RF64 file in place and checks that the
+ * result mounts to the same wave as the edited wave written from scratch.
+ * The writes must stay inside the new file and must not overlap. */
+static void test_patch(const struct smplwav *wav, unsigned variant, int as_rf64)
+{
+	static unsigned char              serialised[MAX_FILE_SIZE];
+	static unsigned char              file[2 * MAX_FILE_SIZE];
+	static unsigned char              expected[MAX_FILE_SIZE];
+	static unsigned char              patch[MAX_FILE_SIZE];
+	static unsigned char              written[2 * MAX_FILE_SIZE];
+	static struct wave_storage        original;
+	static struct wave_storage        patched;
+	static struct wave_storage        rewritten;
+	static struct smplwav_chunk       chunks[MAX_CHUNKS];
+	static struct smplwav_patch_write writes[SMPLWAV_PATCH_MAX_WRITES(MAX_CHUNKS)];
+	struct smplwav_chunk_directory    directory;
+	struct smplwav_serialise_plan     plan;
+	struct smplwav                   *w = init_wave(&original);
+	struct smplwav                   *p;
+	struct smplwav                   *r;
+	unsigned char                     header[12];
+	size_t                            size;
+	uint_fast64_t                     file_size;
+	unsigned                          nb_write;
+	unsigned                          i;
+
+	if (serialise_wave(wav, serialised, &size, 1)) {
+		test_fail("patch: variant %u could not be serialised", variant);
+		return;
+	}
+	if (as_rf64)
+		size = make_rf64(file, serialised, size, wav->data_frames);
+	else
+		memcpy(file, serialised, size);
+
+	smplwav_set_directory(w, &directory, chunks, MAX_CHUNKS);
+	if (SMPLWAV_ERROR_CODE(smplwav_mount_memory(w, file, size, SMPLWAV_MOUNT_PRESERVE_UNKNOWN))) {
+		test_fail("patch: variant %u could not be mounted", variant);
+		return;
+	}
+	smplwav_sort_markers(w);
+	edit_wave(w, variant);
+
+	/* The expected result is the edited wave written from scratch. This must
+	 * be made before the patch is applied as the patch overwrites strings
+	 * which the edited wave may still point to. */
+	if (smplwav_serialise_plan(&plan, w, 1, NULL) || plan.size > MAX_FILE_SIZE) {
+		test_fail("patch: variant %u could not be planned", variant);
+		return;
+	}
+	smplwav_serialise_emit(&plan, w, expected);
+
+	if (smplwav_serialise_patch_size(&plan, &directory) > sizeof(patch)) {
+		test_fail("patch: variant %u needs too much space", variant);
+		return;
+	}
+
+	memcpy(header, file, 12);
+	if (smplwav_serialise_patch(&plan, w, &directory, header, patch, writes, &nb_write, &file_size)) {
+		test_fail("patch: variant %u could not be patched", variant);
+		return;
+	}
+
+	if (file_size > sizeof(file) || nb_write > SMPLWAV_PATCH_MAX_WRITES(directory.nb_chunk)) {
+		test_fail("patch: variant %u is out of range", variant);
+		return;
+	}
+
+	memset(written, 0, sizeof(written));
+	for (i = 0; i < nb_write; i++) {
+		size_t j;
+		if (writes[i].offset > file_size || writes[i].size > file_size - writes[i].offset) {
+			test_fail("patch: variant %u writes beyond the end of the file", variant);
+			return;
+		}
+		for (j = 0; j < writes[i].size; j++)
+			if (written[writes[i].offset + j]++)
+				break;
+		if (j < writes[i].size)
+			test_fail("patch: variant %u has overlapping writes", variant);
+		memcpy(file + writes[i].offset, writes[i].data, writes[i].size);
+	}
+
+	if ((p = mount_wave(&patched, file, (size_t)file_size)) == NULL || (r = mount_wave(&rewritten, expected, plan.size)) == NULL) {
+		test_fail("patch: variant %u could not be mounted after patching", variant);
+		return;
+	}
+
+	if (memcmp(file, as_rf64 ? "RF64" : "RIFF", 4))
+		test_fail("patch: variant %u changed form", variant);
+
+	if (!same_wave(p, r))
+		test_fail("patch: variant %u differs from the rewritten file", variant);
+}
+
+/* Aligned plans must put the first byte of audio on the requested boundary,
+ * the mounted file must find its audio there and the padding must not change
+ * the wave. Alignments which are not powers of two must be rejected. */
+static void test_aligned(const struct smplwav *wav, unsigned variant)
+{
+	static const uint_fast32_t    alignments[] = {0, 1, 2, 16, 512, 4096};
+	static const uint_fast32_t    bad_alignments[] = {3, 24, 4097, 0x80000001u};
+	static unsigned char          file[2 * MAX_FILE_SIZE];
+	static struct wave_storage    mounted;
+	struct smplwav_serialise_plan unaligned;
+	struct smplwav_serialise_plan plan;
+	unsigned                      i;
+
+	if (smplwav_serialise_plan(&unaligned, wav, 1, NULL)) {
+		test_fail("aligned: variant %u could not be planned", variant);
+		return;
+	}
+
+	for (i = 0; i < sizeof(alignments) / sizeof(alignments[0]); i++) {
+		uint_fast32_t   alignment = alignments[i];
+		struct smplwav *m;
+
+		if (smplwav_serialise_plan_aligned(&plan, wav, 1, NULL, alignment) || plan.size > sizeof(file)) {
+			test_fail("aligned: variant %u could not be planned to %u bytes", variant, (unsigned)alignment);
+			continue;
+		}
+
+		if (alignment > 1 ? (plan.data_offset % alignment != 0) : (plan.size != unaligned.size || plan.data_offset != unaligned.data_offset))
+			test_fail("aligned: variant %u has audio at %u for %u byte alignment", variant, (unsigned)plan.data_offset, (unsigned)alignment);
+
+		smplwav_serialise_emit(&plan, wav, file);
+		if ((m = mount_wave(&mounted, file, (size_t)plan.size)) == NULL) {
+			test_fail("aligned: variant %u could not be mounted at %u byte alignment", variant, (unsigned)alignment);
+			continue;
+		}
+
+		if ((unsigned char *)m->data != file + plan.data_offset)
+			test_fail("aligned: variant %u mounted audio is not at the planned offset", variant);
+
+		if (!same_wave(wav, m))
+			test_fail("aligned: variant %u differs at %u byte alignment", variant, (unsigned)alignment);
+	}
+
+	for (i = 0; i < sizeof(bad_alignments) / sizeof(bad_alignments[0]); i++)
+		if (!smplwav_serialise_plan_aligned(&plan, wav, 1, NULL, bad_alignments[i]))
+			test_fail("aligned: variant %u accepted %u byte alignment", variant, (unsigned)bad_alignments[i]);
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned char       audio[MAX_FILE_SIZE];
+	static struct wave_storage source;
+	unsigned                   variant;
+
+	(void)argc;
+	(void)argv;
+
+	for (variant = 0; variant < NB_VARIANTS; variant++) {
+		struct smplwav *wav = init_wave(&source);
+		build_wave(wav, variant, audio);
+		test_memory(wav, variant);
+		test_plan(wav, variant);
+		test_segments(wav, variant);
+		test_large_rf64(wav, variant);
+		test_patch(wav, variant, 0);
+		test_patch(wav, variant, 1);
+		test_aligned(wav, variant);
+	}
+
+	return test_result();
+}
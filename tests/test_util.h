@@ -0,0 +1,101 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#ifndef SMPLWAV_TEST_UTIL_H
+#define SMPLWAV_TEST_UTIL_H
+
+#include "smplwav/smplwav.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Helpers shared by the test programs. Every test is deterministic: random
+ * data comes from a fixed linear congruential generator. */
+
+static uint_fast32_t test_rng_state = 1;
+static unsigned      test_failures  = 0;
+
+static COP_ATTR_UNUSED uint_fast32_t test_rng(void)
+{
+	test_rng_state = (test_rng_state * 1664525u + 1013904223u) & 0xFFFFFFFFu;
+	return test_rng_state >> 8;
+}
+
+/* A float in [-range, range] with a fair number of values at exactly 0 and
+ * +/-1 which sit on the clipping boundaries. */
+static COP_ATTR_UNUSED float test_random_float(float range)
+{
+	switch (test_rng() % 16) {
+		case 0:  return 0.0f;
+		case 1:  return 1.0f;
+		case 2:  return -1.0f;
+		default: return (float)(((double)test_rng() / (double)0x800000) * 2.0 - 1.0) * range;
+	}
+}
+
+/* Fills "size" bytes with interleaved samples in the given format. */
+static COP_ATTR_UNUSED void test_random_samples(unsigned char *dest, size_t size, int format)
+{
+	size_t i;
+	if (format == SMPLWAV_FORMAT_FLOAT32) {
+		for (i = 0; i + 4 <= size; i += 4) {
+			float f = test_random_float(1.5f);
+			memcpy(dest + i, &f, 4);
+		}
+	} else {
+		for (i = 0; i < size; i++)
+			dest[i] = (unsigned char)test_rng();
+	}
+}
+
+static COP_ATTR_UNUSED void *test_malloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+	if (p == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+/* Records a failure. Only the first few are printed. */
+static COP_ATTR_UNUSED void test_fail(const char *fmt, ...)
+{
+	if (test_failures++ < 20) {
+		va_list args;
+		va_start(args, fmt);
+		vfprintf(stderr, fmt, args);
+		va_end(args);
+		fputc('\n', stderr);
+	}
+}
+
+/* The exit status of a test program. */
+static COP_ATTR_UNUSED int test_result(void)
+{
+	if (test_failures) {
+		fprintf(stderr, "%u failures\n", test_failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+#endif /* SMPLWAV_TEST_UTIL_H */
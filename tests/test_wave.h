@@ -0,0 +1,263 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef SMPLWAV_TEST_WAVE_H
+#define SMPLWAV_TEST_WAVE_H
+
+#include "smplwav/smplwav_mount.h"
+#include "smplwav/smplwav_serialise.h"
+#include "test_util.h"
+
+/* Helpers for the tests which build waves by hand, serialise them and mount
+ * the result. A wave is built from a variant number so every combination of
+ * format, metadata and markers which the tests care about is covered by
+ * looping over NB_VARIANTS variants. */
+
+#define NB_VARIANTS   (48)
+#define MAX_MARKERS   (64)
+#define MAX_CHUNKS    (32)
+#define MAX_FILE_SIZE (65536)
+
+/* Empty strings are not written to files so none are used here. */
+static char TEST_STRINGS[][48] =
+	{"Piano C4"
+	,"a"
+	,"x y"
+	,"An odd length string"
+	,"An even length string."
+	,"0123456789012345678901234567890123456789"
+	};
+#define NB_TEST_STRINGS (sizeof(TEST_STRINGS) / sizeof(TEST_STRINGS[0]))
+
+static unsigned char TEST_BEXT_BODY[5] = {'b', 'e', 'x', 't', '!'};
+
+static COP_ATTR_UNUSED void st_le32(unsigned char *p, uint_fast64_t v)
+{
+	p[0] = (unsigned char)(v);
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+static COP_ATTR_UNUSED void st_le64(unsigned char *p, uint_fast64_t v)
+{
+	st_le32(p, v & 0xFFFFFFFFu);
+	st_le32(p + 4, v >> 32);
+}
+
+static COP_ATTR_UNUSED uint_fast32_t ld_le32(const unsigned char *p)
+{
+	return ((uint_fast32_t)p[0]) | (((uint_fast32_t)p[1]) << 8) | (((uint_fast32_t)p[2]) << 16) | (((uint_fast32_t)p[3]) << 24);
+}
+
+static COP_ATTR_UNUSED char *test_random_string(void)
+{
+	return TEST_STRINGS[test_rng() % NB_TEST_STRINGS];
+}
+
+/* Builds a wave in "wav" (which must have had its storage set) using "audio"
+ * to hold its samples. "audio" must have room for MAX_FILE_SIZE bytes. */
+static COP_ATTR_UNUSED void build_wave(struct smplwav *wav, unsigned variant, unsigned char *audio)
+{
+	unsigned i;
+	unsigned nb_marker = variant % 11;
+	size_t   audio_size;
+
+	for (i = 0; i < SMPLWAV_NB_INFO_TAGS; i++)
+		wav->info[i] = NULL;
+	if (variant % 3)
+		wav->info[SMPLWAV_INFO_INAM] = test_random_string();
+	if (variant % 5 == 1)
+		wav->info[SMPLWAV_INFO_ICMT] = test_random_string();
+
+	wav->has_pitch_info = variant % 2;
+	wav->pitch_info     = wav->has_pitch_info ? ((((uint_fast64_t)60) << 32) | (test_rng() & 0xFFFFFFu)) : 0;
+
+	wav->format.format          = variant % 4;
+	wav->format.channels        = 1 + variant % 3;
+	wav->format.bits_per_sample = 8 * smplwav_format_container_size(wav->format.format);
+	wav->format.sample_rate     = (variant % 2) ? 44100 : 48000;
+
+	wav->data_frames = 200 + 7 * variant;
+	wav->data        = audio;
+	audio_size       = wav->data_frames * wav->format.channels * smplwav_format_container_size(wav->format.format);
+	test_random_samples(audio, audio_size, wav->format.format);
+
+	/* Positions are distinct so the order of the markers after sorting does
+	 * not depend on anything else. */
+	wav->nb_marker = nb_marker;
+	for (i = 0; i < nb_marker; i++) {
+		struct smplwav_marker *m = wav->markers + i;
+		m->id       = 0;
+		m->in_cue   = 0;
+		m->in_smpl  = 0;
+		m->has_ltxt = 0;
+		m->position = (uint_fast32_t)((i * wav->data_frames) / nb_marker + test_rng() % 3);
+		m->length   = (i % 2) ? (1 + test_rng() % (wav->data_frames - m->position)) : 0;
+		m->name     = (test_rng() % 3) ? test_random_string() : NULL;
+		m->desc     = (test_rng() % 4 == 0) ? test_random_string() : NULL;
+	}
+	smplwav_sort_markers(wav);
+
+	/* Loops are stored in a smpl chunk which always carries pitch
+	 * information. */
+	if (nb_marker > 1)
+		wav->has_pitch_info = 1;
+
+	wav->nb_unsupported = 0;
+	if (variant % 4 == 3) {
+		wav->unsupported[0].id   = SMPLWAV_RIFF_ID('b', 'e', 'x', 't');
+		wav->unsupported[0].size = sizeof(TEST_BEXT_BODY);
+		wav->unsupported[0].data = TEST_BEXT_BODY;
+		wav->nb_unsupported      = 1;
+	}
+}
+
+static COP_ATTR_UNUSED int same_string(const char *a, const char *b)
+{
+	return (a == NULL || b == NULL) ? (a == b) : !strcmp(a, b);
+}
+
+/* Patching leaves padding chunks behind which are reported as unsupported
+ * chunks. Returns the index of the next other chunk from "i". */
+static COP_ATTR_UNUSED unsigned skip_padding(const struct smplwav *wav, unsigned i)
+{
+	while   (   i < wav->nb_unsupported
+	        &&  (   wav->unsupported[i].id == SMPLWAV_RIFF_ID('J', 'U', 'N', 'K')
+	            ||  wav->unsupported[i].id == SMPLWAV_RIFF_ID('j', 'u', 'n', 'k')
+	            ||  wav->unsupported[i].id == SMPLWAV_RIFF_ID('P', 'A', 'D', ' ')
+	            )
+	        )
+		i++;
+	return i;
+}
+
+/* Compares everything which is stored in a file. The audio is only compared
+ * if both waves have it in memory. */
+static COP_ATTR_UNUSED int same_wave(const struct smplwav *a, const struct smplwav *b)
+{
+	unsigned i;
+	unsigned j;
+
+	if  (   a->format.format != b->format.format
+	    ||  a->format.channels != b->format.channels
+	    ||  a->format.sample_rate != b->format.sample_rate
+	    ||  a->format.bits_per_sample != b->format.bits_per_sample
+	    ||  a->data_frames != b->data_frames
+	    ||  a->has_pitch_info != b->has_pitch_info
+	    ||  (a->has_pitch_info && a->pitch_info != b->pitch_info)
+	    ||  a->nb_marker != b->nb_marker
+	    )
+		return 0;
+
+	if (a->data != NULL && b->data != NULL && memcmp(a->data, b->data, a->data_frames * a->format.channels * smplwav_format_container_size(a->format.format)))
+		return 0;
+
+	for (i = 0; i < SMPLWAV_NB_INFO_TAGS; i++)
+		if (!same_string(a->info[i], b->info[i]))
+			return 0;
+
+	for (i = 0; i < a->nb_marker; i++) {
+		const struct smplwav_marker *x = a->markers + i;
+		const struct smplwav_marker *y = b->markers + i;
+		if  (   x->position != y->position
+		    ||  x->length != y->length
+		    ||  !same_string(x->name, y->name)
+		    ||  !same_string(x->desc, y->desc)
+		    )
+			return 0;
+	}
+
+	for (i = skip_padding(a, 0), j = skip_padding(b, 0); i < a->nb_unsupported && j < b->nb_unsupported; i = skip_padding(a, i + 1), j = skip_padding(b, j + 1)) {
+		const struct smplwav_extra_ck *x = a->unsupported + i;
+		const struct smplwav_extra_ck *y = b->unsupported + j;
+		if (x->id != y->id || x->size != y->size || memcmp(x->data, y->data, x->size))
+			return 0;
+	}
+
+	return i == a->nb_unsupported && j == b->nb_unsupported;
+}
+
+struct wave_storage {
+	struct smplwav          wav;
+	struct smplwav_marker   markers[MAX_MARKERS];
+	struct smplwav_extra_ck unsupported[MAX_CHUNKS];
+};
+
+static COP_ATTR_UNUSED struct smplwav *init_wave(struct wave_storage *s)
+{
+	smplwav_set_storage(&s->wav, s->markers, MAX_MARKERS, s->unsupported, MAX_CHUNKS);
+	return &s->wav;
+}
+
+/* Mounts "size" bytes of "buf" into "s". The markers are sorted so they can
+ * be compared with a wave built by build_wave(). Returns NULL on failure. */
+static COP_ATTR_UNUSED struct smplwav *mount_wave(struct wave_storage *s, unsigned char *buf, size_t size)
+{
+	struct smplwav *wav = init_wave(s);
+	if (SMPLWAV_ERROR_CODE(smplwav_mount_memory(wav, buf, size, SMPLWAV_MOUNT_PRESERVE_UNKNOWN)))
+		return NULL;
+	smplwav_sort_markers(wav);
+	return wav;
+}
+
+/* Serialises "wav" into "buf" which has room for MAX_FILE_SIZE bytes. */
+static COP_ATTR_UNUSED int serialise_wave(const struct smplwav *wav, unsigned char *buf, size_t *size, int store_cue_loops)
+{
+	if (smplwav_serialise(wav, NULL, size, store_cue_loops) || *size > MAX_FILE_SIZE)
+		return 1;
+	return smplwav_serialise(wav, buf, size, store_cue_loops);
+}
+
+/* Rewrites a serialised RIFF file as an RF64 file by adding a ds64 chunk
+ * after the header and setting the 32-bit sizes of the form and the data
+ * chunk to 0xFFFFFFFF. "dest" needs 36 bytes more than "size". */
+static COP_ATTR_UNUSED size_t make_rf64(unsigned char *dest, const unsigned char *src, size_t size, uint_fast64_t data_frames)
+{
+	size_t        pos       = 12;
+	size_t        out       = 48;
+	uint_fast64_t data_size = 0;
+
+	while (pos + 8 <= size) {
+		uint_fast32_t ck_sz = ld_le32(src + pos + 4);
+		size_t        total = 8 + ck_sz + (ck_sz & 1);
+		memcpy(dest + out, src + pos, total);
+		if (!memcmp(src + pos, "data", 4)) {
+			data_size = ck_sz;
+			st_le32(dest + out + 4, 0xFFFFFFFFu);
+		}
+		pos += total;
+		out += total;
+	}
+
+	memcpy(dest, "RF64", 4);
+	st_le32(dest + 4, 0xFFFFFFFFu);
+	memcpy(dest + 8, "WAVE", 4);
+	memcpy(dest + 12, "ds64", 4);
+	st_le32(dest + 16, 28);
+	st_le64(dest + 20, out - 8);
+	st_le64(dest + 28, data_size);
+	st_le64(dest + 36, data_frames);
+	st_le32(dest + 44, 0);
+	return out;
+}
+
+#endif /* SMPLWAV_TEST_WAVE_H */